@@ -0,0 +1,106 @@
+#include "arena.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+constexpr size_t ScratchArena::kAlignment;
+
+namespace
+{
+
+// The smallest block worth having
+const size_t kMinBlock = 64 * 1024;
+
+size_t roundUp( size_t bytes )
+{
+    return ( bytes + ScratchArena::kAlignment - 1 ) / ScratchArena::kAlignment
+        * ScratchArena::kAlignment;
+}
+
+} // namespace
+
+ScratchArena& ScratchArena::forThread()
+{
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+void* ScratchArena::allocateBytes( size_t bytes )
+{
+    bytes = roundUp( std::max<size_t>( bytes, 1 ) );
+    if ( m_block == 0 && m_used == 0 && m_blocks.size() > 1 )
+    {
+        // Empty, so one block the size of them all will do from now on
+        const size_t total = getCapacity();
+        m_blocks.clear();
+        addBlock( total );
+    }
+    if ( m_blocks.empty() )
+    {
+        addBlock( std::max( bytes, kMinBlock ) );
+    }
+    else if ( m_used + bytes > m_blocks[m_block].size )
+    {
+        // Any blocks past this one are free, but too small to be sure of
+        m_blocks.resize( m_block + 1 );
+        addBlock( std::max( bytes, getCapacity() ) );
+        m_block = m_blocks.size() - 1;
+        m_used = 0;
+    }
+    void* p = m_blocks[m_block].data.get() + m_used;
+    m_used += bytes;
+    return p;
+}
+
+BitmapView ScratchArena::allocateBitmap( size_t width, size_t height, size_t pixelSize )
+{
+    const size_t stride = Bitmap::strideFor( width, pixelSize );
+    BitmapView view{ allocate<uint8_t>( stride * height ), width, height, pixelSize, stride };
+    const size_t rowSize = width * pixelSize;
+    for ( size_t y = 0; y < height; ++y )
+    {
+        std::memset( view.row( y ) + rowSize, 0, stride - rowSize );
+    }
+    return view;
+}
+
+size_t ScratchArena::getCapacity() const
+{
+    size_t total = 0;
+    for ( const Block& block : m_blocks )
+    {
+        total += block.size;
+    }
+    return total;
+}
+
+void ScratchArena::release()
+{
+    m_blocks.clear();
+    m_block = 0;
+    m_used = 0;
+}
+
+void ScratchArena::addBlock( size_t size )
+{
+    void* p = nullptr;
+    if ( ::posix_memalign( &p, kAlignment, size ) != 0 )
+    {
+        throw std::bad_alloc();
+    }
+    std::unique_ptr<uint8_t[], FreeDeleter> data( static_cast<uint8_t*>( p ) );
+    m_blocks.push_back( Block{ std::move( data ), size } );
+    ++m_heapAllocations;
+    MARENGO_TRACE_COUNT( "arena.allocated", size );
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "bitmap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Scratch memory for the buffers an operation only needs while it
+        // runs (a grayscale copy, running totals, libjpeg's row pointers),
+        // handed out by bumping an offset, so once the arena has grown to
+        // what a frame needs, later frames take nothing from the heap.
+        //
+        // Each thread has its own; an operation opens a Scope on it, and
+        // everything allocated since goes back when the Scope does. Scopes
+        // nest, so an operation can call another. Nothing is freed until
+        // release(): the memory is there for the next frame.
+        //
+        // If a frame needs more than the arena has, another block is added
+        // (so what was handed out stays put). The next time the arena is
+        // empty, the blocks are swapped for one big enough for them all.
+        class ScratchArena
+        {
+        public:
+            static constexpr size_t kAlignment = Bitmap::kAlignment;
+
+            ScratchArena() = default;
+            ScratchArena( const ScratchArena& ) = delete;
+            ScratchArena& operator=( const ScratchArena& ) = delete;
+
+            // The calling thread's
+            static ScratchArena& forThread();
+
+            // count Ts, kAlignment aligned and uninitialised. T must not
+            // need constructing or destroying.
+            template <typename T>
+            T* allocate( size_t count )
+            {
+                return static_cast<T*>( allocateBytes( count * sizeof( T ) ) );
+            }
+
+            // Rows laid out as in a Bitmap of the same size, slack zeroed
+            BitmapView allocateBitmap( size_t width, size_t height, size_t pixelSize );
+
+            // Everything allocated since it was made goes back when it goes
+            class Scope
+            {
+            public:
+                explicit Scope( ScratchArena& arena )
+                    : m_arena( arena )
+                    , m_block( arena.m_block )
+                    , m_used( arena.m_used )
+                {
+                }
+                ~Scope()
+                {
+                    m_arena.m_block = m_block;
+                    m_arena.m_used = m_used;
+                }
+
+                Scope( const Scope& ) = delete;
+                Scope& operator=( const Scope& ) = delete;
+
+            private:
+                ScratchArena& m_arena;
+                size_t m_block;
+                size_t m_used;
+            };
+
+            // Bytes held, in use or not
+            size_t getCapacity() const;
+
+            // Times the arena has gone to the heap, which stops going up
+            // once it has grown to what is needed
+            size_t getHeapAllocations() const { return m_heapAllocations; }
+
+            // Frees everything. Only when no Scope is open.
+            void release();
+
+        private:
+            void* allocateBytes( size_t bytes );
+
+            struct FreeDeleter
+            {
+                void operator()( uint8_t* p ) const { std::free( p ); }
+            };
+            struct Block
+            {
+                std::unique_ptr<uint8_t[], FreeDeleter> data;
+                size_t size;
+            };
+
+            void addBlock( size_t size );
+
+            std::vector<Block> m_blocks;
+            // Where the next allocation goes: m_used bytes into m_block
+            size_t m_block = 0;
+            size_t m_used = 0;
+            size_t m_heapAllocations = 0;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,393 @@
+#include "bands.h"
+#include "kernels.h"
+#include "palette.h"
+#include "scanline.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+size_t pageSize()
+{
+    static const size_t size = static_cast<size_t>( ::sysconf( _SC_PAGESIZE ) );
+    return size;
+}
+
+std::string scratchDirectory( const std::string& dir )
+{
+    if ( ! dir.empty() )
+    {
+        return dir;
+    }
+    const char* tmp = std::getenv( "TMPDIR" );
+    return tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+}
+
+} // namespace
+
+ScratchFile::ScratchFile( size_t size, const std::string& dir )
+    : m_data( nullptr )
+    , m_size( size )
+{
+    if ( size == 0 )
+    {
+        return;
+    }
+    std::string path = scratchDirectory( dir ) + "/jpeg-scratch-XXXXXX";
+    const int fd = ::mkstemp( &path[0] );
+    if ( fd < 0 )
+    {
+        throw std::runtime_error(
+            "Could not create a scratch file in " + scratchDirectory( dir )
+            + ": " + std::strerror( errno ) );
+    }
+    ::unlink( path.c_str() );
+    if ( ::ftruncate( fd, static_cast<off_t>( size ) ) != 0 )
+    {
+        const int err = errno;
+        ::close( fd );
+        throw std::runtime_error(
+            "Could not size scratch file: " + std::string( std::strerror( err ) ) );
+    }
+    void* p = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    const int err = errno;
+    ::close( fd ); // the mapping keeps it open
+    if ( p == MAP_FAILED )
+    {
+        throw std::runtime_error(
+            "Could not map scratch file: " + std::string( std::strerror( err ) ) );
+    }
+    m_data = static_cast<uint8_t*>( p );
+}
+
+ScratchFile::~ScratchFile()
+{
+    if ( m_data != nullptr )
+    {
+        ::munmap( m_data, m_size );
+    }
+}
+
+void ScratchFile::release( size_t offset, size_t length )
+{
+    // Whole pages only; any part of a page either side is simply read
+    // back in if it is wanted
+    const size_t page = pageSize();
+    const size_t begin = offset / page * page;
+    const size_t end = std::min( m_size, ( offset + length + page - 1 ) / page * page );
+    if ( m_data != nullptr && begin < end )
+    {
+        ::madvise( m_data + begin, end - begin, MADV_DONTNEED );
+    }
+}
+
+RowStore::RowStore( size_t width, size_t height, size_t pixelSize,
+                    const BandOptions& options )
+    : m_stride( Bitmap::strideFor( width, pixelSize ) )
+    , m_rowSize( width * pixelSize )
+{
+    if ( m_stride * height <= options.memoryBudget )
+    {
+        m_memory = Bitmap( width, height, pixelSize );
+        m_data = m_memory.getData();
+    }
+    else
+    {
+        m_file.reset( new ScratchFile( m_stride * height, options.scratchDir ) );
+        m_data = m_file->data();
+    }
+}
+
+void RowStore::release( size_t first, size_t count )
+{
+    if ( m_file != nullptr )
+    {
+        m_file->release( first * m_stride, count * m_stride );
+    }
+}
+
+RowSource::RowSource( size_t width, size_t height, size_t pixelSize,
+                      int colourSpace )
+    : m_width( width )
+    , m_height( height )
+    , m_pixelSize( pixelSize )
+    , m_colourSpace( colourSpace )
+{
+}
+
+const uint8_t* RowSource::next()
+{
+    if ( m_row >= m_height )
+    {
+        throw std::out_of_range( "Read past the last row" );
+    }
+    const uint8_t* row = produce();
+    ++m_row;
+    return row;
+}
+
+DecodeSource::DecodeSource( const std::string& fileName )
+    : DecodeSource( std::unique_ptr<ScanlineReader>( new ScanlineReader( fileName ) ) )
+{
+}
+
+DecodeSource::DecodeSource( std::unique_ptr<ScanlineReader> reader )
+    : RowSource( reader->getWidth(), reader->getHeight(),
+                 reader->getPixelSize(), reader->getColourSpace() )
+    , m_reader( std::move( reader ) )
+{
+    const size_t batch = std::max<size_t>( m_reader->getBatchRows(), 1 );
+    m_batch = Bitmap( getWidth(), batch, getPixelSize() );
+    for ( size_t i = 0; i < batch; ++i )
+    {
+        m_rows.push_back( m_batch.getRow( i ) );
+    }
+}
+
+DecodeSource::~DecodeSource()
+{
+}
+
+const uint8_t* DecodeSource::produce()
+{
+    if ( m_row >= m_batchFirst + m_batchCount )
+    {
+        m_batchFirst = m_row;
+        m_batchCount = m_reader->readRows( m_rows.data(), m_rows.size() );
+    }
+    return m_rows[ m_row - m_batchFirst ];
+}
+
+namespace
+{
+
+// Image::shrink()'s height for a source of height rows
+size_t shrunkHeight( size_t height, float scaleFactor )
+{
+    size_t newHeight = 0;
+    size_t oldRow = 0;
+    for ( size_t row = 0; row < height; ++row )
+    {
+        if ( static_cast<size_t>( scaleFactor * row ) > oldRow )
+        {
+            oldRow = scaleFactor * row;
+            ++newHeight;
+        }
+    }
+    return newHeight;
+}
+
+float shrinkFactor( const RowSource& source, size_t newWidth )
+{
+    if ( newWidth == 0 )
+    {
+        throw std::out_of_range( "New width cannot be zero" );
+    }
+    if ( newWidth >= source.getWidth() )
+    {
+        throw std::out_of_range( "ShrinkSource can only make rows narrower" );
+    }
+    const float scaleFactor = static_cast<float>( newWidth ) / source.getWidth();
+    if ( shrunkHeight( source.getHeight(), scaleFactor ) == 0 )
+    {
+        throw std::out_of_range( "New width leaves no rows" );
+    }
+    return scaleFactor;
+}
+
+} // namespace
+
+ShrinkSource::ShrinkSource( RowSource& source, size_t newWidth )
+    : RowSource( newWidth,
+                 shrunkHeight( source.getHeight(), shrinkFactor( source, newWidth ) ),
+                 source.getPixelSize(), source.getColourSpace() )
+    , m_source( source )
+    , m_scaleFactor( static_cast<float>( newWidth ) / source.getWidth() )
+    , m_totals( newWidth * source.getPixelSize() )
+    , m_counts( newWidth * source.getPixelSize() )
+    , m_out( newWidth * source.getPixelSize() )
+{
+}
+
+const uint8_t* ShrinkSource::produce()
+{
+    const size_t bytes = m_source.getWidth() * m_source.getPixelSize();
+    // As in Image::shrink(): every source row is totted up, and a row is
+    // emitted, taking in the row just added, when the scaled row moves on
+    for ( ;; )
+    {
+        const uint8_t* src = m_source.next();
+        const size_t row = m_sourceRow++;
+        for ( size_t col = 0; col < bytes; ++col )
+        {
+            size_t idx = m_scaleFactor * col;
+            m_totals[ idx ] += src[col];
+            ++m_counts[ idx ];
+        }
+        if ( static_cast<size_t>( m_scaleFactor * row ) > m_oldRow )
+        {
+            m_oldRow = m_scaleFactor * row;
+            for ( size_t i = 0; i < m_out.size(); ++i )
+            {
+                m_out[i] = m_totals[i] / m_counts[i];
+                m_totals[i] = 0;
+                m_counts[i] = 0;
+            }
+            return m_out.data();
+        }
+    }
+}
+
+ResampleSource::ResampleSource( RowSource& source, size_t width, size_t height,
+                                ResampleFilter filter, const BandOptions& options )
+    : RowSource( width, height, source.getPixelSize(), source.getColourSpace() )
+    , m_source( source )
+    , m_options( options )
+{
+    if ( width == 0 || height == 0 )
+    {
+        throw std::out_of_range( "Resampled size cannot be zero" );
+    }
+    m_across = resampleWeights( source.getWidth(), width, filter );
+    m_down = resampleWeights( source.getHeight(), height, filter );
+    m_window.resize( m_down.taps );
+    const size_t rowBytes = Bitmap::strideFor( width, getPixelSize() );
+    if ( rowBytes * m_down.taps <= options.memoryBudget )
+    {
+        m_ring.reset( new RowStore( width, m_down.taps, getPixelSize(), options ) );
+        m_out.resize( width * getPixelSize() );
+    }
+}
+
+const uint8_t* ResampleSource::produce()
+{
+    if ( m_ring != nullptr )
+    {
+        return produceFromRing();
+    }
+    if ( m_output == nullptr )
+    {
+        resampleInStrips();
+    }
+    if ( m_row > 0 )
+    {
+        m_output->release( m_row - 1, 1 );
+    }
+    return m_output->getRow( m_row );
+}
+
+const uint8_t* ResampleSource::produceFromRing()
+{
+    const size_t taps = m_down.taps;
+    const size_t first = m_down.first[ m_row ];
+    while ( m_sourced < first + taps )
+    {
+        resampleRow( m_source.next(), m_ring->getRow( m_sourced % taps ),
+                     getWidth(), getPixelSize(), m_across );
+        ++m_sourced;
+    }
+    for ( size_t t = 0; t < taps; ++t )
+    {
+        m_window[t] = m_ring->getRow( ( first + t ) % taps );
+    }
+    kernels::kernels().resampleRows( m_window.data(), &m_down.weights[ m_row * taps ],
+                                     taps, m_out.data(), m_out.size() );
+    return m_out.data();
+}
+
+void ResampleSource::resampleInStrips()
+{
+    const size_t pixelSize = getPixelSize();
+    const size_t sourceHeight = m_source.getHeight();
+    const size_t taps = m_down.taps;
+
+    // Everything across first, out of memory as it goes
+    m_whole.reset( new RowStore( getWidth(), sourceHeight, pixelSize, m_options ) );
+    for ( size_t row = 0; row < sourceHeight; ++row )
+    {
+        resampleRow( m_source.next(), m_whole->getRow( row ), getWidth(),
+                     pixelSize, m_across );
+        m_whole->release( row, 1 );
+    }
+
+    // Then down, in strips whose taps rows fit in the budget. A strip is
+    // at least a page wide, as a page is what gets read in.
+    m_output.reset( new RowStore( getWidth(), getHeight(), pixelSize, m_options ) );
+    const size_t page = pageSize();
+    const size_t stripBytes = std::max(
+        page, m_options.memoryBudget / taps / page * page );
+    const kernels::Kernels& k = kernels::kernels();
+    const size_t rowBytes = getWidth() * pixelSize;
+    for ( size_t begin = 0; begin < rowBytes; begin += stripBytes )
+    {
+        const size_t bytes = std::min( stripBytes, rowBytes - begin );
+        size_t released = 0;
+        for ( size_t y = 0; y < getHeight(); ++y )
+        {
+            const size_t first = m_down.first[y];
+            for ( size_t t = 0; t < taps; ++t )
+            {
+                m_window[t] = m_whole->getRow( first + t ) + begin;
+            }
+            k.resampleRows( m_window.data(), &m_down.weights[ y * taps ], taps,
+                            m_output->getRow( y ) + begin, bytes );
+            m_output->release( y, 1 );
+            // Rows above this window aren't needed again for this strip
+            m_whole->release( released, first - released );
+            released = first;
+        }
+        m_whole->release( released, sourceHeight - released );
+    }
+    m_whole.reset();
+}
+
+DitherSource::DitherSource( RowSource& source, const Palette& palette,
+                            Dither method, Scan scan, Match match )
+    : RowSource( source.getWidth(), source.getHeight(), source.getPixelSize(),
+                 source.getColourSpace() )
+    , m_source( source )
+    , m_ditherer( source.getWidth(), palette, method, scan, match )
+    , m_out( source.getWidth() * 3 )
+{
+    if ( source.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "dither needs an RGB image" );
+    }
+}
+
+const uint8_t* DitherSource::produce()
+{
+    m_ditherer.ditherRow( m_source.next(), m_out.data() );
+    return m_out.data();
+}
+
+void writeJpeg( RowSource& source, const std::string& fileName, int quality )
+{
+    if ( source.getScanline() != 0 )
+    {
+        throw std::logic_error( "writeJpeg needs all of the rows" );
+    }
+    ScanlineWriter writer( fileName, source.getWidth(), source.getHeight(),
+                           source.getPixelSize(), source.getColourSpace(),
+                           quality );
+    for ( size_t row = 0; row < source.getHeight(); ++row )
+    {
+        writer.writeRow( source.next() );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "bitmap.h"
+#include "dither.h"
+#include "resample.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Palette;
+        class ScanlineReader;
+
+        // Processing for images too big to hold, as Image does, in memory.
+        //
+        // Each stage is a RowSource which hands out its rows top to bottom
+        // and pulls what it needs from the stage before, so a chain such as
+        //
+        //   DecodeSource decode( "poster.jpg" );
+        //   ShrinkSource shrink( decode, 2000 );
+        //   DitherSource dither( shrink, palette, Dither::FloydSteinberg );
+        //   writeJpeg( dither, "small.jpg" );
+        //
+        // only ever holds a few rows of each stage. Stages which need
+        // more than that (ResampleSource, when shrinking a long way) keep
+        // their rows in memory up to options.memoryBudget, and past that in
+        // a ScratchFile, so memory use is bounded whatever the image size.
+
+        struct BandOptions
+        {
+            // Bytes of rows any one stage may keep in memory
+            size_t memoryBudget = size_t( 64 ) << 20;
+            // Where scratch files go; empty for $TMPDIR, or /tmp
+            std::string scratchDir;
+        };
+
+        // A temporary file mapped into memory. It is unlinked as soon as
+        // it is made, so it goes away with the process, however that ends.
+        // Its pages are the kernel's to write out and drop when memory is
+        // short, and release() drops them straight away.
+        // Will throw if the file can't be made or mapped.
+        class ScratchFile
+        {
+        public:
+            ScratchFile( size_t size, const std::string& dir );
+            ~ScratchFile();
+
+            ScratchFile( const ScratchFile& ) = delete;
+            ScratchFile& operator=( const ScratchFile& ) = delete;
+
+            uint8_t* data() { return m_data; }
+            size_t size() const { return m_size; }
+
+            // Takes bytes [offset, offset + length) out of memory. They
+            // keep their contents, which are read back in when next used.
+            void release( size_t offset, size_t length );
+
+        private:
+            uint8_t* m_data;
+            size_t m_size;
+        };
+
+        // A block of rows laid out as a Bitmap would be (aligned, padded
+        // rows), which is a Bitmap when it fits in the memory budget and
+        // a ScratchFile when it doesn't.
+        class RowStore
+        {
+        public:
+            RowStore( size_t width, size_t height, size_t pixelSize,
+                      const BandOptions& options );
+
+            uint8_t* getRow( size_t y ) { return m_data + y * m_stride; }
+            size_t getRowSize() const { return m_rowSize; }
+            bool onDisk() const { return m_file != nullptr; }
+
+            // Done with rows [first, first + count) for now: if they are
+            // on disk, they are taken out of memory
+            void release( size_t first, size_t count );
+
+        private:
+            Bitmap m_memory;
+            std::unique_ptr<ScratchFile> m_file;
+            uint8_t* m_data;
+            size_t m_stride;
+            size_t m_rowSize;
+        };
+
+        class RowSource
+        {
+        public:
+            virtual ~RowSource() {}
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getPixelSize() const { return m_pixelSize; }
+            int getColourSpace() const { return m_colourSpace; }
+
+            // How many rows have been handed out so far
+            size_t getScanline() const { return m_row; }
+
+            // The next row, which stays put until the next call. Will throw
+            // once every row has been handed out.
+            const uint8_t* next();
+
+        protected:
+            RowSource( size_t width, size_t height, size_t pixelSize,
+                       int colourSpace );
+
+            // Row m_row, which next() has already checked is there
+            virtual const uint8_t* produce() = 0;
+
+            size_t m_row = 0;
+
+        private:
+            size_t m_width;
+            size_t m_height;
+            size_t m_pixelSize;
+            int m_colourSpace;
+        };
+
+        // A JPEG file's rows as libjpeg decodes them, a batch at a time
+        class DecodeSource : public RowSource
+        {
+        public:
+            explicit DecodeSource( const std::string& fileName );
+            ~DecodeSource();
+
+        private:
+            explicit DecodeSource( std::unique_ptr<ScanlineReader> reader );
+
+            const uint8_t* produce() override;
+
+            std::unique_ptr<ScanlineReader> m_reader;
+            Bitmap m_batch;
+            std::vector<uint8_t*> m_rows;
+            size_t m_batchFirst = 0;
+            size_t m_batchCount = 0;
+        };
+
+        // The same rows as Image::shrink( newWidth ) gives, worked out the
+        // same way (a running total per output pixel), so with nothing but
+        // a row of totals. Will throw in the same cases.
+        class ShrinkSource : public RowSource
+        {
+        public:
+            ShrinkSource( RowSource& source, size_t newWidth );
+
+        private:
+            const uint8_t* produce() override;
+
+            RowSource& m_source;
+            float m_scaleFactor;
+            size_t m_sourceRow = 0;
+            size_t m_oldRow = 0;
+            std::vector<size_t> m_totals;
+            std::vector<size_t> m_counts;
+            std::vector<uint8_t> m_out;
+        };
+
+        // Resampling as Image::resample() does it, but always across first
+        // (so it can be done as rows come in), where resample() goes
+        // whichever way is less work; the two orders round slightly
+        // differently. Each output row is a weighted sum of the taps rows
+        // under it.
+        //
+        // If taps of those rows fit in the budget they are kept in a ring
+        // in memory. Otherwise every row goes to a RowStore, i.e. a scratch
+        // file, which is then resampled down in strips of columns narrow
+        // enough for their taps rows to fit, into another RowStore the
+        // rows are then handed out from.
+        class ResampleSource : public RowSource
+        {
+        public:
+            ResampleSource( RowSource& source, size_t width, size_t height,
+                            ResampleFilter filter, const BandOptions& options );
+
+            // Whether the rows went to scratch files
+            bool onDisk() const { return m_output != nullptr; }
+
+        private:
+            const uint8_t* produce() override;
+            const uint8_t* produceFromRing();
+            void resampleInStrips();
+
+            RowSource& m_source;
+            BandOptions m_options;
+            ResampleWeights m_across;
+            ResampleWeights m_down;
+            // The ring: sourced row r in slot r % taps
+            std::unique_ptr<RowStore> m_ring;
+            size_t m_sourced = 0;
+            std::vector<const uint8_t*> m_window;
+            std::vector<uint8_t> m_out;
+            // Or in strips: all the rows across, then all the rows out
+            std::unique_ptr<RowStore> m_whole;
+            std::unique_ptr<RowStore> m_output;
+        };
+
+        // Rows dithered by a RowDitherer (see dither.h)
+        class DitherSource : public RowSource
+        {
+        public:
+            DitherSource( RowSource& source, const Palette& palette,
+                          Dither method, Scan scan = Scan::Raster,
+                          Match match = Match::Redmean );
+
+        private:
+            const uint8_t* produce() override;
+
+            RowSource& m_source;
+            RowDitherer m_ditherer;
+            std::vector<uint8_t> m_out;
+        };
+
+        // Encodes source's rows into fileName, as they come. Will throw if
+        // any have already been taken.
+        void writeJpeg( RowSource& source, const std::string& fileName,
+                        int quality = 95 );
+
+    } // namespace jpeg
+} // namespace marengo
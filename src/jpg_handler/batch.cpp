@@ -0,0 +1,243 @@
+#include "batch.h"
+#include "palette.h"
+#include "workpool.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+bool hasJpegExtension( const std::string& name )
+{
+    const size_t dot = name.rfind( '.' );
+    if ( dot == std::string::npos )
+    {
+        return false;
+    }
+    std::string ext = name.substr( dot + 1 );
+    std::transform( ext.begin(), ext.end(), ext.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    return ext == "jpg" || ext == "jpeg";
+}
+
+std::string baseName( const std::string& path )
+{
+    const size_t slash = path.rfind( '/' );
+    return slash == std::string::npos ? path : path.substr( slash + 1 );
+}
+
+// Reads the whole file into buffer, keeping its capacity
+void readFile( const std::string& fileName, std::vector<uint8_t>& buffer )
+{
+    std::ifstream ifs( fileName, std::ios::in | std::ios::binary | std::ios::ate );
+    if ( ! ifs )
+    {
+        throw std::runtime_error( "Could not open " + fileName );
+    }
+    buffer.resize( static_cast<size_t>( ifs.tellg() ) );
+    ifs.seekg( 0 );
+    ifs.read( reinterpret_cast<char*>( buffer.data() ), buffer.size() );
+    if ( ! ifs )
+    {
+        throw std::runtime_error( "Could not read " + fileName );
+    }
+}
+
+void writeFile( const std::string& fileName, const std::vector<uint8_t>& data )
+{
+    std::ofstream ofs( fileName, std::ios::out | std::ios::binary );
+    ofs.write( reinterpret_cast<const char*>( data.data() ), data.size() );
+    ofs.close();
+    if ( ! ofs )
+    {
+        throw std::runtime_error( "Could not write " + fileName );
+    }
+}
+
+bool sameFile( const std::string& a, const std::string& b )
+{
+    struct stat sa;
+    struct stat sb;
+    return ::stat( a.c_str(), &sa ) == 0 && ::stat( b.c_str(), &sb ) == 0
+        && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Everything one worker thread keeps from file to file
+struct Worker
+{
+    Decoder decoder;
+    Encoder encoder;
+    Image image;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    BatchStats stats;
+};
+
+} // namespace
+
+std::vector<std::string> listJpegs( const std::string& spec )
+{
+    std::vector<std::string> files;
+    struct stat st;
+    if ( ::stat( spec.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ) )
+    {
+        DIR* dir = ::opendir( spec.c_str() );
+        if ( dir == nullptr )
+        {
+            throw std::runtime_error( "Could not open " + spec );
+        }
+        while ( const ::dirent* entry = ::readdir( dir ) )
+        {
+            const std::string path = spec + "/" + entry->d_name;
+            struct stat est;
+            if ( hasJpegExtension( entry->d_name )
+                 && ::stat( path.c_str(), &est ) == 0 && S_ISREG( est.st_mode ) )
+            {
+                files.push_back( path );
+            }
+        }
+        ::closedir( dir );
+        std::sort( files.begin(), files.end() );
+    }
+    else if ( spec.find_first_of( "*?[" ) != std::string::npos )
+    {
+        ::glob_t matches;
+        const int rc = ::glob( spec.c_str(), 0, nullptr, &matches );
+        if ( rc == 0 )
+        {
+            files.assign( matches.gl_pathv, matches.gl_pathv + matches.gl_pathc );
+        }
+        ::globfree( &matches );
+        if ( rc != 0 && rc != GLOB_NOMATCH )
+        {
+            throw std::runtime_error( "Could not expand " + spec );
+        }
+    }
+    else
+    {
+        std::ifstream ifs( spec );
+        if ( ! ifs )
+        {
+            throw std::runtime_error( "Could not open " + spec );
+        }
+        std::string line;
+        while ( std::getline( ifs, line ) )
+        {
+            const size_t last = line.find_last_not_of( " \t\r" );
+            line.erase( last == std::string::npos ? 0 : last + 1 );
+            if ( ! line.empty() && line[0] != '#' )
+            {
+                files.push_back( line );
+            }
+        }
+    }
+    if ( files.empty() )
+    {
+        throw std::runtime_error( "No JPEG files in " + spec );
+    }
+    return files;
+}
+
+BatchStats runBatch( const std::vector<std::string>& inputs,
+                     const std::string& outDir,
+                     const Palette& palette,
+                     const LoadOptions& options,
+                     unsigned threads,
+                     int quality,
+                     EncodePreset preset )
+{
+    if ( ::mkdir( outDir.c_str(), 0777 ) != 0 && errno != EEXIST )
+    {
+        throw std::runtime_error(
+            "Could not create " + outDir + ": " + std::strerror( errno )
+            );
+    }
+    // Two inputs with one name (from different directories, or the same
+    // file listed twice) would be written to one output. The first keeps
+    // it; the rest fail, so it can't be overwritten as it is written.
+    std::vector<std::string> outputs( inputs.size() );
+    std::vector<size_t> firstWithName( inputs.size() );
+    {
+        std::unordered_map<std::string, size_t> named;
+        for ( size_t i = 0; i < inputs.size(); ++i )
+        {
+            outputs[i] = outDir + "/" + baseName( inputs[i] );
+            firstWithName[i] = named.emplace( outputs[i], i ).first->second;
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers( workerCount( inputs.size(), threads ) );
+    for ( auto& worker : workers )
+    {
+        worker.reset( new Worker );
+        worker->encoder.setPreset( preset );
+    }
+    std::mutex reportMutex;
+
+    const auto start = std::chrono::steady_clock::now();
+    runWorkStealing( inputs.size(), workers.size(),
+        [&]( unsigned self, size_t task )
+        {
+            Worker& w = *workers[self];
+            const std::string& input = inputs[task];
+            const std::string& output = outputs[task];
+            try
+            {
+                if ( firstWithName[task] != task )
+                {
+                    throw std::runtime_error( "would be saved to the same file as "
+                                              + inputs[firstWithName[task]] );
+                }
+                if ( sameFile( input, output ) )
+                {
+                    throw std::runtime_error( "would be saved over itself" );
+                }
+                readFile( input, w.in );
+                w.decoder.decode( w.in.data(), w.in.size(), w.image, options );
+                w.image.fsdColor( palette );
+                w.encoder.encode( w.image, w.out, quality );
+                writeFile( output, w.out );
+                ++w.stats.images;
+                w.stats.megapixels += w.image.getWidth() * w.image.getHeight() / 1e6;
+            }
+            catch ( const std::exception& e )
+            {
+                ++w.stats.failed;
+                std::lock_guard<std::mutex> lock( reportMutex );
+                std::cerr << input << ": " << e.what() << "\n";
+            }
+        } );
+
+    BatchStats total;
+    total.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start ).count();
+    for ( const auto& worker : workers )
+    {
+        total.images += worker->stats.images;
+        total.failed += worker->stats.failed;
+        total.megapixels += worker->stats.megapixels;
+    }
+    return total;
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "jpeg.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Palette;
+
+        // The JPEG files spec stands for, in order:
+        // - a directory: every .jpg / .jpeg in it (not subdirectories),
+        // - a pattern with * ? or [ in it: whatever glob(3) matches,
+        // - anything else: a manifest, one file name per line (blank lines
+        //   and lines starting with '#' skipped).
+        // Will throw if spec matches nothing or cannot be read.
+        std::vector<std::string> listJpegs( const std::string& spec );
+
+        struct BatchStats
+        {
+            size_t images = 0; // done
+            size_t failed = 0; // couldn't be loaded, dithered or saved
+            double megapixels = 0; // dithered, over all the images done
+            double seconds = 0;
+        };
+
+        // fsdColor()s every file in inputs into outDir, under the same
+        // name, spread over threads worker threads (0 for one per core)
+        // which steal files from each other as they run out (see
+        // workpool.h). Each worker keeps one Decoder, Encoder, Image and
+        // file buffers for all of its files, so after its first few files
+        // there is no per file set up left but opening them.
+        //
+        // A file which fails is reported on stderr and counted, and the
+        // batch carries on. Files which would be written over themselves
+        // fail rather than being overwritten, as do files with the same
+        // name as one before them in inputs (e.g. a/x.jpg then b/x.jpg),
+        // which would be saved to the same place. Outputs are encoded with
+        // preset.
+        BatchStats runBatch( const std::vector<std::string>& inputs,
+                             const std::string& outDir,
+                             const Palette& palette,
+                             const LoadOptions& options,
+                             unsigned threads,
+                             int quality = 95,
+                             EncodePreset preset = EncodePreset::Default );
+
+    } // namespace jpeg
+} // namespace marengo
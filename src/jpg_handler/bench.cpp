@@ -0,0 +1,260 @@
+// Times each Image operation on the bundled images, and on synthetic ones,
+// at a few sizes. Build with "make bench" and run from this directory:
+//
+//   ./bench [--reps <n>] [--quick] [<jpeg file> ...]
+//
+// Prints one tab separated line per image, size and stage, after a header
+// line naming the columns, so the output can go straight into a
+// spreadsheet or be diffed between runs and machines:
+//
+//   image  width  height  stage  reps  ns_per_pixel  mp_per_s  peak_rss_kb
+//
+// Times are the best of reps runs, per pixel of the image the stage starts
+// with (for decode, the one it comes out with).
+// peak_rss_kb is the most the process held during that stage, where the
+// kernel can reset the high water mark (Linux 4.0 and later); otherwise
+// it is the peak of the whole run so far.
+
+#include "jpeg.h"
+#include "palette.h"
+#include "scanline.h"
+#include "tjcodec.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <jpeglib.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using marengo::jpeg::Image;
+
+// Resets the peak RSS, if the kernel lets us
+void resetPeakRss()
+{
+    std::ofstream ofs( "/proc/self/clear_refs" );
+    ofs << "5";
+}
+
+long peakRssKb()
+{
+    std::ifstream ifs( "/proc/self/status" );
+    std::string line;
+    while ( std::getline( ifs, line ) )
+    {
+        if ( line.compare( 0, 6, "VmHWM:" ) == 0 )
+        {
+            return std::stol( line.substr( 6 ) );
+        }
+    }
+    ::rusage usage;
+    ::getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_maxrss;
+}
+
+struct Bench
+{
+    unsigned reps;
+    std::string tempDir;
+};
+
+// Runs setup then stage reps times, timing only stage, and prints the best
+void run( const Bench& bench, const std::string& name, size_t width,
+          size_t height, const char* stage,
+          const std::function<void()>& setup,
+          const std::function<void()>& work )
+{
+    double best = 0;
+    resetPeakRss();
+    for ( unsigned i = 0; i < bench.reps; ++i )
+    {
+        setup();
+        const auto start = std::chrono::steady_clock::now();
+        work();
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start ).count();
+        best = i == 0 ? seconds : std::min( best, seconds );
+    }
+    const double pixels = static_cast<double>( width ) * height;
+    std::cout << name << '\t' << width << '\t' << height << '\t' << stage
+              << '\t' << bench.reps << '\t' << best * 1e9 / pixels
+              << '\t' << pixels / best / 1e6 << '\t' << peakRssKb() << '\n';
+}
+
+// Every stage on fileName, decoded to width (0 for its own width)
+void benchFile( const Bench& bench, const std::string& name,
+                const std::string& fileName, size_t width )
+{
+    marengo::jpeg::LoadOptions options;
+    options.targetWidth = width;
+    Image source( fileName, options );
+    const size_t w = source.getWidth();
+    const size_t h = source.getHeight();
+    const marengo::jpeg::Palette& palette = marengo::jpeg::Palette::defaultPalette();
+    const std::string jpegOut = bench.tempDir + "/bench.jpg";
+    const std::string ppmOut = bench.tempDir + "/bench.ppm";
+
+    // Each stage works on a fresh deep copy, made outside the timing
+    std::unique_ptr<Image> img;
+    const auto copy = [&]() { img.reset( new Image( source, Image::CopyMode::Deep ) ); };
+    const auto nothing = []() {};
+
+    // Decode and encode through each codec there is, and with the fast
+    // DCT and upsampling
+    marengo::jpeg::LoadOptions fast = options;
+    fast.fastDct = true;
+    fast.fastUpsample = true;
+    marengo::jpeg::LoadOptions turbo = options;
+    turbo.codec = marengo::jpeg::Codec::TurboJpeg;
+    marengo::jpeg::LoadOptions turboFast = fast;
+    turboFast.codec = marengo::jpeg::Codec::TurboJpeg;
+    const bool haveTurbo = marengo::jpeg::tj::available();
+    std::vector<uint8_t> encoded;
+
+    run( bench, name, w, h, "decode", nothing,
+         [&]() { Image decoded( fileName, options ); } );
+    run( bench, name, w, h, "decode.fast", nothing,
+         [&]() { Image decoded( fileName, fast ); } );
+    if ( haveTurbo )
+    {
+        run( bench, name, w, h, "decode.turbo", nothing,
+             [&]() { Image decoded( fileName, turbo ); } );
+        run( bench, name, w, h, "decode.turbo.fast", nothing,
+             [&]() { Image decoded( fileName, turboFast ); } );
+    }
+    run( bench, name, w, h, "shrink", copy, [&]() { img->shrink( w / 2 ); } );
+    run( bench, name, w, h, "expand", copy, [&]() { img->expand( w * 2 ); } );
+    run( bench, name, w, h, "fsd", copy, [&]() { img->fsd(); } );
+    run( bench, name, w, h, "fsdColor", copy, [&]() { img->fsdColor( palette ); } );
+    run( bench, name, w, h, "save", nothing, [&]() { source.save( jpegOut ); } );
+    run( bench, name, w, h, "encode", nothing,
+         [&]() { source.saveToBuffer( encoded ); } );
+    marengo::jpeg::Encoder encoder;
+    encoder.setPreset( marengo::jpeg::EncodePreset::Fast );
+    run( bench, name, w, h, "encode.fast", nothing,
+         [&]() { encoder.encode( source, encoded ); } );
+    encoder.setPreset( marengo::jpeg::EncodePreset::Archive );
+    run( bench, name, w, h, "encode.archive", nothing,
+         [&]() { encoder.encode( source, encoded ); } );
+    if ( haveTurbo )
+    {
+        run( bench, name, w, h, "encode.turbo", nothing,
+             [&]() { source.saveToBuffer( encoded, 95, marengo::jpeg::Codec::TurboJpeg ); } );
+    }
+    run( bench, name, w, h, "savePpm", nothing, [&]() { source.savePpm( ppmOut ); } );
+    std::remove( jpegOut.c_str() );
+    std::remove( ppmOut.c_str() );
+}
+
+// A width x height JPEG of smooth gradients with some hash noise on top,
+// somewhere between a photo and a test card for the encoder
+std::string makeSynthetic( const Bench& bench, size_t width, size_t height )
+{
+    const std::string fileName = bench.tempDir + "/bench_synthetic_"
+        + std::to_string( width ) + "x" + std::to_string( height ) + ".jpg";
+    marengo::jpeg::ScanlineWriter writer( fileName, width, height, 3, JCS_RGB, 95 );
+    std::vector<uint8_t> row( width * 3 );
+    for ( size_t y = 0; y < height; ++y )
+    {
+        for ( size_t x = 0; x < width; ++x )
+        {
+            const uint32_t noise = ( ( x * 73856093u ) ^ ( y * 19349663u ) ) % 32;
+            row[x * 3] = static_cast<uint8_t>( x * 255 / width ^ noise );
+            row[x * 3 + 1] = static_cast<uint8_t>( y * 255 / height ^ noise );
+            row[x * 3 + 2] = static_cast<uint8_t>( ( x + y ) * 127 / ( width + height ) + noise );
+        }
+        writer.writeRow( row.data() );
+    }
+    return fileName;
+}
+
+std::string baseName( const std::string& path )
+{
+    const size_t slash = path.rfind( '/' );
+    return slash == std::string::npos ? path : path.substr( slash + 1 );
+}
+
+} // namespace
+
+int main( int argc, char* argv[] )
+{
+    Bench bench{ 5, "/tmp" };
+    bool quick = false;
+    std::vector<std::string> files;
+    for ( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        if ( arg == "--reps" && i + 1 < argc )
+        {
+            bench.reps = std::max( 1ul, std::stoul( argv[++i] ) );
+        }
+        else if ( arg == "--quick" )
+        {
+            // One run of each, and fewer sizes
+            quick = true;
+            bench.reps = 1;
+        }
+        else
+        {
+            files.push_back( arg );
+        }
+    }
+    if ( const char* tmp = std::getenv( "TMPDIR" ) )
+    {
+        bench.tempDir = tmp;
+    }
+    if ( files.empty() )
+    {
+        files = { "sample.jpg", "../../dali", "../../fili_perspectivo.jpg" };
+    }
+
+    try
+    {
+        std::cout << "image\twidth\theight\tstage\treps\tns_per_pixel\tmp_per_s\tpeak_rss_kb\n";
+        // Each file at its own size, and decoded down to a couple of
+        // common ones where it is bigger
+        const std::vector<size_t> widths = quick ? std::vector<size_t>{ 640 }
+                                                 : std::vector<size_t>{ 1920, 640 };
+        for ( const auto& file : files )
+        {
+            benchFile( bench, baseName( file ), file, 0 );
+            const size_t own = marengo::jpeg::ScanlineReader( file ).getWidth();
+            for ( size_t width : widths )
+            {
+                if ( width < own )
+                {
+                    benchFile( bench, baseName( file ), file, width );
+                }
+            }
+        }
+
+        std::vector<std::pair<size_t, size_t>> sizes{ { 640, 480 }, { 1920, 1080 } };
+        if ( ! quick )
+        {
+            sizes.push_back( { 3840, 2160 } );
+        }
+        for ( const auto& size : sizes )
+        {
+            const std::string synthetic = makeSynthetic( bench, size.first, size.second );
+            benchFile( bench, "synthetic", synthetic, 0 );
+            std::remove( synthetic.c_str() );
+        }
+    }
+    catch ( const std::exception& e )
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include "bitmap.h"
+#include "trace.h"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+constexpr size_t Bitmap::kAlignment;
+constexpr size_t Bitmap::kRowPadding;
+
+namespace
+{
+
+std::atomic<size_t> heapAllocations( 0 );
+
+} // namespace
+
+Bitmap::Bitmap()
+    : m_width( 0 )
+    , m_height( 0 )
+    , m_pixelSize( 0 )
+    , m_stride( 0 )
+    , m_capacity( 0 )
+{
+}
+
+Bitmap::Bitmap( size_t width, size_t height, size_t pixelSize )
+    : m_width( width )
+    , m_height( height )
+    , m_pixelSize( pixelSize )
+    , m_stride( strideFor( width, pixelSize ) )
+    , m_capacity( 0 )
+{
+    if ( width == 0 || height == 0 || pixelSize == 0 )
+    {
+        m_width = m_height = m_pixelSize = m_stride = 0;
+        return;
+    }
+    void* p = nullptr;
+    if ( ::posix_memalign( &p, kAlignment, m_stride * m_height ) != 0 )
+    {
+        throw std::bad_alloc();
+    }
+    m_data.reset( static_cast<uint8_t*>( p ) );
+    m_capacity = m_stride * m_height;
+    heapAllocations.fetch_add( 1, std::memory_order_relaxed );
+    MARENGO_TRACE_COUNT( "bitmap.allocated", m_capacity );
+    zeroSlack();
+}
+
+Bitmap::Bitmap( const Bitmap& rhs )
+    : Bitmap( rhs.m_width, rhs.m_height, rhs.m_pixelSize )
+{
+    if ( ! empty() )
+    {
+        std::memcpy( m_data.get(), rhs.m_data.get(), m_stride * m_height );
+        MARENGO_TRACE_COUNT( "bitmap.copied", m_stride * m_height );
+    }
+}
+
+Bitmap& Bitmap::operator=( const Bitmap& rhs )
+{
+    if ( this != &rhs )
+    {
+        Bitmap tmp( rhs );
+        swap( tmp );
+    }
+    return *this;
+}
+
+Bitmap::Bitmap( Bitmap&& rhs ) noexcept
+    : Bitmap()
+{
+    swap( rhs );
+}
+
+Bitmap& Bitmap::operator=( Bitmap&& rhs ) noexcept
+{
+    Bitmap tmp( std::move( rhs ) );
+    swap( tmp );
+    return *this;
+}
+
+Bitmap::~Bitmap()
+{
+}
+
+void Bitmap::swap( Bitmap& rhs ) noexcept
+{
+    std::swap( m_data, rhs.m_data );
+    std::swap( m_width, rhs.m_width );
+    std::swap( m_height, rhs.m_height );
+    std::swap( m_pixelSize, rhs.m_pixelSize );
+    std::swap( m_stride, rhs.m_stride );
+    std::swap( m_capacity, rhs.m_capacity );
+}
+
+void Bitmap::reset( size_t width, size_t height, size_t pixelSize )
+{
+    const size_t stride = strideFor( width, pixelSize );
+    if ( width == 0 || height == 0 || pixelSize == 0 || stride * height > m_capacity )
+    {
+        Bitmap( width, height, pixelSize ).swap( *this );
+        return;
+    }
+    m_width = width;
+    m_height = height;
+    m_pixelSize = pixelSize;
+    m_stride = stride;
+    zeroSlack();
+}
+
+void Bitmap::zeroSlack()
+{
+    const size_t rowSize = getRowSize();
+    for ( size_t y = 0; y < m_height; ++y )
+    {
+        std::memset( getRow( y ) + rowSize, 0, m_stride - rowSize );
+    }
+}
+
+size_t Bitmap::strideFor( size_t width, size_t pixelSize )
+{
+    const size_t bytes = width * pixelSize + kRowPadding;
+    return ( bytes + kAlignment - 1 ) / kAlignment * kAlignment;
+}
+
+size_t Bitmap::getHeapAllocations()
+{
+    return heapAllocations.load( std::memory_order_relaxed );
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Non-owning description of a block of pixel rows. This is what we
+        // hand to kernels (and anything else which just wants to walk rows)
+        // so they don't need to know who owns the memory.
+        struct BitmapView
+        {
+            uint8_t* data;
+            size_t width;
+            size_t height;
+            size_t pixelSize;
+            size_t stride; // bytes between the start of consecutive rows
+
+            uint8_t* row( size_t y ) const { return data + y * stride; }
+        };
+
+        // A whole image held in a single contiguous allocation.
+        //
+        // Each row starts on a kAlignment byte boundary and is followed by
+        // at least kRowPadding bytes of slack, so SIMD code can load/store
+        // a full vector at the end of a row without stepping into the next
+        // one. The slack is zeroed on allocation, the pixel bytes are not:
+        // every producer of a Bitmap writes all of its pixels anyway.
+        class Bitmap
+        {
+        public:
+            static constexpr size_t kAlignment = 64;
+            static constexpr size_t kRowPadding = 32;
+
+            Bitmap();
+            Bitmap( size_t width, size_t height, size_t pixelSize );
+
+            Bitmap( const Bitmap& rhs );
+            Bitmap& operator=( const Bitmap& rhs );
+            Bitmap( Bitmap&& rhs ) noexcept;
+            Bitmap& operator=( Bitmap&& rhs ) noexcept;
+
+            ~Bitmap();
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getPixelSize() const { return m_pixelSize; }
+            // Bytes between the start of one row and the next
+            size_t getStride() const { return m_stride; }
+            // Bytes of actual pixel data in each row (width * pixelSize)
+            size_t getRowSize() const { return m_width * m_pixelSize; }
+            // Bytes allocated, which may be more than stride * height after
+            // reset()
+            size_t getCapacity() const { return m_capacity; }
+            bool empty() const { return m_data == nullptr; }
+
+            uint8_t* getData() { return m_data.get(); }
+            const uint8_t* getData() const { return m_data.get(); }
+
+            // No bounds checking, these are meant for inner loops.
+            uint8_t* getRow( size_t y ) { return m_data.get() + y * m_stride; }
+            const uint8_t* getRow( size_t y ) const
+            {
+                return m_data.get() + y * m_stride;
+            }
+
+            BitmapView getView()
+            {
+                return { m_data.get(), m_width, m_height, m_pixelSize, m_stride };
+            }
+
+            void swap( Bitmap& rhs ) noexcept;
+
+            // Makes this a width x height bitmap, as the constructor does,
+            // but in the memory it has if that is big enough, so a bitmap
+            // kept between frames is only ever allocated once. The pixels
+            // are left as they were, i.e. meaningless, but the slack is
+            // zeroed again.
+            void reset( size_t width, size_t height, size_t pixelSize );
+
+            // Rounds a row size up to the stride we'd use for it
+            static size_t strideFor( size_t width, size_t pixelSize );
+
+            // Bitmaps allocated so far, on every thread. A loop reusing
+            // its bitmaps (see Image::setKeepSpare()) stops adding to it.
+            static size_t getHeapAllocations();
+
+        private:
+            void zeroSlack();
+
+            struct FreeDeleter
+            {
+                void operator()( uint8_t* p ) const { std::free( p ); }
+            };
+
+            std::unique_ptr<uint8_t[], FreeDeleter> m_data;
+            size_t m_width;
+            size_t m_height;
+            size_t m_pixelSize;
+            size_t m_stride;
+            size_t m_capacity;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,185 @@
+#include "camera.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+Camera::Camera( const std::string& device, size_t width, size_t height,
+                unsigned bufferCount )
+    : m_fd( ::open( device.c_str(), O_RDWR | O_NONBLOCK ) )
+{
+    if ( m_fd < 0 )
+    {
+        throw std::runtime_error(
+            "Could not open " + device + ": " + std::strerror( errno )
+            );
+    }
+    try
+    {
+        ::v4l2_capability caps;
+        std::memset( &caps, 0, sizeof( caps ) );
+        control( VIDIOC_QUERYCAP, &caps, "VIDIOC_QUERYCAP" );
+        if ( ! ( caps.capabilities & V4L2_CAP_VIDEO_CAPTURE )
+             || ! ( caps.capabilities & V4L2_CAP_STREAMING ) )
+        {
+            throw std::runtime_error( device + " is not a streaming camera" );
+        }
+
+        ::v4l2_format format;
+        std::memset( &format, 0, sizeof( format ) );
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        format.fmt.pix.width = width;
+        format.fmt.pix.height = height;
+        format.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+        format.fmt.pix.field = V4L2_FIELD_NONE;
+        control( VIDIOC_S_FMT, &format, "VIDIOC_S_FMT" );
+        if ( format.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG
+             && format.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG )
+        {
+            throw std::runtime_error( device + " cannot capture MJPEG" );
+        }
+        m_width = format.fmt.pix.width;
+        m_height = format.fmt.pix.height;
+
+        ::v4l2_requestbuffers request;
+        std::memset( &request, 0, sizeof( request ) );
+        request.count = bufferCount;
+        request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        request.memory = V4L2_MEMORY_MMAP;
+        control( VIDIOC_REQBUFS, &request, "VIDIOC_REQBUFS" );
+        if ( request.count == 0 )
+        {
+            throw std::runtime_error( device + " gave no capture buffers" );
+        }
+
+        // Map every buffer once and queue it for the driver to fill
+        for ( unsigned idx = 0; idx < request.count; ++idx )
+        {
+            ::v4l2_buffer buffer;
+            std::memset( &buffer, 0, sizeof( buffer ) );
+            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.index = idx;
+            control( VIDIOC_QUERYBUF, &buffer, "VIDIOC_QUERYBUF" );
+            void* data = ::mmap( nullptr, buffer.length, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, m_fd, buffer.m.offset );
+            if ( data == MAP_FAILED )
+            {
+                throw std::runtime_error( "Could not map a capture buffer" );
+            }
+            m_buffers.push_back( { data, buffer.length } );
+            control( VIDIOC_QBUF, &buffer, "VIDIOC_QBUF" );
+        }
+
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        control( VIDIOC_STREAMON, &type, "VIDIOC_STREAMON" );
+        m_streaming = true;
+    }
+    catch ( ... )
+    {
+        // The destructor won't run, so tidy up here
+        for ( const Buffer& buffer : m_buffers )
+        {
+            ::munmap( buffer.data, buffer.length );
+        }
+        ::close( m_fd );
+        throw;
+    }
+}
+
+Camera::~Camera()
+{
+    if ( m_streaming )
+    {
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ::ioctl( m_fd, VIDIOC_STREAMOFF, &type );
+    }
+    for ( const Buffer& buffer : m_buffers )
+    {
+        ::munmap( buffer.data, buffer.length );
+    }
+    ::close( m_fd );
+}
+
+void Camera::capture( const std::function<void( const uint8_t*, size_t )>& use,
+                      int timeoutMs )
+{
+    ::v4l2_buffer buffer;
+    std::memset( &buffer, 0, sizeof( buffer ) );
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    for ( ;; )
+    {
+        if ( ::ioctl( m_fd, VIDIOC_DQBUF, &buffer ) == 0 )
+        {
+            break;
+        }
+        if ( errno == EINTR )
+        {
+            continue;
+        }
+        if ( errno != EAGAIN )
+        {
+            throw std::runtime_error(
+                std::string( "VIDIOC_DQBUF failed: " ) + std::strerror( errno )
+                );
+        }
+        // Nothing ready yet
+        ::pollfd fd = { m_fd, POLLIN, 0 };
+        const int rc = ::poll( &fd, 1, timeoutMs );
+        if ( rc == 0 )
+        {
+            throw std::runtime_error( "Timed out waiting for a frame" );
+        }
+        if ( rc < 0 && errno != EINTR )
+        {
+            throw std::runtime_error(
+                std::string( "poll failed: " ) + std::strerror( errno )
+                );
+        }
+    }
+
+    // Back to the driver whatever happens
+    try
+    {
+        use( static_cast<const uint8_t*>( m_buffers[ buffer.index ].data ),
+             buffer.bytesused );
+    }
+    catch ( ... )
+    {
+        ::ioctl( m_fd, VIDIOC_QBUF, &buffer );
+        throw;
+    }
+    control( VIDIOC_QBUF, &buffer, "VIDIOC_QBUF" );
+}
+
+void Camera::control( unsigned long request, void* arg, const char* what )
+{
+    int rc;
+    do
+    {
+        rc = ::ioctl( m_fd, request, arg );
+    }
+    while ( rc < 0 && errno == EINTR );
+    if ( rc < 0 )
+    {
+        throw std::runtime_error(
+            std::string( what ) + " failed: " + std::strerror( errno )
+            );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
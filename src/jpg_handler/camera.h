@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // A V4L2 camera (e.g. /dev/video0 on the NanoPi) streaming Motion
+        // JPEG frames.
+        //
+        // The frames land in a small pool of buffers which the driver
+        // fills and we map into memory once, up front. capture() borrows
+        // the oldest full one and hands it straight back afterwards, so
+        // once streaming nothing is allocated or copied per frame: a frame
+        // goes from the driver's buffer into a Decoder without any stops
+        // in between.
+        class Camera
+        {
+        public:
+            // Asks for width x height MJPEG; the driver may pick the
+            // nearest size it can do, see getWidth() / getHeight().
+            // bufferCount buffers are requested (the driver may give more).
+            // Will throw if the device cannot be opened, isn't a streaming
+            // capture device or cannot produce MJPEG.
+            Camera( const std::string& device, size_t width, size_t height,
+                    unsigned bufferCount = 4 );
+            ~Camera();
+
+            Camera( const Camera& ) = delete;
+            Camera& operator=( const Camera& ) = delete;
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getBufferCount() const { return m_buffers.size(); }
+
+            // Waits (up to timeoutMs) for the next frame and calls
+            // use( jpegData, size ) with it. The data is only valid during
+            // the call: the buffer goes back to the driver as soon as use()
+            // returns, or throws. Will throw on timeout or a driver error.
+            void capture( const std::function<void( const uint8_t*, size_t )>& use,
+                          int timeoutMs = 2000 );
+
+        private:
+            struct Buffer
+            {
+                void* data;
+                size_t length;
+            };
+
+            // ioctl(), retried if interrupted; throws what on failure
+            void control( unsigned long request, void* arg, const char* what );
+
+            int m_fd;
+            size_t m_width;
+            size_t m_height;
+            std::vector<Buffer> m_buffers;
+            bool m_streaming = false;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
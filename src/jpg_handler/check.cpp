@@ -0,0 +1,642 @@
+// Regression checks, so an optimisation can't change the output unnoticed.
+// Build and run with "make check", from this directory:
+//
+//   ./checks [--update] [--perf <file>] [--threshold <percent>] [--reps <n>]
+//
+// Four sets of checks, each printing a line per check and FAIL for any
+// that fail (the exit status is then 1):
+//
+// - golden: fsd(), fsdColor(), shrink() and expand() on the bundled
+//   images, with the scalar kernels on one thread, hashed as the PPM
+//   savePpm() would write and compared with golden.txt. --update writes
+//   golden.txt afresh instead, for when a change to the output is meant.
+// - cross: the same with every other kernel set the CPU has; and with
+//   each of them, fsdColor() (cancellable too) and dither() on several
+//   threads, and the streaming paths (bands.h, fsdColorStream(),
+//   IncrementalDitherer), all against the scalar, single threaded, whole
+//   image results.
+// - alloc: the same frame decoded and transformed over and over, which
+//   after the first frame should need no more memory (see arena.h).
+// - perf: with --perf, the best time of each golden operation, per pixel,
+//   against that file. If it doesn't exist yet it is written, so the first
+//   run on a machine sets the baseline. Anything more than threshold per
+//   cent slower (25 unless set) fails.
+
+#include "arena.h"
+#include "bands.h"
+#include "incremental.h"
+#include "jpeg.h"
+#include "kernels.h"
+#include "palette.h"
+#include "scanline.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// Every operator new, on any thread, for checkSteadyState()
+std::atomic<size_t> newCalls( 0 );
+
+} // namespace
+
+void* operator new( size_t size )
+{
+    newCalls.fetch_add( 1, std::memory_order_relaxed );
+    void* p = std::malloc( size == 0 ? 1 : size );
+    if ( p == nullptr )
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete( void* p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    std::free( p );
+}
+
+namespace
+{
+
+using namespace marengo::jpeg;
+
+const char* const kGoldenFile = "golden.txt";
+
+struct File
+{
+    const char* name;
+    const char* path;
+};
+
+const File kFiles[] = {
+    { "sample", "sample.jpg" },
+    { "guacas", "../../guacas.jpg" },
+    { "dali", "../../dali" },
+};
+
+// What is checked on each file
+struct Operation
+{
+    const char* name;
+    std::function<void( Image& )> apply;
+};
+
+const std::vector<Operation>& operations()
+{
+    static const std::vector<Operation> ops = {
+        { "fsd", []( Image& img ) { img.fsd(); } },
+        { "fsdColor",
+          []( Image& img ) { img.fsdColor( Palette::defaultPalette() ); } },
+        { "shrink", []( Image& img ) { img.shrink( img.getWidth() / 3 ); } },
+        { "expand", []( Image& img ) { img.expand( img.getWidth() * 2 ); } },
+    };
+    return ops;
+}
+
+// 64 bit FNV-1a
+struct Hash
+{
+    uint64_t value = 0xCBF29CE484222325ull;
+
+    void add( const void* data, size_t size )
+    {
+        const uint8_t* p = static_cast<const uint8_t*>( data );
+        for ( size_t i = 0; i < size; ++i )
+        {
+            value = ( value ^ p[i] ) * 0x100000001B3ull;
+        }
+    }
+};
+
+std::string hex( uint64_t value )
+{
+    std::ostringstream oss;
+    oss << std::hex << std::setw( 16 ) << std::setfill( '0' ) << value;
+    return oss.str();
+}
+
+// Of the file savePpm() would write
+std::string ppmHash( const Bitmap& bitmap )
+{
+    Hash hash;
+    const std::string header = "P6 " + std::to_string( bitmap.getWidth() ) + " "
+        + std::to_string( bitmap.getHeight() ) + " 255\n";
+    hash.add( header.data(), header.size() );
+    for ( size_t y = 0; y < bitmap.getHeight(); ++y )
+    {
+        hash.add( bitmap.getRow( y ), bitmap.getRowSize() );
+    }
+    return hex( hash.value );
+}
+
+std::string ppmHash( const Image& img )
+{
+    return ppmHash( img.getBitmap() );
+}
+
+std::string rowsHash( RowSource& source )
+{
+    Hash hash;
+    const std::string header = "P6 " + std::to_string( source.getWidth() ) + " "
+        + std::to_string( source.getHeight() ) + " 255\n";
+    hash.add( header.data(), header.size() );
+    for ( size_t y = 0; y < source.getHeight(); ++y )
+    {
+        hash.add( source.next(), source.getWidth() * source.getPixelSize() );
+    }
+    return hex( hash.value );
+}
+
+std::string fileHash( const std::string& fileName )
+{
+    std::ifstream ifs( fileName, std::ios::binary );
+    if ( ! ifs )
+    {
+        throw std::runtime_error( "Could not open " + fileName );
+    }
+    Hash hash;
+    char buffer[4096];
+    while ( ifs.read( buffer, sizeof buffer ) || ifs.gcount() > 0 )
+    {
+        hash.add( buffer, static_cast<size_t>( ifs.gcount() ) );
+    }
+    return hex( hash.value );
+}
+
+struct Results
+{
+    size_t passed = 0;
+    size_t failed = 0;
+
+    void check( const std::string& name, const std::string& expected,
+                const std::string& actual )
+    {
+        const bool ok = expected == actual;
+        ++( ok ? passed : failed );
+        std::cout << ( ok ? "ok   " : "FAIL " ) << name;
+        if ( ! ok )
+        {
+            std::cout << ": expected " << expected << ", got " << actual;
+        }
+        std::cout << '\n';
+    }
+};
+
+std::string tempDir()
+{
+    const char* tmp = std::getenv( "TMPDIR" );
+    return tmp != nullptr ? tmp : "/tmp";
+}
+
+// file/operation to hash, with the kernels in use
+std::map<std::string, std::string> hashAll()
+{
+    std::map<std::string, std::string> hashes;
+    for ( const File& file : kFiles )
+    {
+        const Image source( file.path );
+        for ( const Operation& op : operations() )
+        {
+            Image img( source, Image::CopyMode::Deep );
+            op.apply( img );
+            hashes[std::string( file.name ) + "/" + op.name] = ppmHash( img );
+        }
+    }
+    return hashes;
+}
+
+std::map<std::string, std::string> readGolden()
+{
+    std::ifstream ifs( kGoldenFile );
+    if ( ! ifs )
+    {
+        throw std::runtime_error( std::string( "No " ) + kGoldenFile
+                                  + ", run with --update to make one" );
+    }
+    std::map<std::string, std::string> golden;
+    std::string key;
+    std::string hash;
+    while ( ifs >> key >> hash )
+    {
+        golden[key] = hash;
+    }
+    return golden;
+}
+
+void writeGolden( const std::map<std::string, std::string>& hashes )
+{
+    std::ofstream ofs( kGoldenFile );
+    for ( const auto& entry : hashes )
+    {
+        ofs << entry.first << ' ' << entry.second << '\n';
+    }
+    if ( ! ofs )
+    {
+        throw std::runtime_error( std::string( "Could not write " ) + kGoldenFile );
+    }
+    std::cout << "wrote " << kGoldenFile << '\n';
+}
+
+// reference holds the scalar results
+void checkGolden( Results& results, const std::map<std::string, std::string>& reference )
+{
+    const std::map<std::string, std::string> golden = readGolden();
+    for ( const auto& entry : reference )
+    {
+        const auto found = golden.find( entry.first );
+        results.check( "golden " + entry.first,
+                       found == golden.end() ? "(missing)" : found->second,
+                       entry.second );
+    }
+}
+
+void checkKernels( Results& results, const std::map<std::string, std::string>& reference )
+{
+    using kernels::Isa;
+    for ( Isa isa : { Isa::Sse41, Isa::Avx2, Isa::Neon } )
+    {
+        if ( ! kernels::isSupported( isa ) )
+        {
+            continue;
+        }
+        kernels::setIsa( isa );
+        const std::string name = kernels::kernels().name;
+        for ( const auto& entry : hashAll() )
+        {
+            results.check( "cross " + name + " " + entry.first,
+                           reference.at( entry.first ), entry.second );
+        }
+    }
+    kernels::setIsa( Isa::Scalar );
+}
+
+// f's result with the scalar kernels, whichever set is under test
+std::string withScalar( const std::function<std::string()>& f )
+{
+    const kernels::Isa isa = kernels::kernels().isa;
+    kernels::setIsa( kernels::Isa::Scalar );
+    const std::string result = f();
+    kernels::setIsa( isa );
+    return result;
+}
+
+// The ppmHash() of op on a copy of source, with the scalar kernels on one
+// thread
+std::string scalarHash( const Image& source, const std::function<void( Image& )>& op )
+{
+    return withScalar( [&]()
+        {
+            Image img( source, Image::CopyMode::Deep );
+            op( img );
+            return ppmHash( img );
+        } );
+}
+
+// With the kernel set in use, which matters most here: the SIMD kernels
+// store whole vectors into the row below while the rows run as a
+// wavefront
+void checkThreads( Results& results )
+{
+    const Palette& palette = Palette::defaultPalette();
+    const std::string isa = kernels::kernels().name;
+    for ( const File& file : kFiles )
+    {
+        const Image source( file.path );
+        const std::string one = scalarHash(
+            source, [&]( Image& img ) { img.fsdColor( palette, 1 ); } );
+        const std::string atkinson = scalarHash(
+            source, [&]( Image& img ) { img.dither( palette, Dither::Atkinson, 1 ); } );
+        for ( unsigned threads : { 2u, 3u, 8u } )
+        {
+            const std::string suffix = " threads=" + std::to_string( threads )
+                + " " + file.name;
+            Image img( source, Image::CopyMode::Deep );
+            img.fsdColor( palette, threads );
+            results.check( "cross " + isa + " fsdColor" + suffix, one, ppmHash( img ) );
+
+            Image other( source, Image::CopyMode::Deep );
+            other.dither( palette, Dither::Atkinson, threads );
+            results.check( "cross " + isa + " atkinson" + suffix, atkinson,
+                           ppmHash( other ) );
+
+            // The cancellable one, left to finish, then stopped part way
+            // (which must come back, however the threads are placed)
+            Image cancellable( source, Image::CopyMode::Deep );
+            const bool finished = cancellable.fsdColor(
+                palette, []() { return false; }, threads );
+            results.check( "cross " + isa + " fsdColor stop" + suffix,
+                           one + " finished",
+                           ppmHash( cancellable ) + ( finished ? " finished" : " stopped" ) );
+            std::atomic<size_t> asked( 0 );
+            Image stopped( source, Image::CopyMode::Deep );
+            const bool all = stopped.fsdColor(
+                palette, [&asked]() { return ++asked > 20; }, threads );
+            results.check( "cross " + isa + " fsdColor stopped" + suffix, "stopped",
+                           all ? "finished" : "stopped" );
+        }
+    }
+}
+
+void checkStreaming( Results& results )
+{
+    const Palette& palette = Palette::defaultPalette();
+    const std::string dir = tempDir();
+    const std::string isa = kernels::kernels().name;
+    for ( const File& file : kFiles )
+    {
+        const std::string name = std::string( " " ) + file.name;
+        const Image source( file.path );
+
+        const std::string shrunk = scalarHash(
+            source, [&]( Image& img ) { img.shrink( source.getWidth() / 3 ); } );
+        {
+            DecodeSource decode( file.path );
+            ShrinkSource shrink( decode, source.getWidth() / 3 );
+            results.check( "cross " + isa + " ShrinkSource" + name, shrunk,
+                           rowsHash( shrink ) );
+        }
+
+        const std::string atkinson = scalarHash(
+            source, [&]( Image& img ) { img.dither( palette, Dither::Atkinson ); } );
+        {
+            DecodeSource decode( file.path );
+            DitherSource dither( decode, palette, Dither::Atkinson );
+            results.check( "cross " + isa + " DitherSource" + name, atkinson,
+                           rowsHash( dither ) );
+        }
+
+        // The same file, byte for byte
+        const std::string whole = dir + "/check_whole.jpg";
+        const std::string streamed = dir + "/check_streamed.jpg";
+        const std::string wholeHash = withScalar( [&]()
+            {
+                Image dithered( source, Image::CopyMode::Deep );
+                dithered.fsdColor( palette );
+                dithered.save( whole );
+                return fileHash( whole );
+            } );
+        fsdColorStream( file.path, streamed, palette );
+        results.check( "cross " + isa + " fsdColorStream" + name, wholeHash,
+                       fileHash( streamed ) );
+        std::remove( whole.c_str() );
+        std::remove( streamed.c_str() );
+
+        // A frame, then the same with a stripe across the middle changed,
+        // then with the bottom rows changed too
+        IncrementalDitherer incremental( palette );
+        Image frame( source, Image::CopyMode::Deep );
+        for ( int step = 0; step < 3; ++step )
+        {
+            const size_t first = step == 1 ? frame.getHeight() / 2
+                                           : frame.getHeight() - 3;
+            if ( step > 0 )
+            {
+                for ( size_t y = first; y < first + 3; ++y )
+                {
+                    uint8_t* row = frame.getRow( y );
+                    for ( size_t i = 0; i < frame.getWidth() * 3; i += 7 )
+                    {
+                        row[i] = static_cast<uint8_t>( 255 - row[i] );
+                    }
+                }
+            }
+            incremental.dither( frame );
+            const std::string expected = scalarHash(
+                frame, [&]( Image& img ) { img.fsdColor( palette ); } );
+            results.check( "cross " + isa + " IncrementalDitherer step "
+                           + std::to_string( step ) + name, expected,
+                           ppmHash( incremental.getOutput() ) );
+        }
+    }
+}
+
+// Decoding the same frame again and again through a Decoder, and putting
+// it through fsdColor() (on several threads), encode(), shrink(), expand(),
+// fsd() and fsdMono() each time, should take nothing more from the heap
+// after the first: no operator new, no more bitmaps or arena blocks, and
+// the pixels kept for reuse stay as they were.
+void checkSteadyState( Results& results )
+{
+    const unsigned kFrames = 5;
+    const Palette& palette = Palette::defaultPalette();
+    ScratchArena& arena = ScratchArena::forThread();
+    for ( const File& file : kFiles )
+    {
+        std::ifstream ifs( file.path, std::ios::in | std::ios::binary );
+        if ( ! ifs )
+        {
+            throw std::runtime_error( std::string( "Could not open " ) + file.path );
+        }
+        const std::vector<uint8_t> data( ( std::istreambuf_iterator<char>( ifs ) ),
+                                         std::istreambuf_iterator<char>() );
+        Decoder decoder;
+        Encoder encoder;
+        Image frame;
+        std::vector<uint8_t> jpeg;
+        // What there is once the first frame is done
+        size_t news = 0;
+        size_t bitmaps = 0;
+        size_t blocks = 0;
+        size_t spare = 0;
+        for ( unsigned i = 0; i < kFrames; ++i )
+        {
+            decoder.decode( data.data(), data.size(), frame );
+            frame.fsdColor( palette, 4 );
+            encoder.encode( frame, jpeg );
+            frame.shrink( frame.getWidth() / 3 );
+            frame.expand( frame.getWidth() * 2 );
+            frame.fsd();
+            frame.fsdMono();
+            if ( i == 0 )
+            {
+                news = newCalls.load();
+                bitmaps = Bitmap::getHeapAllocations();
+                blocks = arena.getHeapAllocations();
+                spare = frame.getSpareCapacity();
+            }
+        }
+        const std::string more = std::to_string( newCalls.load() - news )
+            + " operator new, "
+            + std::to_string( Bitmap::getHeapAllocations() - bitmaps ) + " bitmaps, "
+            + std::to_string( arena.getHeapAllocations() - blocks ) + " arena blocks, "
+            + std::to_string( frame.getSpareCapacity() - spare ) + " bytes more spare";
+        results.check( std::string( "alloc steady state " ) + file.name,
+                       "0 operator new, 0 bitmaps, 0 arena blocks, 0 bytes more spare",
+                       more );
+    }
+}
+
+// Best nanoseconds per pixel of op on a copy of source. Small images get
+// more than reps runs, until they have taken a fifth of a second, as a
+// single run of those is too short to time steadily.
+double timeOperation( const Image& source, const Operation& op, unsigned reps )
+{
+    double best = 0;
+    double total = 0;
+    for ( unsigned i = 0; i < reps || total < 2e8; ++i )
+    {
+        Image img( source, Image::CopyMode::Deep );
+        const auto start = std::chrono::steady_clock::now();
+        op.apply( img );
+        const double ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start ).count();
+        best = i == 0 ? ns : std::min( best, ns );
+        total += ns;
+    }
+    return best / ( static_cast<double>( source.getWidth() ) * source.getHeight() );
+}
+
+void checkPerf( Results& results, const std::string& fileName, double threshold,
+                unsigned reps )
+{
+    // What to measure against, as file/operation to nanoseconds per pixel
+    std::map<std::string, double> baseline;
+    std::ifstream ifs( fileName );
+    const bool haveBaseline = static_cast<bool>( ifs );
+    std::string key;
+    double ns;
+    while ( ifs >> key >> ns )
+    {
+        baseline[key] = ns;
+    }
+
+    std::map<std::string, double> times;
+    for ( const File& file : kFiles )
+    {
+        const Image source( file.path );
+        for ( const Operation& op : operations() )
+        {
+            const std::string name = std::string( file.name ) + "/" + op.name;
+            double time = timeOperation( source, op, reps );
+            times[name] = time;
+            const auto found = baseline.find( name );
+            if ( found == baseline.end() )
+            {
+                continue;
+            }
+            // Anything else running on the machine only ever makes a run
+            // slower, so one too slow gets two more chances
+            for ( int retry = 0; retry < 2 && time > found->second * ( 1 + threshold / 100 );
+                  ++retry )
+            {
+                time = std::min( time, timeOperation( source, op, reps ) );
+            }
+            const double change = ( time / found->second - 1 ) * 100;
+            const bool ok = change <= threshold;
+            ++( ok ? results.passed : results.failed );
+            std::cout << ( ok ? "ok   " : "FAIL " ) << "perf " << name << ": "
+                      << std::fixed << std::setprecision( 2 ) << time
+                      << " ns/pixel against " << found->second << " ("
+                      << std::showpos << std::setprecision( 0 ) << change
+                      << std::noshowpos << "%)\n";
+            std::cout.unsetf( std::ios::fixed );
+        }
+    }
+    if ( ! haveBaseline )
+    {
+        std::ofstream ofs( fileName );
+        for ( const auto& entry : times )
+        {
+            ofs << entry.first << '\t' << entry.second << '\n';
+        }
+        std::cout << "wrote " << fileName << ", the baseline for next time\n";
+    }
+}
+
+} // namespace
+
+int main( int argc, char* argv[] )
+{
+    bool update = false;
+    std::string perfFile;
+    double threshold = 25;
+    unsigned reps = 5;
+    for ( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        if ( arg == "--update" )
+        {
+            update = true;
+        }
+        else if ( arg == "--perf" && i + 1 < argc )
+        {
+            perfFile = argv[++i];
+        }
+        else if ( arg == "--threshold" && i + 1 < argc )
+        {
+            threshold = std::stod( argv[++i] );
+        }
+        else if ( arg == "--reps" && i + 1 < argc )
+        {
+            reps = std::max( 1ul, std::stoul( argv[++i] ) );
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--update] [--perf <file>]"
+                      << " [--threshold <percent>] [--reps <n>]\n";
+            return 1;
+        }
+    }
+
+    try
+    {
+        Results results;
+        // Everything is measured against the scalar kernels
+        const kernels::Isa best = kernels::kernels().isa;
+        kernels::setIsa( kernels::Isa::Scalar );
+        const std::map<std::string, std::string> reference = hashAll();
+        if ( update )
+        {
+            writeGolden( reference );
+            return 0;
+        }
+        checkGolden( results, reference );
+        checkKernels( results, reference );
+        for ( kernels::Isa isa : { kernels::Isa::Scalar, kernels::Isa::Sse41,
+                                   kernels::Isa::Avx2, kernels::Isa::Neon } )
+        {
+            if ( kernels::isSupported( isa ) )
+            {
+                kernels::setIsa( isa );
+                checkThreads( results );
+                checkStreaming( results );
+            }
+        }
+        kernels::setIsa( kernels::Isa::Scalar );
+        checkSteadyState( results );
+        if ( ! perfFile.empty() )
+        {
+            // With the kernels that would normally be used
+            kernels::setIsa( best );
+            checkPerf( results, perfFile, threshold, reps );
+        }
+        std::cout << results.passed << " passed, " << results.failed << " failed\n";
+        return results.failed == 0 ? 0 : 1;
+    }
+    catch ( const std::exception& e )
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // A small direct-mapped cache from RGB colour to palette index, for
+        // colour matching which is too slow to redo for every pixel.
+        // Camera frames and dithered areas repeat the same few thousand
+        // colours over and over, so most lookups hit.
+        //
+        // The 24 bit colour is scrambled (a multiply by an odd constant,
+        // so no two colours scramble the same); the top kSlotBits pick the
+        // slot and the rest are kept as a tag next to the index, valid bit
+        // and all, in one 32 bit word. So any number of threads can share
+        // a cache: a word is either all there or not, and one that another
+        // thread has just written over simply misses.
+        class ColourCache
+        {
+        public:
+            static constexpr int kSlotBits = 12;
+            static constexpr size_t kSlots = size_t( 1 ) << kSlotBits;
+
+            ColourCache()
+                : m_slots( new std::atomic<uint32_t>[ kSlots ]() )
+            {
+            }
+
+            // True, setting idx, if the colour is in the cache
+            bool find( uint8_t r, uint8_t g, uint8_t b, size_t& idx ) const
+            {
+                const uint32_t key = scramble( r, g, b );
+                const uint32_t entry =
+                    m_slots[ key >> kTagBits ].load( std::memory_order_relaxed );
+                idx = entry & 0xFF;
+                return ( entry >> 8 ) == ( kValid | ( key & kTagMask ) );
+            }
+
+            void store( uint8_t r, uint8_t g, uint8_t b, size_t idx ) const
+            {
+                const uint32_t key = scramble( r, g, b );
+                m_slots[ key >> kTagBits ].store(
+                    ( ( kValid | ( key & kTagMask ) ) << 8 ) | static_cast<uint32_t>( idx ),
+                    std::memory_order_relaxed );
+            }
+
+        private:
+            static constexpr int kTagBits = 24 - kSlotBits;
+            static constexpr uint32_t kTagMask = ( 1u << kTagBits ) - 1;
+            static constexpr uint32_t kValid = 1u << kTagBits;
+
+            static uint32_t scramble( uint8_t r, uint8_t g, uint8_t b )
+            {
+                const uint32_t rgb = ( uint32_t( r ) << 16 ) | ( uint32_t( g ) << 8 ) | b;
+                return ( rgb * 0x9E3779B1u ) & 0xFFFFFF;
+            }
+
+            std::unique_ptr<std::atomic<uint32_t>[]> m_slots;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "bitmap.h"
+#include "quantizer.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Error diffusion kernels described at compile time, so that
+        // diffuse() below compiles to a separate, fully unrolled inner loop
+        // for each one: every offset and weight is a constant, and there
+        // is no loop over the taps at run time.
+
+        // One destination of a pixel's error: dx pixels right and dy rows
+        // down, getting weight / divisor of it
+        template <int Dx, int Dy, int Weight>
+        struct Tap
+        {
+            static constexpr int dx = Dx;
+            static constexpr int dy = Dy;
+            static constexpr int weight = Weight;
+        };
+
+        namespace detail
+        {
+            constexpr int maxOf()
+            {
+                return 0;
+            }
+            template <typename... Ints>
+            constexpr int maxOf( int first, Ints... rest )
+            {
+                return first > maxOf( rest... ) ? first : maxOf( rest... );
+            }
+            constexpr int sumOf()
+            {
+                return 0;
+            }
+            template <typename... Ints>
+            constexpr int sumOf( int first, Ints... rest )
+            {
+                return first + sumOf( rest... );
+            }
+            constexpr bool allOf()
+            {
+                return true;
+            }
+            template <typename... Bools>
+            constexpr bool allOf( bool first, Bools... rest )
+            {
+                return first && allOf( rest... );
+            }
+            constexpr int absOf( int v )
+            {
+                return v < 0 ? -v : v;
+            }
+        } // namespace detail
+
+        template <int Divisor, typename... Taps>
+        struct DiffusionKernel
+        {
+            static constexpr int kDivisor = Divisor;
+            // How far left or right of a pixel its error goes
+            static constexpr int kReach = detail::maxOf( detail::absOf( Taps::dx )... );
+            // Rows of error in flight: this one and those below
+            static constexpr int kRows = 1 + detail::maxOf( Taps::dy... );
+
+            static_assert( sizeof...( Taps ) > 0, "A kernel needs taps" );
+            static_assert( kRows >= 2, "A kernel must reach the row below" );
+            static_assert( detail::allOf( ( Taps::dy > 0 || Taps::dx > 0 )... ),
+                           "Error can only go to pixels not done yet" );
+            // Error is kept as int16, scaled by kDivisor, and a pixel can
+            // be owed up to 255 from every tap
+            static_assert( 255 * detail::sumOf( Taps::weight... ) <= 32767,
+                           "Weights too big for int16 error" );
+
+            // Hands r, g, b out to the taps. errors[dy] points at this
+            // pixel's entry (3 int16s) in the error row dy below. Dir is 1
+            // going left to right and -1 going right to left, which
+            // mirrors the kernel.
+            template <int Dir>
+            static void spread( int16_t* const* errors, int r, int g, int b )
+            {
+                const int unused[] = { ( add<Dir, Taps>( errors, r, g, b ), 0 )... };
+                (void)unused;
+            }
+
+        private:
+            template <int Dir, typename T>
+            static void add( int16_t* const* errors, int r, int g, int b )
+            {
+                int16_t* e = errors[ T::dy ] + Dir * T::dx * 3;
+                e[0] += r * T::weight;
+                e[1] += g * T::weight;
+                e[2] += b * T::weight;
+            }
+        };
+
+        //                                        X  7
+        //                                  3  5  1       / 16
+        using FloydSteinbergKernel = DiffusionKernel<16,
+            Tap<1, 0, 7>, Tap<-1, 1, 3>, Tap<0, 1, 5>, Tap<1, 1, 1>>;
+
+        // Only 6/8 of the error is passed on, so contrast holds up better
+        // (and there is less smearing on e-ink), at the cost of flattening
+        // the darkest and lightest areas
+        //                                        X  1  1
+        //                                     1  1  1
+        //                                        1       / 8
+        using AtkinsonKernel = DiffusionKernel<8,
+            Tap<1, 0, 1>, Tap<2, 0, 1>,
+            Tap<-1, 1, 1>, Tap<0, 1, 1>, Tap<1, 1, 1>,
+            Tap<0, 2, 1>>;
+
+        //                                        X  7  5
+        //                                  3  5  7  5  3
+        //                                  1  3  5  3  1 / 48
+        using JarvisJudiceNinkeKernel = DiffusionKernel<48,
+            Tap<1, 0, 7>, Tap<2, 0, 5>,
+            Tap<-2, 1, 3>, Tap<-1, 1, 5>, Tap<0, 1, 7>, Tap<1, 1, 5>, Tap<2, 1, 3>,
+            Tap<-2, 2, 1>, Tap<-1, 2, 3>, Tap<0, 2, 5>, Tap<1, 2, 3>, Tap<2, 2, 1>>;
+
+        //                                        X  8  4
+        //                                  2  4  8  4  2
+        //                                  1  2  4  2  1 / 42
+        using StuckiKernel = DiffusionKernel<42,
+            Tap<1, 0, 8>, Tap<2, 0, 4>,
+            Tap<-2, 1, 2>, Tap<-1, 1, 4>, Tap<0, 1, 8>, Tap<1, 1, 4>, Tap<2, 1, 2>,
+            Tap<-2, 2, 1>, Tap<-1, 2, 2>, Tap<0, 2, 4>, Tap<1, 2, 2>, Tap<2, 2, 1>>;
+
+        //                                        X  2
+        //                                     1  1       / 4
+        using SierraLiteKernel = DiffusionKernel<4,
+            Tap<1, 0, 2>, Tap<-1, 1, 1>, Tap<0, 1, 1>>;
+
+        namespace detail
+        {
+            // One pixel: src plus the error it is owed, rounded to
+            // nearest, to the nearest palette colour in dst; then the new
+            // error goes out to the taps
+            template <typename Kernel, int Dir, typename Matcher>
+            inline void diffusePixel( const uint8_t* src, uint8_t* dst,
+                                      int16_t* const* error, const Matcher& q )
+            {
+                const int divisor = Kernel::kDivisor;
+                int value[3];
+                for ( int c = 0; c < 3; ++c )
+                {
+                    const int owed = error[0][c];
+                    const int e = owed >= 0 ? ( owed + divisor / 2 ) / divisor
+                                            : -( ( -owed + divisor / 2 ) / divisor );
+                    value[c] = std::min( 255, std::max( 0, src[c] + e ) );
+                }
+                const uint8_t* colour = q.getColour(
+                    q.nearest( value[0], value[1], value[2] ) );
+                Kernel::template spread<Dir>( error, value[0] - colour[0],
+                                              value[1] - colour[1],
+                                              value[2] - colour[2] );
+                dst[0] = colour[0];
+                dst[1] = colour[1];
+                dst[2] = colour[2];
+            }
+        } // namespace detail
+
+        // Error diffuses an RGB bitmap to the quantizer's palette, in
+        // place, on threads threads (see wavefront.h). The Matcher is
+        // anything with Quantizer's nearest( r, g, b ) and getColour( idx ),
+        // which are all the templates here need.
+        //
+        // Unlike fsdColor(), the error is kept apart from the pixels, in
+        // Kernel::kRows rows of int16, so it never wraps around, and every
+        // pixel is dithered, edges included (error that would fall off the
+        // image is dropped).
+        template <typename Kernel, typename Matcher>
+        void diffuse( Bitmap& bitmap, const Matcher& q, unsigned threads )
+        {
+            const size_t width = bitmap.getWidth();
+            const size_t height = bitmap.getHeight();
+            const size_t reach = Kernel::kReach;
+            const size_t rows = Kernel::kRows;
+            // Each error row has reach spare pixels either side, for the
+            // error which falls off the edges
+            const size_t errorStride = ( width + 2 * reach ) * 3;
+            std::vector<int16_t> errors( rows * errorStride, 0 );
+            const auto errorRow = [&]( size_t row )
+                {
+                    return &errors[ ( row % rows ) * errorStride + reach * 3 ];
+                };
+
+            // Row r's error row is r % rows, so the row rows - 1 below
+            // takes over the one the row above has just finished with.
+            // It gets cleared here, a chunk at a time, just ahead of the
+            // first write to it (from clearFrom on, counting from the left
+            // hand spare pixels). With a lead of 2 * reach, the row above is
+            // always far enough ahead that no two rows touch the same
+            // error entries at once.
+            runWavefront( height, width, 2 * reach, threads,
+                [&]( size_t row, size_t begin, size_t end )
+                {
+                    int16_t* newest = errorRow( row + rows - 1 );
+                    const size_t clearFrom = begin == 0 ? 0 : begin + 2 * reach;
+                    const size_t clearTo = end + 2 * reach;
+                    std::fill( newest - reach * 3 + clearFrom * 3,
+                               newest - reach * 3 + clearTo * 3, 0 );
+
+                    int16_t* error[ Kernel::kRows ];
+                    for ( size_t dy = 0; dy < rows; ++dy )
+                    {
+                        error[dy] = errorRow( row + dy ) + begin * 3;
+                    }
+                    uint8_t* px = bitmap.getRow( row ) + begin * 3;
+                    for ( size_t col = begin; col < end; ++col, px += 3 )
+                    {
+                        detail::diffusePixel<Kernel, 1>( px, px, error, q );
+                        for ( size_t dy = 0; dy < rows; ++dy )
+                        {
+                            error[dy] += 3;
+                        }
+                    }
+                } );
+        }
+
+        // The same dither one row at a time, top to bottom, for when the
+        // rows come from (or go to) somewhere else: a ScanlineReader, say,
+        // or a source which must stay read-only. The only state is the
+        // Kernel::kRows rows of int16 error, a few KB for a camera frame,
+        // which stays in L1 while the rows stream past.
+        //
+        // With serpentine, every other row goes right to left with the
+        // kernel mirrored, which breaks up the diagonal "worms" a one way
+        // scan leaves in flat areas. (That makes each row depend on the
+        // whole of the row above, so there is no wavefront version.)
+        template <typename Kernel, typename Matcher = Quantizer>
+        class RowDiffuser
+        {
+        public:
+            RowDiffuser( size_t width, const Matcher& q, bool serpentine )
+                : m_width( width )
+                , m_q( q )
+                , m_serpentine( serpentine )
+                , m_stride( ( width + 2 * Kernel::kReach ) * 3 )
+                , m_errors( Kernel::kRows * m_stride, 0 )
+            {
+            }
+
+            // Reads src, writes palette colours to dst (width RGB pixels
+            // each). dst may be src.
+            void ditherRow( const uint8_t* src, uint8_t* dst )
+            {
+                const size_t rows = Kernel::kRows;
+                // The row rows - 1 below gets the one the last row used
+                int16_t* newest = errorRow( m_row + rows - 1 );
+                std::fill( newest - Kernel::kReach * 3,
+                           newest - Kernel::kReach * 3 + m_stride, 0 );
+                int16_t* error[ Kernel::kRows ];
+                if ( m_serpentine && m_row % 2 == 1 )
+                {
+                    const size_t last = ( m_width - 1 ) * 3;
+                    for ( size_t dy = 0; dy < rows; ++dy )
+                    {
+                        error[dy] = errorRow( m_row + dy ) + last;
+                    }
+                    for ( size_t col = m_width; col-- > 0; )
+                    {
+                        detail::diffusePixel<Kernel, -1>(
+                            src + col * 3, dst + col * 3, error, m_q );
+                        for ( size_t dy = 0; dy < rows; ++dy )
+                        {
+                            error[dy] -= 3;
+                        }
+                    }
+                }
+                else
+                {
+                    for ( size_t dy = 0; dy < rows; ++dy )
+                    {
+                        error[dy] = errorRow( m_row + dy );
+                    }
+                    for ( size_t col = 0; col < m_width; ++col )
+                    {
+                        detail::diffusePixel<Kernel, 1>(
+                            src + col * 3, dst + col * 3, error, m_q );
+                        for ( size_t dy = 0; dy < rows; ++dy )
+                        {
+                            error[dy] += 3;
+                        }
+                    }
+                }
+                ++m_row;
+            }
+
+        private:
+            int16_t* errorRow( size_t row )
+            {
+                return &m_errors[ ( row % Kernel::kRows ) * m_stride + Kernel::kReach * 3 ];
+            }
+
+            size_t m_width;
+            const Matcher& m_q;
+            bool m_serpentine;
+            size_t m_stride;
+            std::vector<int16_t> m_errors;
+            size_t m_row = 0;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
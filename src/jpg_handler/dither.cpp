@@ -0,0 +1,488 @@
+#include "dither.h"
+#include "diffusion.h"
+#include "palette.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+// A square threshold matrix: the order in which its cells switch on
+struct Matrix
+{
+    size_t size;
+    std::vector<uint32_t> ranks; // 0 to size * size - 1, each once
+};
+
+// Each step doubles the size: [ 4M 4M+2 ; 4M+3 4M+1 ]
+Matrix makeBayer( size_t size )
+{
+    Matrix m{ 1, { 0 } };
+    while ( m.size < size )
+    {
+        const size_t n = m.size;
+        Matrix next{ n * 2, std::vector<uint32_t>( n * n * 4 ) };
+        static const uint32_t quadrant[4] = { 0, 2, 3, 1 };
+        for ( size_t y = 0; y < n * 2; ++y )
+        {
+            for ( size_t x = 0; x < n * 2; ++x )
+            {
+                next.ranks[ y * n * 2 + x ] = 4 * m.ranks[ ( y % n ) * n + x % n ]
+                    + quadrant[ ( y / n ) * 2 + x / n ];
+            }
+        }
+        m = std::move( next );
+    }
+    return m;
+}
+
+// Ulichney's void-and-cluster: points are added where they are furthest
+// from all the others (the biggest void), and taken away where they are
+// most crowded (the tightest cluster), judged by a Gaussian "energy" which
+// wraps around the edges so the matrix tiles without seams. Ranked in the
+// order they go in, that leaves no low frequency structure. The seed is
+// fixed, so the matrix (and so the output) is the same every time.
+Matrix makeBlueNoise( size_t size )
+{
+    const size_t count = size * size;
+    const double sigma = 1.5;
+
+    // The energy one point adds at each (wrapped) offset from it
+    std::vector<double> kernel( count );
+    for ( size_t y = 0; y < size; ++y )
+    {
+        for ( size_t x = 0; x < size; ++x )
+        {
+            const double dx = std::min( x, size - x );
+            const double dy = std::min( y, size - y );
+            kernel[ y * size + x ] = std::exp( -( dx * dx + dy * dy ) / ( 2 * sigma * sigma ) );
+        }
+    }
+    std::vector<double> energy( count, 0 );
+    std::vector<char> on( count, false );
+    const auto toggle = [&]( size_t idx, bool value )
+        {
+            on[idx] = value;
+            const double sign = value ? 1 : -1;
+            const size_t px = idx % size;
+            const size_t py = idx / size;
+            for ( size_t y = 0; y < size; ++y )
+            {
+                // The kernel row, wrapped round to start at px
+                const double* k = &kernel[ ( ( y + size - py ) % size ) * size ];
+                double* e = &energy[ y * size ];
+                for ( size_t x = 0; x < px; ++x )
+                {
+                    e[x] += sign * k[ x + size - px ];
+                }
+                for ( size_t x = px; x < size; ++x )
+                {
+                    e[x] += sign * k[ x - px ];
+                }
+            }
+        };
+    const auto tightestCluster = [&]()
+        {
+            size_t best = 0;
+            double most = -1;
+            for ( size_t i = 0; i < count; ++i )
+            {
+                if ( on[i] && energy[i] > most )
+                {
+                    most = energy[i];
+                    best = i;
+                }
+            }
+            return best;
+        };
+    const auto largestVoid = [&]()
+        {
+            size_t best = 0;
+            double least = 1e300;
+            for ( size_t i = 0; i < count; ++i )
+            {
+                if ( ! on[i] && energy[i] < least )
+                {
+                    least = energy[i];
+                    best = i;
+                }
+            }
+            return best;
+        };
+
+    // A random tenth of the points to start with, then spread them out
+    // evenly: keep moving the most crowded one to the emptiest spot until
+    // that is where it came from
+    uint32_t seed = 12345;
+    const size_t initial = count / 10;
+    for ( size_t placed = 0; placed < initial; )
+    {
+        seed = seed * 1664525u + 1013904223u;
+        const size_t idx = ( seed >> 8 ) % count;
+        if ( ! on[idx] )
+        {
+            toggle( idx, true );
+            ++placed;
+        }
+    }
+    for ( ;; )
+    {
+        const size_t cluster = tightestCluster();
+        toggle( cluster, false );
+        const size_t hole = largestVoid();
+        toggle( hole, true );
+        if ( hole == cluster )
+        {
+            break;
+        }
+    }
+    const std::vector<char> prototype = on;
+    const std::vector<double> prototypeEnergy = energy;
+
+    Matrix m{ size, std::vector<uint32_t>( count ) };
+    // The initial points rank below the rest, the most crowded lowest
+    for ( size_t rank = initial; rank-- > 0; )
+    {
+        const size_t cluster = tightestCluster();
+        toggle( cluster, false );
+        m.ranks[cluster] = rank;
+    }
+    // and then the rest go in, each into the biggest gap there is
+    on = prototype;
+    energy = prototypeEnergy;
+    for ( size_t rank = initial; rank < count; ++rank )
+    {
+        const size_t hole = largestVoid();
+        toggle( hole, true );
+        m.ranks[hole] = rank;
+    }
+    return m;
+}
+
+const Matrix& bayerMatrix()
+{
+    static const Matrix m = makeBayer( 8 );
+    return m;
+}
+
+const Matrix& blueNoiseMatrix()
+{
+    static const Matrix m = makeBlueNoise( 64 );
+    return m;
+}
+
+// How far apart the palette's levels would be if its colours were an even
+// grid over the RGB cube: 255 for up to 8 colours, 127 for 27 and so on.
+// The threshold is spread over that much, so a flat area comes out as a
+// mix of the two nearest levels.
+int thresholdSpread( size_t paletteSize )
+{
+    const int levels = static_cast<int>( std::lround( std::cbrt( static_cast<double>( paletteSize ) ) ) );
+    return 255 / std::max( 1, levels - 1 );
+}
+
+// A matrix's ranks as offsets to add to the pixels: ( rank + 0.5 ) / cells
+// - 0.5, times the spread, worked out once per cell
+class Thresholds
+{
+public:
+    Thresholds( const Matrix& matrix, size_t paletteSize )
+        : m_size( matrix.size )
+        , m_offsets( matrix.size * matrix.size )
+    {
+        const size_t cells = m_offsets.size();
+        const int spread = thresholdSpread( paletteSize );
+        for ( size_t i = 0; i < cells; ++i )
+        {
+            m_offsets[i] = static_cast<int16_t>( std::lround(
+                ( ( matrix.ranks[i] + 0.5 ) / cells - 0.5 ) * spread ) );
+        }
+    }
+
+    template <typename Matcher>
+    void ditherRow( const uint8_t* src, uint8_t* dst, size_t width,
+                    size_t row, const Matcher& q ) const
+    {
+        const int16_t* offset = &m_offsets[ ( row % m_size ) * m_size ];
+        for ( size_t col = 0; col < width; ++col, src += 3, dst += 3 )
+        {
+            const int t = offset[ col % m_size ];
+            const uint8_t* colour = q.getColour( q.nearest(
+                std::min( 255, std::max( 0, src[0] + t ) ),
+                std::min( 255, std::max( 0, src[1] + t ) ),
+                std::min( 255, std::max( 0, src[2] + t ) ) ) );
+            dst[0] = colour[0];
+            dst[1] = colour[1];
+            dst[2] = colour[2];
+        }
+    }
+
+private:
+    size_t m_size;
+    std::vector<int16_t> m_offsets;
+};
+
+const Matrix& matrixFor( Dither method )
+{
+    return method == Dither::Bayer ? bayerMatrix() : blueNoiseMatrix();
+}
+
+// What the dither templates need of a palette, nearest() and getColour(),
+// for each Match. Both are just references, cheap to copy.
+struct RedmeanMatcher
+{
+    const Quantizer& q;
+    size_t nearest( uint8_t r, uint8_t g, uint8_t b ) const
+    {
+        return q.nearest( r, g, b );
+    }
+    const uint8_t* getColour( size_t idx ) const { return q.getColour( idx ); }
+};
+
+struct PerceptualMatcher
+{
+    const Palette& palette;
+    Match match;
+    size_t nearest( uint8_t r, uint8_t g, uint8_t b ) const
+    {
+        return palette.nearest( r, g, b, match );
+    }
+    const uint8_t* getColour( size_t idx ) const { return palette.getColour( idx ); }
+};
+
+// Calls fn with the matcher for match, so each gets its own inner loops
+template <typename Fn>
+void withMatcher( const Palette& palette, Match match, Fn&& fn )
+{
+    if ( match == Match::Redmean )
+    {
+        fn( RedmeanMatcher{ palette.getQuantizer() } );
+    }
+    else
+    {
+        fn( PerceptualMatcher{ palette, match } );
+    }
+}
+
+bool isOrdered( Dither method )
+{
+    return method == Dither::Bayer || method == Dither::BlueNoise;
+}
+
+template <typename Matcher>
+void orderedDither( Bitmap& bitmap, const Matcher& q, size_t paletteSize,
+                    const Matrix& matrix, unsigned threads )
+{
+    const Thresholds thresholds( matrix, paletteSize );
+    const size_t width = bitmap.getWidth();
+    const size_t height = bitmap.getHeight();
+    const size_t bandRows = 16;
+    runWorkStealing( ( height + bandRows - 1 ) / bandRows, threads,
+        [&]( unsigned, size_t band )
+        {
+            const size_t last = std::min( height, ( band + 1 ) * bandRows );
+            for ( size_t row = band * bandRows; row < last; ++row )
+            {
+                thresholds.ditherRow( bitmap.getRow( row ), bitmap.getRow( row ),
+                                      width, row, q );
+            }
+        } );
+}
+
+} // namespace
+
+struct RowDitherer::Impl
+{
+    virtual ~Impl() {}
+    virtual void ditherRow( const uint8_t* src, uint8_t* dst ) = 0;
+};
+
+namespace
+{
+
+template <typename Kernel, typename Matcher>
+struct DiffuserImpl : RowDitherer::Impl
+{
+    DiffuserImpl( size_t width, const Matcher& q, bool serpentine )
+        : q( q )
+        , diffuser( width, this->q, serpentine )
+    {
+    }
+    void ditherRow( const uint8_t* src, uint8_t* dst ) override
+    {
+        diffuser.ditherRow( src, dst );
+    }
+    Matcher q;
+    RowDiffuser<Kernel, Matcher> diffuser;
+};
+
+template <typename Matcher>
+struct OrderedImpl : RowDitherer::Impl
+{
+    OrderedImpl( size_t width, const Matcher& q, const Matrix& matrix,
+                 size_t paletteSize )
+        : width( width )
+        , q( q )
+        , thresholds( matrix, paletteSize )
+    {
+    }
+    void ditherRow( const uint8_t* src, uint8_t* dst ) override
+    {
+        thresholds.ditherRow( src, dst, width, row++, q );
+    }
+    size_t width;
+    Matcher q;
+    Thresholds thresholds;
+    size_t row = 0;
+};
+
+template <typename Matcher>
+RowDitherer::Impl* makeImpl( size_t width, const Matcher& q, size_t paletteSize,
+                             Dither method, bool serpentine )
+{
+    switch ( method )
+    {
+    case Dither::FloydSteinberg:
+        return new DiffuserImpl<FloydSteinbergKernel, Matcher>( width, q, serpentine );
+    case Dither::Atkinson:
+        return new DiffuserImpl<AtkinsonKernel, Matcher>( width, q, serpentine );
+    case Dither::JarvisJudiceNinke:
+        return new DiffuserImpl<JarvisJudiceNinkeKernel, Matcher>( width, q, serpentine );
+    case Dither::Stucki:
+        return new DiffuserImpl<StuckiKernel, Matcher>( width, q, serpentine );
+    case Dither::SierraLite:
+        return new DiffuserImpl<SierraLiteKernel, Matcher>( width, q, serpentine );
+    case Dither::Bayer:
+    case Dither::BlueNoise:
+        break;
+    }
+    return new OrderedImpl<Matcher>( width, q, matrixFor( method ), paletteSize );
+}
+
+template <typename Matcher>
+void diffuseBitmap( Bitmap& bitmap, const Matcher& q, Dither method,
+                    unsigned threads )
+{
+    switch ( method )
+    {
+    case Dither::FloydSteinberg:
+        diffuse<FloydSteinbergKernel>( bitmap, q, threads );
+        break;
+    case Dither::Atkinson:
+        diffuse<AtkinsonKernel>( bitmap, q, threads );
+        break;
+    case Dither::JarvisJudiceNinke:
+        diffuse<JarvisJudiceNinkeKernel>( bitmap, q, threads );
+        break;
+    case Dither::Stucki:
+        diffuse<StuckiKernel>( bitmap, q, threads );
+        break;
+    case Dither::SierraLite:
+        diffuse<SierraLiteKernel>( bitmap, q, threads );
+        break;
+    case Dither::Bayer:
+    case Dither::BlueNoise:
+        break;
+    }
+}
+
+} // namespace
+
+RowDitherer::RowDitherer( size_t width, const Palette& palette,
+                          Dither method, Scan scan, Match match )
+{
+    withMatcher( palette, match, [&]( const auto& q )
+        {
+            m_impl.reset( makeImpl( width, q, palette.size(), method,
+                                    scan == Scan::Serpentine ) );
+        } );
+}
+
+RowDitherer::~RowDitherer()
+{
+}
+
+void RowDitherer::ditherRow( const uint8_t* src, uint8_t* dst )
+{
+    m_impl->ditherRow( src, dst );
+}
+
+Dither ditherFromName( const std::string& name )
+{
+    if ( name == "floyd-steinberg" || name == "fs" )
+    {
+        return Dither::FloydSteinberg;
+    }
+    if ( name == "atkinson" )
+    {
+        return Dither::Atkinson;
+    }
+    if ( name == "jjn" || name == "jarvis-judice-ninke" )
+    {
+        return Dither::JarvisJudiceNinke;
+    }
+    if ( name == "stucki" )
+    {
+        return Dither::Stucki;
+    }
+    if ( name == "sierra-lite" )
+    {
+        return Dither::SierraLite;
+    }
+    if ( name == "bayer" )
+    {
+        return Dither::Bayer;
+    }
+    if ( name == "blue-noise" )
+    {
+        return Dither::BlueNoise;
+    }
+    throw std::invalid_argument( "Unknown dither method " + name );
+}
+
+void ditherBitmap( Bitmap& bitmap, const Palette& palette,
+                   Dither method, unsigned threads, Scan scan, Match match )
+{
+    if ( bitmap.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "Dithering to a palette needs an RGB image" );
+    }
+    if ( threads == 0 )
+    {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+    if ( ! isOrdered( method ) && ( threads == 1 || scan == Scan::Serpentine ) )
+    {
+        RowDitherer ditherer( bitmap.getWidth(), palette, method, scan, match );
+        for ( size_t row = 0; row < bitmap.getHeight(); ++row )
+        {
+            ditherer.ditherRow( bitmap.getRow( row ), bitmap.getRow( row ) );
+        }
+        return;
+    }
+    withMatcher( palette, match, [&]( const auto& q )
+        {
+            if ( isOrdered( method ) )
+            {
+                orderedDither( bitmap, q, palette.size(), matrixFor( method ), threads );
+            }
+            else
+            {
+                diffuseBitmap( bitmap, q, method, threads );
+            }
+        } );
+}
+
+} // namespace jpeg
+} // namespace marengo
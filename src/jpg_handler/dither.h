@@ -0,0 +1,89 @@
+#pragma once
+
+#include "bitmap.h"
+#include "palette.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        enum class Dither
+        {
+            FloydSteinberg,
+            Atkinson,
+            JarvisJudiceNinke,
+            Stucki,
+            SierraLite,
+            Bayer,             // 8x8 ordered
+            BlueNoise          // 64x64 ordered, void-and-cluster
+        };
+
+        // The order the error diffusion methods visit pixels in. Raster is
+        // left to right on every row. Serpentine goes right to left on
+        // every other row (with the kernel mirrored), which avoids the
+        // diagonal artifacts a one way scan leaves in flat areas, but
+        // each row needs the whole row above, so it can't be threaded.
+        // The ordered methods don't care.
+        enum class Scan
+        {
+            Raster,
+            Serpentine
+        };
+
+        // "floyd-steinberg" (or "fs"), "atkinson", "jjn", "stucki",
+        // "sierra-lite", "bayer" or "blue-noise". Will throw on anything
+        // else.
+        Dither ditherFromName( const std::string& name );
+
+        // Dithers an RGB bitmap to palette in place.
+        //
+        // The error diffusion methods keep their error in a few rows of
+        // int16 (diffusion.h) rather than adding it into the pixels the
+        // way fsdColor() does, so nothing wraps round, and the edges are
+        // dithered too. With Scan::Raster and threads > 1 the rows run as
+        // a wavefront. The ordered ones add a threshold from a fixed
+        // matrix to each pixel, scaled to the palette's spacing, and have
+        // no dependencies between pixels at all, so their rows are simply
+        // shared out between the threads. The output is the same whatever
+        // the thread count.
+        // match picks how the nearest palette colour is found (see
+        // palette.h); the perceptual ones share the palette's cache.
+        // Will throw if the bitmap isn't RGB.
+        void ditherBitmap( Bitmap& bitmap, const Palette& palette,
+                           Dither method, unsigned threads = 1,
+                           Scan scan = Scan::Raster,
+                           Match match = Match::Redmean );
+
+        // The same, one row at a time, top to bottom, for rows which are
+        // streamed in (e.g. from a ScanlineReader) or mustn't be written
+        // to. All it holds is the error rows, or the threshold matrix.
+        class RowDitherer
+        {
+        public:
+            // palette must outlive the RowDitherer
+            RowDitherer( size_t width, const Palette& palette, Dither method,
+                         Scan scan = Scan::Raster,
+                         Match match = Match::Redmean );
+            ~RowDitherer();
+
+            RowDitherer( const RowDitherer& ) = delete;
+            RowDitherer& operator=( const RowDitherer& ) = delete;
+
+            // Reads width RGB pixels from src and writes their palette
+            // colours to dst, which may be src
+            void ditherRow( const uint8_t* src, uint8_t* dst );
+
+            struct Impl;
+
+        private:
+            std::unique_ptr<Impl> m_impl;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
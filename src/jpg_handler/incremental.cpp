@@ -0,0 +1,196 @@
+#include "incremental.h"
+#include "jpeg.h"
+#include "kernels.h"
+#include "palette.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+const size_t IncrementalDitherer::kBandRows;
+
+namespace
+{
+
+// Whether rows a and b, of rowSize bytes, differ by more than tolerance
+// in any byte
+bool rowDiffers( const uint8_t* a, const uint8_t* b, size_t rowSize,
+                 unsigned tolerance )
+{
+    if ( tolerance == 0 )
+    {
+        return std::memcmp( a, b, rowSize ) != 0;
+    }
+    for ( size_t i = 0; i < rowSize; ++i )
+    {
+        if ( static_cast<unsigned>( std::abs( a[i] - b[i] ) ) > tolerance )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The kernels add error to a row a byte at a time, wrapping as uint8_t
+// does, so the error a row was given comes back exactly from the
+// difference, wrapped the same way, and adds onto any other source row
+void subtractRows( const uint8_t* a, const uint8_t* b, uint8_t* difference,
+                   size_t rowSize )
+{
+    for ( size_t i = 0; i < rowSize; ++i )
+    {
+        difference[i] = static_cast<uint8_t>( a[i] - b[i] );
+    }
+}
+
+void addRow( uint8_t* row, const uint8_t* error, size_t rowSize )
+{
+    for ( size_t i = 0; i < rowSize; ++i )
+    {
+        row[i] = static_cast<uint8_t>( row[i] + error[i] );
+    }
+}
+
+} // namespace
+
+IncrementalDitherer::IncrementalDitherer( const Palette& palette, unsigned tolerance )
+    : m_palette( palette )
+    , m_tolerance( tolerance )
+{
+}
+
+void IncrementalDitherer::reset()
+{
+    m_source = Bitmap();
+    m_output = Bitmap();
+    m_bandErrors = Bitmap();
+    m_ring = Bitmap();
+    m_dirty.clear();
+    m_rowsDithered = 0;
+}
+
+const std::vector<DirtyRect>& IncrementalDitherer::dither( const Image& frame )
+{
+    if ( frame.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "fsdColor needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "incremental.dither" );
+    const size_t width = frame.getWidth();
+    const size_t height = frame.getHeight();
+    const size_t rowSize = width * 3;
+    m_dirty.clear();
+    m_rowsDithered = 0;
+    if ( width == 0 || height == 0 )
+    {
+        return m_dirty;
+    }
+
+    // The first row to re-dither
+    size_t first = 0;
+    const bool whole = m_source.getWidth() != width || m_source.getHeight() != height;
+    if ( whole )
+    {
+        m_source = Bitmap( width, height, 3 );
+        m_output = Bitmap( width, height, 3 );
+        m_bandErrors = Bitmap( width, ( height + kBandRows - 1 ) / kBandRows, 3 );
+        m_ring = Bitmap( width, 2, 3 );
+    }
+    else
+    {
+        while ( first < height
+                && ! rowDiffers( frame.getRow( first ), m_source.getRow( first ),
+                                 rowSize, m_tolerance ) )
+        {
+            ++first;
+        }
+        if ( first == height )
+        {
+            return m_dirty;
+        }
+    }
+
+    // Rows in a band before the changed one still need dithering again,
+    // as only the band's first row was kept
+    const size_t start = first / kBandRows * kBandRows;
+    for ( size_t y = first; y < height; ++y )
+    {
+        std::memcpy( m_source.getRow( y ), frame.getRow( y ), rowSize );
+    }
+
+    const Quantizer& quantizer = m_palette.getQuantizer();
+    const kernels::Kernels& k = kernels::kernels();
+    std::memcpy( m_ring.getRow( start % 2 ), m_source.getRow( start ), rowSize );
+    if ( start != 0 )
+    {
+        addRow( m_ring.getRow( start % 2 ), m_bandErrors.getRow( start / kBandRows ),
+                rowSize );
+    }
+    for ( size_t band = start / kBandRows; band * kBandRows < height; ++band )
+    {
+        const size_t top = band * kBandRows;
+        const size_t bottom = std::min( height, top + kBandRows );
+        size_t left = width;
+        size_t right = 0;
+        for ( size_t y = top; y < bottom; ++y )
+        {
+            uint8_t* cur = m_ring.getRow( y % 2 );
+            uint8_t* next = nullptr;
+            if ( y + 1 < height )
+            {
+                next = m_ring.getRow( ( y + 1 ) % 2 );
+                std::memcpy( next, m_source.getRow( y + 1 ), rowSize );
+            }
+            if ( y == top && y != 0 )
+            {
+                subtractRows( cur, m_source.getRow( y ), m_bandErrors.getRow( band ),
+                              rowSize );
+            }
+            k.fsdColorRow( cur, next, width, 0, width, quantizer );
+
+            uint8_t* out = m_output.getRow( y );
+            for ( size_t x = 0; x < width; ++x )
+            {
+                if ( std::memcmp( cur + x * 3, out + x * 3, 3 ) != 0 )
+                {
+                    left = std::min( left, x );
+                    right = x + 1;
+                }
+            }
+            std::memcpy( out, cur, rowSize );
+        }
+        if ( right == 0 )
+        {
+            continue;
+        }
+        // One rect for a run of bands changed across the same columns
+        if ( ! m_dirty.empty() )
+        {
+            DirtyRect& last = m_dirty.back();
+            if ( last.y + last.height == top && last.x == left
+                 && last.width == right - left )
+            {
+                last.height += bottom - top;
+                continue;
+            }
+        }
+        m_dirty.push_back( { left, top, right - left, bottom - top } );
+    }
+    if ( whole )
+    {
+        m_dirty.assign( 1, DirtyRect{ 0, 0, width, height } );
+    }
+    m_rowsDithered = height - start;
+    MARENGO_TRACE_COUNT( "incremental.rows", m_rowsDithered );
+    return m_dirty;
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "bitmap.h"
+#include "panel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Image;
+        class Palette;
+
+        // fsdColor() for a camera looking at a mostly still scene, which
+        // only re-dithers what a new frame could have changed.
+        //
+        // Floyd-Steinberg error only ever flows right and down, so rows
+        // above the first one whose source changed dither exactly as they
+        // did last time. Each frame, the source rows are compared with the
+        // last frame's; the output above the first changed row is kept,
+        // and the dither restarts from the top of its band of kBandRows.
+        // To restart there exactly, the ditherer keeps the error the row
+        // above diffused into the first row of every band, which depends
+        // only on the rows above. So the output is always just what
+        // fsdColor( palette ) would give for the frame.
+        //
+        // Memory: the last frame's source and output, plus a row per band.
+        class IncrementalDitherer
+        {
+        public:
+            static const size_t kBandRows = 16;
+
+            // With a tolerance, source pixels which differ from the last
+            // frame's by no more than that in every channel count as the
+            // same. That keeps sensor noise from re-dithering everything,
+            // but the output is then only fsdColor()'s for the frame whose
+            // rows were last dithered.
+            explicit IncrementalDitherer( const Palette& palette,
+                                          unsigned tolerance = 0 );
+
+            // Dithers frame (which must be RGB). Returns the rectangles of
+            // output which changed, top to bottom, no more than one per
+            // band: nothing if the frame looks the same, everything if it
+            // is the first or a new size.
+            const std::vector<DirtyRect>& dither( const Image& frame );
+
+            // The dithered frame
+            const Bitmap& getOutput() const { return m_output; }
+
+            // Rows re-dithered by the last dither()
+            size_t getRowsDithered() const { return m_rowsDithered; }
+
+            // Forgets the last frame, so the next one is done in full
+            void reset();
+
+        private:
+            const Palette& m_palette;
+            unsigned m_tolerance;
+            Bitmap m_source;
+            Bitmap m_output;
+            // Row b: the error diffused into the first row of band b
+            Bitmap m_bandErrors;
+            // Rows being dithered: cur and next
+            Bitmap m_ring;
+            std::vector<DirtyRect> m_dirty;
+            size_t m_rowsDithered = 0;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
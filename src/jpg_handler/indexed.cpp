@@ -0,0 +1,252 @@
+#include "indexed.h"
+#include "jpeg.h"
+#include "palette.h"
+
+#include <zlib.h>
+
+#include <fstream>
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+std::ofstream openForSaving( const std::string& fileName )
+{
+    std::ofstream ofs( fileName, std::ios::out | std::ios::binary );
+    if ( ! ofs )
+    {
+        throw std::runtime_error(
+            "Could not open " + fileName + " for saving"
+            );
+    }
+    return ofs;
+}
+
+void checkWritten( std::ofstream& ofs, const std::string& fileName )
+{
+    ofs.close();
+    if ( ! ofs )
+    {
+        throw std::runtime_error( "Could not write " + fileName );
+    }
+}
+
+void putBigEndian( std::vector<uint8_t>& out, uint32_t v )
+{
+    out.push_back( v >> 24 );
+    out.push_back( ( v >> 16 ) & 0xFF );
+    out.push_back( ( v >> 8 ) & 0xFF );
+    out.push_back( v & 0xFF );
+}
+
+// A PNG chunk: length, type, data, then a CRC of the type and data
+void writePngChunk( std::ofstream& ofs, const char* type,
+                    const std::vector<uint8_t>& data )
+{
+    std::vector<uint8_t> chunk;
+    chunk.reserve( data.size() + 12 );
+    putBigEndian( chunk, data.size() );
+    chunk.insert( chunk.end(), type, type + 4 );
+    chunk.insert( chunk.end(), data.begin(), data.end() );
+    uLong crc = ::crc32( 0L, Z_NULL, 0 );
+    crc = ::crc32( crc, chunk.data() + 4, chunk.size() - 4 );
+    putBigEndian( chunk, crc );
+    ofs.write( reinterpret_cast<const char*>( chunk.data() ), chunk.size() );
+}
+
+} // namespace
+
+IndexedImage::IndexedImage( size_t width, size_t height,
+                            const Palette& palette, unsigned bitsPerPixel )
+    : m_width( width )
+    , m_height( height )
+    , m_colours( palette.getColour( 0 ), palette.getColour( 0 ) + palette.size() * 3 )
+{
+    if ( bitsPerPixel == 0 )
+    {
+        bitsPerPixel = 1;
+        while ( ( 1u << bitsPerPixel ) < palette.size() )
+        {
+            bitsPerPixel *= 2;
+        }
+    }
+    if ( bitsPerPixel != 1 && bitsPerPixel != 2 && bitsPerPixel != 4
+         && bitsPerPixel != 8 )
+    {
+        throw std::invalid_argument( "Bits per pixel must be 1, 2, 4 or 8" );
+    }
+    if ( palette.size() > ( 1u << bitsPerPixel ) )
+    {
+        throw std::invalid_argument(
+            "Palette too big for " + std::to_string( bitsPerPixel )
+            + " bits per pixel"
+            );
+    }
+    m_bitsPerPixel = bitsPerPixel;
+    m_mask = ( 1u << bitsPerPixel ) - 1;
+    m_stride = ( width * bitsPerPixel + 7 ) / 8;
+    m_data.assign( m_stride * height, 0 );
+}
+
+IndexedImage IndexedImage::fromImage( const Image& image,
+                                      const Palette& palette,
+                                      unsigned bitsPerPixel )
+{
+    if ( image.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "IndexedImage needs an RGB image" );
+    }
+    IndexedImage indexed( image.getWidth(), image.getHeight(),
+                          palette, bitsPerPixel );
+    const Quantizer& quantizer = palette.getQuantizer();
+    const unsigned bits = indexed.m_bitsPerPixel;
+    for ( size_t row = 0; row < indexed.m_height; ++row )
+    {
+        const uint8_t* src = image.getRow( row );
+        uint8_t* dst = indexed.getRow( row );
+        // Fill a byte at a time rather than through setIndex()
+        unsigned byte = 0;
+        unsigned used = 0;
+        for ( size_t col = 0; col < indexed.m_width; ++col, src += 3 )
+        {
+            byte = ( byte << bits ) | quantizer.nearest( src[0], src[1], src[2] );
+            used += bits;
+            if ( used == 8 )
+            {
+                *dst++ = byte;
+                byte = 0;
+                used = 0;
+            }
+        }
+        if ( used > 0 )
+        {
+            *dst = byte << ( 8 - used );
+        }
+    }
+    return indexed;
+}
+
+void IndexedImage::saveRaw( const std::string& fileName ) const
+{
+    std::ofstream ofs = openForSaving( fileName );
+    ofs.write( reinterpret_cast<const char*>( m_data.data() ), m_data.size() );
+    checkWritten( ofs, fileName );
+}
+
+void IndexedImage::savePgm( const std::string& fileName ) const
+{
+    std::ofstream ofs = openForSaving( fileName );
+    ofs << "P5 " << m_width << " " << m_height << " "
+        << static_cast<unsigned>( m_mask ) << "\n";
+    std::vector<uint8_t> line( m_width );
+    for ( size_t row = 0; row < m_height; ++row )
+    {
+        for ( size_t col = 0; col < m_width; ++col )
+        {
+            line[col] = getIndex( col, row );
+        }
+        ofs.write( reinterpret_cast<const char*>( line.data() ), line.size() );
+    }
+    checkWritten( ofs, fileName );
+}
+
+void IndexedImage::savePbm( const std::string& fileName ) const
+{
+    if ( getPaletteSize() > 2 )
+    {
+        throw std::runtime_error( "PBM needs a 2 colour palette" );
+    }
+    // PBM has 1 for black
+    const auto brightness = [this]( size_t idx )
+        {
+            if ( idx >= getPaletteSize() )
+            {
+                return 0;
+            }
+            return m_colours[ idx * 3 ] + m_colours[ idx * 3 + 1 ]
+                 + m_colours[ idx * 3 + 2 ];
+        };
+    const uint8_t black = brightness( 0 ) <= brightness( 1 ) ? 0 : 1;
+
+    std::ofstream ofs = openForSaving( fileName );
+    ofs << "P4 " << m_width << " " << m_height << "\n";
+    if ( m_bitsPerPixel == 1 )
+    {
+        // Already packed the PBM way; at most the bits need flipping
+        std::vector<uint8_t> line( m_stride );
+        for ( size_t row = 0; row < m_height; ++row )
+        {
+            const uint8_t* src = getRow( row );
+            for ( size_t i = 0; i < m_stride; ++i )
+            {
+                line[i] = black == 1 ? src[i] : ~src[i];
+            }
+            ofs.write( reinterpret_cast<const char*>( line.data() ), line.size() );
+        }
+    }
+    else
+    {
+        std::vector<uint8_t> line( ( m_width + 7 ) / 8 );
+        for ( size_t row = 0; row < m_height; ++row )
+        {
+            std::fill( line.begin(), line.end(), 0 );
+            for ( size_t col = 0; col < m_width; ++col )
+            {
+                if ( getIndex( col, row ) == black )
+                {
+                    line[ col / 8 ] |= 0x80 >> ( col % 8 );
+                }
+            }
+            ofs.write( reinterpret_cast<const char*>( line.data() ), line.size() );
+        }
+    }
+    checkWritten( ofs, fileName );
+}
+
+void IndexedImage::savePng( const std::string& fileName ) const
+{
+    // Every row gets a filter type byte in front. 0 (none) suits dithered
+    // images, which the predicting filters do little for.
+    std::vector<uint8_t> raw;
+    raw.reserve( ( m_stride + 1 ) * m_height );
+    for ( size_t row = 0; row < m_height; ++row )
+    {
+        raw.push_back( 0 );
+        raw.insert( raw.end(), getRow( row ), getRow( row ) + m_stride );
+    }
+    uLongf packedSize = ::compressBound( raw.size() );
+    std::vector<uint8_t> packed( packedSize );
+    if ( ::compress2( packed.data(), &packedSize, raw.data(), raw.size(),
+                      Z_BEST_COMPRESSION ) != Z_OK )
+    {
+        throw std::runtime_error( "Could not compress " + fileName );
+    }
+    packed.resize( packedSize );
+
+    std::vector<uint8_t> header;
+    putBigEndian( header, m_width );
+    putBigEndian( header, m_height );
+    header.push_back( m_bitsPerPixel );
+    header.push_back( 3 ); // colour type: palette
+    header.push_back( 0 ); // compression: deflate
+    header.push_back( 0 ); // filter method
+    header.push_back( 0 ); // not interlaced
+
+    std::ofstream ofs = openForSaving( fileName );
+    static const char signature[8] = {
+        '\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n' };
+    ofs.write( signature, sizeof( signature ) );
+    writePngChunk( ofs, "IHDR", header );
+    writePngChunk( ofs, "PLTE", m_colours );
+    writePngChunk( ofs, "IDAT", packed );
+    writePngChunk( ofs, "IEND", std::vector<uint8_t>() );
+    checkWritten( ofs, fileName );
+}
+
+} // namespace jpeg
+} // namespace marengo
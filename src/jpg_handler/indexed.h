@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Image;
+        class Palette;
+
+        // An image stored as palette indices, bit-packed 1, 2, 4 or 8 bits
+        // to a pixel, e.g. the result of fsdColor() on its way to a panel.
+        // At 4 bits that is a sixth of the memory of the RGB version, and
+        // the writers below store it losslessly, without JPEG smearing the
+        // dither pattern.
+        //
+        // Rows are packed first pixel in the top bits (as PNG and most
+        // framebuffers expect) and padded to a whole byte.
+        class IndexedImage
+        {
+        public:
+            // All pixels start as index 0. bitsPerPixel is 1, 2, 4 or 8;
+            // 0 picks the smallest that fits the palette. Will throw if the
+            // palette doesn't fit in bitsPerPixel.
+            IndexedImage( size_t width, size_t height, const Palette& palette,
+                          unsigned bitsPerPixel = 0 );
+
+            // Each pixel of image (which must be RGB) becomes the index of
+            // its nearest palette entry. After fsdColor( palette ) that is
+            // an exact match for every pixel.
+            static IndexedImage fromImage( const Image& image,
+                                           const Palette& palette,
+                                           unsigned bitsPerPixel = 0 );
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            unsigned getBitsPerPixel() const { return m_bitsPerPixel; }
+            // Bytes per packed row
+            size_t getStride() const { return m_stride; }
+            size_t getPaletteSize() const { return m_colours.size() / 3; }
+
+            const uint8_t* getData() const { return m_data.data(); }
+            uint8_t* getRow( size_t y ) { return &m_data[ y * m_stride ]; }
+            const uint8_t* getRow( size_t y ) const
+            {
+                return &m_data[ y * m_stride ];
+            }
+
+            // No bounds checking is done on x, y or idx
+            uint8_t getIndex( size_t x, size_t y ) const
+            {
+                const size_t bit = x * m_bitsPerPixel;
+                const unsigned shift = 8 - m_bitsPerPixel - bit % 8;
+                return ( getRow( y )[ bit / 8 ] >> shift ) & m_mask;
+            }
+            void setIndex( size_t x, size_t y, uint8_t idx )
+            {
+                const size_t bit = x * m_bitsPerPixel;
+                const unsigned shift = 8 - m_bitsPerPixel - bit % 8;
+                uint8_t& byte = getRow( y )[ bit / 8 ];
+                byte = ( byte & ~( m_mask << shift ) ) | ( idx << shift );
+            }
+
+            // The writers all throw if fileName cannot be written.
+
+            // Just the packed rows, no header: a framebuffer dump
+            void saveRaw( const std::string& fileName ) const;
+
+            // 8 bit PGM (P5) of the indices themselves
+            void savePgm( const std::string& fileName ) const;
+
+            // PBM (P4). Only for 2 colour palettes: pixels whose colour is
+            // the darker of the two come out black.
+            void savePbm( const std::string& fileName ) const;
+
+            // PNG with a palette (colour type 3), at getBitsPerPixel()
+            void savePng( const std::string& fileName ) const;
+
+        private:
+            size_t m_width;
+            size_t m_height;
+            unsigned m_bitsPerPixel;
+            uint8_t m_mask;
+            size_t m_stride;
+            std::vector<uint8_t> m_data;
+            std::vector<uint8_t> m_colours; // RGB triplets
+        };
+
+    } // namespace jpeg
+} // namespace marengo
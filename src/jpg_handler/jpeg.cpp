@@ -1,49 +1,246 @@
 #include "jpeg.h"
-
+#include "arena.h"
+#include "kernels.h"
+#include "palette.h"
+#include "summedarea.h"
+#include "tjcodec.h"
+#include "trace.h"
+#include "wavefront.h"
+
+#include <cstdio>
+#include <fcntl.h>
 #include <jpeglib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include <cmath>
+namespace marengo
+{
+namespace jpeg
+{
 
+namespace
+{
 
-#define BLUE_H 0X38488d
-#define GREEN_H 0X547a49
-#define RED_H 0X9f4b4e
-#define BLACK_H 0X242933
-#define YELLOW_H 0Xc9d168
-#define ORANGE_H 0Xb55d4c
-#define WHITE_H 0Xd3dde4
+// A pointer to each row of bitmap, for libjpeg's multi-row calls, from
+// arena
+::JSAMPROW* rowPointers( Bitmap& bitmap, ScratchArena& arena )
+{
+    ::JSAMPROW* rows = arena.allocate<::JSAMPROW>( bitmap.getHeight() );
+    for ( size_t row = 0; row < bitmap.getHeight(); ++row )
+    {
+        rows[row] = bitmap.getRow( row );
+    }
+    return rows;
+}
 
-enum colors { BLUE = 0, GREEN, RED, BLACK, YELLOW, ORANGE, WHITE };
+// Without this libjpeg prints the error message and calls exit()
+void throwJpegError( ::j_common_ptr cinfo )
+{
+    char jpegLastErrorMsg[JMSG_LENGTH_MAX];
+    // Call the function pointer to get the error message
+    ( *( cinfo->err->format_message ) )( cinfo, jpegLastErrorMsg );
+    throw std::runtime_error( jpegLastErrorMsg );
+}
 
+// A whole file mapped read-only into memory, for jpeg_mem_src
+class MappedFile
+{
+public:
+    explicit MappedFile( const std::string& fileName )
+    {
+        const int fd = ::open( fileName.c_str(), O_RDONLY );
+        if ( fd < 0 )
+        {
+            throw std::runtime_error( "Could not open " + fileName );
+        }
+        struct stat st;
+        if ( ::fstat( fd, &st ) != 0 || st.st_size == 0 )
+        {
+            ::close( fd );
+            throw std::runtime_error(
+                "File does not seem to be a normal JPEG"
+                );
+        }
+        m_size = st.st_size;
+        m_data = ::mmap( nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        ::close( fd ); // the mapping keeps the file open
+        if ( m_data == MAP_FAILED )
+        {
+            throw std::runtime_error( "Could not map " + fileName );
+        }
+    }
+    ~MappedFile()
+    {
+        ::munmap( m_data, m_size );
+    }
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator=( const MappedFile& ) = delete;
+
+    unsigned char* data() const { return static_cast<unsigned char*>( m_data ); }
+    size_t size() const { return m_size; }
+
+private:
+    void* m_data;
+    size_t m_size;
+};
+
+// A libjpeg destination which encodes into a std::vector. The vector is
+// grown as needed and trimmed to the JPEG's size at the end, but its
+// capacity is kept, so reusing one vector frame after frame soon stops
+// allocating at all.
+const size_t kMinBufferSize = 64 * 1024;
+
+// Optimised Huffman tables are written over the compressor's own, which
+// jpeg_set_defaults() then leaves alone, so an Encoder's next image would
+// get this one's. This keeps a copy of the standard ones and puts them
+// back, however the encode ends.
+class HuffmanTables
+{
+public:
+    ~HuffmanTables()
+    {
+        if ( m_info == nullptr )
+        {
+            return;
+        }
+        for ( int i = 0; i < NUM_HUFF_TBLS; ++i )
+        {
+            restore( m_info->dc_huff_tbl_ptrs[i], m_dc[i] );
+            restore( m_info->ac_huff_tbl_ptrs[i], m_ac[i] );
+        }
+    }
 
+    void save( ::jpeg_compress_struct* info )
+    {
+        m_info = info;
+        for ( int i = 0; i < NUM_HUFF_TBLS; ++i )
+        {
+            copy( info->dc_huff_tbl_ptrs[i], m_dc[i] );
+            copy( info->ac_huff_tbl_ptrs[i], m_ac[i] );
+        }
+    }
 
-namespace marengo
+private:
+    static void copy( const ::JHUFF_TBL* table, ::JHUFF_TBL& into )
+    {
+        if ( table != nullptr )
+        {
+            into = *table;
+        }
+    }
+
+    static void restore( ::JHUFF_TBL* table, const ::JHUFF_TBL& from )
+    {
+        if ( table != nullptr )
+        {
+            *table = from;
+        }
+    }
+
+    ::jpeg_compress_struct* m_info = nullptr;
+    ::JHUFF_TBL m_dc[NUM_HUFF_TBLS];
+    ::JHUFF_TBL m_ac[NUM_HUFF_TBLS];
+};
+
+void writeAll( FILE* fp, const std::vector<uint8_t>& data, const std::string& fileName )
 {
-namespace jpeg
+    if ( std::fwrite( data.data(), 1, data.size(), fp ) != data.size() )
+    {
+        throw std::runtime_error( "Could not write " + fileName );
+    }
+}
+
+struct VectorDestination
+{
+    ::jpeg_destination_mgr mgr;
+    std::vector<uint8_t>* buffer;
+
+    explicit VectorDestination( std::vector<uint8_t>& buf )
+        : buffer( &buf )
+    {
+        mgr.init_destination = init;
+        mgr.empty_output_buffer = grow;
+        mgr.term_destination = term;
+    }
+
+    static VectorDestination& of( ::j_compress_ptr cinfo )
+    {
+        // mgr is the first member, so this is the VectorDestination
+        return *reinterpret_cast<VectorDestination*>( cinfo->dest );
+    }
+
+    static void init( ::j_compress_ptr cinfo )
+    {
+        std::vector<uint8_t>& buffer = *of( cinfo ).buffer;
+        buffer.resize( std::max( buffer.capacity(), kMinBufferSize ) );
+        cinfo->dest->next_output_byte = buffer.data();
+        cinfo->dest->free_in_buffer = buffer.size();
+    }
+
+    // Called when the buffer is full
+    static boolean grow( ::j_compress_ptr cinfo )
+    {
+        std::vector<uint8_t>& buffer = *of( cinfo ).buffer;
+        const size_t used = buffer.size();
+        buffer.resize( used * 2 );
+        cinfo->dest->next_output_byte = buffer.data() + used;
+        cinfo->dest->free_in_buffer = buffer.size() - used;
+        return TRUE;
+    }
+
+    static void term( ::j_compress_ptr cinfo )
+    {
+        std::vector<uint8_t>& buffer = *of( cinfo ).buffer;
+        buffer.resize( buffer.size() - cinfo->dest->free_in_buffer );
+    }
+};
+
+} // namespace
+
+Image::Image()
+    : m_errorMgr( std::make_shared<::jpeg_error_mgr>() )
+    , m_bitmap( std::make_shared<Bitmap>() )
+    , m_width( 0 )
+    , m_height( 0 )
+    , m_pixelSize( 3 )
+    , m_colourSpace( JCS_RGB )
 {
+}
 
 Image::Image( const std::string& fileName )
+    : Image( fileName, LoadOptions() )
 {
-    // Creating a custom deleter for the decompressInfo pointer
-    // to ensure ::jpeg_destroy_compress() gets called even if
-    // we throw out of this function.
-    auto dt = []( ::jpeg_decompress_struct *ds )
-            {
-                ::jpeg_destroy_decompress( ds );
-            };
-    std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(
-            new ::jpeg_decompress_struct,
-            dt
-            );
+}
 
-    // Note this is a shared pointer as we can share this 
-    // between objects which have copy constructed from each other
-    m_errorMgr = std::make_shared<::jpeg_error_mgr>();
+Image::Image( const std::string& fileName, const LoadOptions& options )
+{
+    if ( options.codec == Codec::TurboJpeg )
+    {
+        // TurboJPEG only decodes from memory
+        MappedFile mapped( fileName );
+        loadTurbo( mapped.data(), mapped.size(), options );
+        return;
+    }
+    if ( options.mapFile )
+    {
+        // The mapping only has to outlive the decode
+        MappedFile mapped( fileName );
+        load( [&mapped]( ::jpeg_decompress_struct* info )
+                {
+                    ::jpeg_mem_src( info, mapped.data(), mapped.size() );
+                },
+              options );
+        return;
+    }
 
     // Using fopen here ( and in save() ) because libjpeg expects
     // a FILE pointer.
@@ -62,124 +259,356 @@ Image::Image( const std::string& fileName )
         throw std::runtime_error( "Could not open " + fileName );
     }
 
+    // Read the file:
+    load( [&infile]( ::jpeg_decompress_struct* info )
+            {
+                ::jpeg_stdio_src( info, infile.get() );
+            },
+          options );
+}
+
+Image::Image( const uint8_t* data, size_t size, const LoadOptions& options )
+{
+    if ( size == 0 )
+    {
+        throw std::runtime_error( "Empty JPEG buffer" );
+    }
+    if ( options.codec == Codec::TurboJpeg )
+    {
+        loadTurbo( data, size, options );
+        return;
+    }
+    load( [data, size]( ::jpeg_decompress_struct* info )
+            {
+                ::jpeg_mem_src( info, const_cast<unsigned char*>( data ), size );
+            },
+          options );
+}
+
+void Image::load(
+    const std::function<void( ::jpeg_decompress_struct* )>& setSource,
+    const LoadOptions& options
+    )
+{
+    // Creating a custom deleter for the decompressInfo pointer
+    // to ensure ::jpeg_destroy_compress() gets called even if
+    // we throw out of this function.
+    auto dt = []( ::jpeg_decompress_struct *ds )
+            {
+                ::jpeg_destroy_decompress( ds );
+                delete ds;
+            };
+    std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompressInfo(
+            new ::jpeg_decompress_struct,
+            dt
+            );
+
+    // Note this is a shared pointer as we can share this 
+    // between objects which have copy constructed from each other
+    m_errorMgr = std::make_shared<::jpeg_error_mgr>();
+
     decompressInfo->err = ::jpeg_std_error( m_errorMgr.get() );
-    // Note this usage of a lambda to provide our own error handler
-    // to libjpeg. If we do not supply a handler, and libjpeg hits
-    // a problem, it just prints the error message and calls exit().
-    m_errorMgr->error_exit = [](::j_common_ptr cinfo)
-        {
-            char jpegLastErrorMsg[JMSG_LENGTH_MAX];
-            // Call the function pointer to get the error message
-            ( *( cinfo->err->format_message ) )
-                ( cinfo, jpegLastErrorMsg );
-            throw std::runtime_error( jpegLastErrorMsg );
-        };
+    // If we do not supply a handler, and libjpeg hits a problem,
+    // it just prints the error message and calls exit().
+    m_errorMgr->error_exit = throwJpegError;
     ::jpeg_create_decompress( decompressInfo.get() );
 
-    // Read the file:
-    ::jpeg_stdio_src( decompressInfo.get(), infile.get() );
+    setSource( decompressInfo.get() );
+    decodeFrom( decompressInfo.get(), options );
+}
 
-    int rc = ::jpeg_read_header( decompressInfo.get(), TRUE );
+void Image::decodeFrom( ::jpeg_decompress_struct* decompressInfo,
+                        const LoadOptions& options )
+{
+    MARENGO_TRACE_SCOPE( "decode" );
+    int rc = ::jpeg_read_header( decompressInfo, TRUE );
     if (rc != 1)
     {
         throw std::runtime_error(
             "File does not seem to be a normal JPEG"
             );
     }
-    ::jpeg_start_decompress( decompressInfo.get() );
+    // jpeg_read_header() has just put these back to their defaults
+    if ( options.fastDct )
+    {
+        decompressInfo->dct_method = JDCT_IFAST;
+    }
+    if ( options.fastUpsample )
+    {
+        decompressInfo->do_fancy_upsampling = FALSE;
+    }
+    if ( options.targetWidth > 0 )
+    {
+        // The smallest DCT scaling that still leaves at least targetWidth
+        // pixels; shrink() does the rest
+        for ( unsigned denom = 8; denom > 1; denom /= 2 )
+        {
+            decompressInfo->scale_num = 1;
+            decompressInfo->scale_denom = denom;
+            ::jpeg_calc_output_dimensions( decompressInfo );
+            if ( decompressInfo->output_width >= options.targetWidth )
+            {
+                break;
+            }
+            decompressInfo->scale_denom = 1;
+        }
+    }
+    ::jpeg_start_decompress( decompressInfo );
 
     m_width       = decompressInfo->output_width;
     m_height      = decompressInfo->output_height;
     m_pixelSize   = decompressInfo->output_components;
     m_colourSpace = decompressInfo->out_color_space;
 
-    size_t row_stride = m_width * m_pixelSize;
+    // libjpeg writes straight into our (contiguous) bitmap rows. One we
+    // have already, from the last frame, will do if nobody else has it.
+    if ( ! m_bitmap || m_bitmap.use_count() > 1
+         || m_bitmap->getWidth() != m_width || m_bitmap->getHeight() != m_height
+         || m_bitmap->getPixelSize() != m_pixelSize )
+    {
+        replaceBitmap( spareBitmap( m_width, m_height, m_pixelSize ) );
+    }
+    m_summedArea.reset();
 
-    m_bitmapData.clear();
-    m_bitmapData.reserve( m_height );
+    // Hand libjpeg every row still to come; each call decodes as many as
+    // it can at once (rec_outbuf_height rows) straight into place
+    {
+        ScratchArena& arena = ScratchArena::forThread();
+        ScratchArena::Scope scope( arena );
+        ::JSAMPROW* rows = rowPointers( *m_bitmap, arena );
+        while ( decompressInfo->output_scanline < m_height )
+        {
+            const size_t done = decompressInfo->output_scanline;
+            ::jpeg_read_scanlines( decompressInfo, &rows[ done ], m_height - done );
+        }
+    }
+    ::jpeg_finish_decompress( decompressInfo );
 
-    while ( decompressInfo->output_scanline < m_height )
+    if ( options.targetWidth > 0 )
     {
-        std::vector<uint8_t> vec(row_stride);
-        uint8_t* p = vec.data();
-        ::jpeg_read_scanlines( decompressInfo.get(), &p, 1 );
-        m_bitmapData.push_back( vec );
+        shrink( options.targetWidth );
     }
-    ::jpeg_finish_decompress( decompressInfo.get() );
 }
 
 // Copy constructor
 Image::Image( const Image& rhs )
+    : Image( rhs, CopyMode::Deep )
+{
+}
+
+Image::Image( const Image& rhs, CopyMode mode )
 {
     m_errorMgr      = rhs.m_errorMgr;
-    m_bitmapData    = rhs.m_bitmapData;
+    m_bitmap        = mode == CopyMode::OnWrite
+                    ? rhs.m_bitmap
+                    : std::make_shared<Bitmap>( *rhs.m_bitmap );
+    m_summedArea    = rhs.m_summedArea;
     m_width         = rhs.m_width;
     m_height        = rhs.m_height;
     m_pixelSize     = rhs.m_pixelSize;
     m_colourSpace   = rhs.m_colourSpace;
 }
 
-Image::~Image()
+Image::Image( Image&& rhs ) noexcept
 {
+    m_errorMgr      = std::move( rhs.m_errorMgr );
+    m_bitmap        = std::move( rhs.m_bitmap );
+    m_summedArea    = std::move( rhs.m_summedArea );
+    m_spare         = std::move( rhs.m_spare );
+    m_keepSpare     = rhs.m_keepSpare;
+    m_width         = rhs.m_width;
+    m_height        = rhs.m_height;
+    m_pixelSize     = rhs.m_pixelSize;
+    m_colourSpace   = rhs.m_colourSpace;
+    rhs.m_width     = 0;
+    rhs.m_height    = 0;
 }
 
-void Image::save( const std::string& fileName, int quality ) const
+Image& Image::operator=( Image&& rhs ) noexcept
 {
-    if ( quality < 0 )
+    if ( this != &rhs )
     {
-        quality = 0;
-    }
-    if ( quality > 100 )
-    {
-        quality = 100;
+        m_errorMgr      = std::move( rhs.m_errorMgr );
+        m_bitmap        = std::move( rhs.m_bitmap );
+        m_summedArea    = std::move( rhs.m_summedArea );
+        m_spare         = std::move( rhs.m_spare );
+        m_keepSpare     = rhs.m_keepSpare;
+        m_width         = rhs.m_width;
+        m_height        = rhs.m_height;
+        m_pixelSize     = rhs.m_pixelSize;
+        m_colourSpace   = rhs.m_colourSpace;
+        rhs.m_width     = 0;
+        rhs.m_height    = 0;
     }
-    FILE* outfile = fopen( fileName.c_str(), "wb" );
-    if ( outfile == NULL )
+    return *this;
+}
+
+Image::~Image()
+{
+}
+
+void Image::save( const std::string& fileName, int quality, Codec codec ) const
+{
+    auto fdt = []( FILE* fp )
+            {
+                fclose( fp );
+            };
+    std::unique_ptr<FILE, decltype(fdt)> outfile(
+            fopen( fileName.c_str(), "wb" ),
+            fdt
+            );
+    if ( outfile.get() == NULL )
     {
         throw std::runtime_error(
             "Could not open " + fileName + " for writing"
             );
     }
+    if ( codec == Codec::TurboJpeg )
+    {
+        std::vector<uint8_t> buffer;
+        encodeTurbo( buffer, quality );
+        writeAll( outfile.get(), buffer, fileName );
+        return;
+    }
+    encode( [&outfile]( ::jpeg_compress_struct* info )
+            {
+                ::jpeg_stdio_dest( info, outfile.get() );
+            },
+            quality );
+}
+
+void Image::saveToBuffer( std::vector<uint8_t>& buffer, int quality,
+                          Codec codec ) const
+{
+    if ( codec == Codec::TurboJpeg )
+    {
+        encodeTurbo( buffer, quality );
+        return;
+    }
+    VectorDestination dest( buffer );
+    encode( [&dest]( ::jpeg_compress_struct* info )
+            {
+                info->dest = &dest.mgr;
+            },
+            quality );
+}
+
+void Image::encode(
+    const std::function<void( ::jpeg_compress_struct* )>& setDestination,
+    int quality
+    ) const
+{
     // Creating a custom deleter for the compressInfo pointer
     // to ensure ::jpeg_destroy_compress() gets called even if
     // we throw out of this function.
     auto dt = []( ::jpeg_compress_struct *cs )
             {
                 ::jpeg_destroy_compress( cs );
+                delete cs;
             };
     std::unique_ptr<::jpeg_compress_struct, decltype(dt)> compressInfo(
             new ::jpeg_compress_struct,
             dt );
+    compressInfo->err = ::jpeg_std_error( m_errorMgr.get() );
+    m_errorMgr->error_exit = throwJpegError;
     ::jpeg_create_compress( compressInfo.get() );
-    ::jpeg_stdio_dest( compressInfo.get(), outfile);
+    setDestination( compressInfo.get() );
+    encodeTo( compressInfo.get(), quality );
+}
+
+void Image::encodeTo( ::jpeg_compress_struct* compressInfo, int quality,
+                      EncodePreset preset ) const
+{
+    MARENGO_TRACE_SCOPE( "encode" );
+    if ( quality < 0 )
+    {
+        quality = 0;
+    }
+    if ( quality > 100 )
+    {
+        quality = 100;
+    }
     compressInfo->image_width = m_width;
     compressInfo->image_height = m_height;
     compressInfo->input_components = m_pixelSize;
     compressInfo->in_color_space =
         static_cast<::J_COLOR_SPACE>( m_colourSpace );
-    compressInfo->err = ::jpeg_std_error( m_errorMgr.get() );
-    ::jpeg_set_defaults( compressInfo.get() );
-    ::jpeg_set_quality( compressInfo.get(), quality, TRUE );
-    ::jpeg_start_compress( compressInfo.get(), TRUE);
-    for ( auto const& vecLine : m_bitmapData )
-    {
-        ::JSAMPROW rowPtr[1];
-        // Casting const-ness away here because the jpeglib
-        // call expects a non-const pointer. It presumably
-        // doesn't modify our data.
-        rowPtr[0] = const_cast<::JSAMPROW>( vecLine.data() );
-        ::jpeg_write_scanlines(
-            compressInfo.get(),
-            rowPtr,
-            1
-            );
+    ::jpeg_set_defaults( compressInfo );
+    ::jpeg_set_quality( compressInfo, quality, TRUE );
+    HuffmanTables standardTables;
+    switch ( preset )
+    {
+    case EncodePreset::Default:
+        break;
+    case EncodePreset::Fast:
+        compressInfo->dct_method = JDCT_IFAST;
+        compressInfo->optimize_coding = FALSE;
+        if ( compressInfo->jpeg_color_space == JCS_YCbCr )
+        {
+            // 4:2:0, as jpeg_set_defaults() does now, but pinned down
+            compressInfo->comp_info[0].h_samp_factor = 2;
+            compressInfo->comp_info[0].v_samp_factor = 2;
+        }
+        break;
+    case EncodePreset::Archive:
+        standardTables.save( compressInfo );
+        compressInfo->optimize_coding = TRUE;
+        ::jpeg_simple_progression( compressInfo );
+        break;
+    }
+    ::jpeg_start_compress( compressInfo, TRUE);
+    // All the rows in one call. Casting const-ness away here because the
+    // jpeglib call expects non-const pointers. It doesn't modify our data.
+    ScratchArena& arena = ScratchArena::forThread();
+    ScratchArena::Scope scope( arena );
+    ::JSAMPROW* rows = rowPointers( const_cast<Bitmap&>( *m_bitmap ), arena );
+    while ( compressInfo->next_scanline < m_height )
+    {
+        const size_t done = compressInfo->next_scanline;
+        ::jpeg_write_scanlines( compressInfo, &rows[ done ], m_height - done );
+    }
+    ::jpeg_finish_compress( compressInfo );
+}
+
+void Image::loadTurbo( const uint8_t* data, size_t size,
+                       const LoadOptions& options )
+{
+    MARENGO_TRACE_SCOPE( "decode" );
+    if ( ! m_errorMgr )
+    {
+        m_errorMgr = std::make_shared<::jpeg_error_mgr>();
+    }
+    // As decodeFrom(), the pixels from the last frame will do if nobody
+    // else has them
+    if ( ! m_bitmap || m_bitmap.use_count() > 1 )
+    {
+        m_bitmap = std::make_shared<Bitmap>();
+    }
+    m_summedArea.reset();
+    int colourSpace = JCS_RGB;
+    tj::decode( data, size, options.targetWidth, options.fastDct,
+                options.fastUpsample, *m_bitmap, colourSpace );
+    m_width = m_bitmap->getWidth();
+    m_height = m_bitmap->getHeight();
+    m_pixelSize = m_bitmap->getPixelSize();
+    m_colourSpace = colourSpace;
+
+    if ( options.targetWidth > 0 )
+    {
+        shrink( options.targetWidth );
     }
-    ::jpeg_finish_compress( compressInfo.get() );
-    fclose( outfile );
+}
+
+void Image::encodeTurbo( std::vector<uint8_t>& buffer, int quality ) const
+{
+    MARENGO_TRACE_SCOPE( "encode" );
+    tj::encode( *m_bitmap, m_colourSpace, std::max( 0, std::min( quality, 100 ) ),
+                buffer );
 }
 
 void Image::savePpm( const std::string& fileName ) const
 {
+    MARENGO_TRACE_SCOPE( "savePpm" );
     std::ofstream ofs( fileName, std::ios::out | std::ios::binary );
     if ( ! ofs )
     {
@@ -189,46 +618,75 @@ void Image::savePpm( const std::string& fileName ) const
     }
     // Write the header
     ofs << "P6 " << m_width << " " << m_height << " 255\n";
-    for ( auto& v : m_bitmapData )
+    for ( size_t row = 0; row < m_height; ++row )
     {
-        ofs.write( reinterpret_cast<const char *>(v.data()), v.size() );
+        ofs.write( reinterpret_cast<const char *>( m_bitmap->getRow( row ) ),
+                   m_bitmap->getRowSize() );
+    }
+    ofs.close();
+}
+
+void Image::savePbm( const std::string& fileName ) const
+{
+    std::ofstream ofs( fileName, std::ios::out | std::ios::binary );
+    if ( ! ofs )
+    {
+        throw std::runtime_error(
+            "Could not open " + fileName + " for saving"
+            );
+    }
+    const kernels::Kernels& k = kernels::kernels();
+    ofs << "P4 " << m_width << " " << m_height << "\n";
+    std::vector<uint8_t> grayRow( m_pixelSize == 1 ? 0 : m_width );
+    std::vector<uint8_t> bits( ( m_width + 7 ) / 8 );
+    for ( size_t row = 0; row < m_height; ++row )
+    {
+        const uint8_t* gray = m_bitmap->getRow( row );
+        if ( m_pixelSize != 1 )
+        {
+            k.grayFromRgb( gray, grayRow.data(), m_width );
+            gray = grayRow.data();
+        }
+        // PBM has 1 for black, first pixel in the top bit
+        std::fill( bits.begin(), bits.end(), 0 );
+        for ( size_t col = 0; col < m_width; ++col )
+        {
+            if ( gray[col] < 128 )
+            {
+                bits[ col / 8 ] |= 0x80 >> ( col % 8 );
+            }
+        }
+        ofs.write( reinterpret_cast<const char*>( bits.data() ), bits.size() );
     }
     ofs.close();
 }
 
 std::vector<uint8_t> Image::getPixel( size_t x, size_t y ) const
 {
-    if ( y >= m_bitmapData.size() )
+    if ( y >= m_height )
     {
         throw std::out_of_range( "Y value too large" );
     }
-    if ( x >= m_bitmapData[0].size() / m_pixelSize )
+    if ( x >= m_width )
     {
         throw std::out_of_range( "X value too large" );
     }
-    std::vector<uint8_t> vec;
-    for ( size_t n = 0; n < m_pixelSize; ++n )
-    {
-        vec.push_back( m_bitmapData[ y ][ x * m_pixelSize + n ] );
-    }
+    const uint8_t* p = m_bitmap->getRow( y ) + x * m_pixelSize;
+    std::vector<uint8_t> vec( p, p + m_pixelSize );
     return vec;
 }
 
 uint8_t Image::getLuminance( size_t x, size_t y ) const
 {
-    auto vec = getPixel( x, y );
-    if ( vec.size() == 1 )
-    {   // monochrome image
-        return vec[0];
+    if ( y >= m_height )
+    {
+        throw std::out_of_range( "Y value too large" );
     }
-    if ( vec.size() == 3 )
+    if ( x >= m_width )
     {
-        // fast approximation of luminance:
-        return static_cast<uint8_t>(
-            ( vec[0] * 2 + vec[1] * 3 + vec[2] ) / 6
-            );
+        throw std::out_of_range( "X value too large" );
     }
-    return 0;
+    return luminanceAt( x, y );
 }
 
 std::vector<uint8_t>
@@ -254,16 +712,28 @@ Image::getAverage( size_t x, size_t y, size_t boxSize ) const
     size_t r{ 0 }; // we just use this one for mono images
     size_t g{ 0 };
     size_t b{ 0 };
-    for ( size_t row = y; row < y + boxSize; ++row )
+    if ( m_summedArea )
     {
-        for ( size_t col = x; col < x + boxSize; ++col )
+        r = m_summedArea->sum( x, y, boxSize, boxSize, 0 );
+        if ( m_pixelSize == 3 )
         {
-            auto vec = getPixel( col, row );
-            r += vec[0];
-            if ( vec.size() == 3 )
+            g = m_summedArea->sum( x, y, boxSize, boxSize, 1 );
+            b = m_summedArea->sum( x, y, boxSize, boxSize, 2 );
+        }
+    }
+    else
+    {
+        for ( size_t row = y; row < y + boxSize; ++row )
+        {
+            const uint8_t* p = m_bitmap->getRow( row ) + x * m_pixelSize;
+            for ( size_t col = 0; col < boxSize; ++col, p += m_pixelSize )
             {
-                g += vec[1];
-                b += vec[2];
+                r += p[0];
+                if ( m_pixelSize == 3 )
+                {
+                    g += p[1];
+                    b += p[2];
+                }
             }
         }
     }
@@ -280,12 +750,18 @@ Image::getAverage( size_t x, size_t y, size_t boxSize ) const
     return retVec;
 }
 
+void Image::buildSummedAreaTable()
+{
+    m_summedArea = std::make_shared<const SummedAreaTable>( *m_bitmap );
+}
+
 void Image::shrink( size_t newWidth )
 {
     if ( newWidth >= m_width )
     {
         return;
     }
+    MARENGO_TRACE_SCOPE( "shrink" );
 
     if ( newWidth == 0 )
     {
@@ -299,107 +775,108 @@ void Image::shrink( size_t newWidth )
     // in a three-times speedup when shrinking a 21Mpx file.
 
     float scaleFactor = static_cast<float>(newWidth) / m_width;
-    size_t newHeight = scaleFactor * m_height;
-    std::vector<std::vector<uint8_t>> vecNewBitmap;
-    vecNewBitmap.reserve( newHeight );
 
-    // Yes, I probably could do a rolling average
-    std::vector<size_t> runningTotals( newWidth * m_pixelSize );
-    std::vector<size_t> runningCounts( newWidth * m_pixelSize );
+    // A new line is emitted each time the scaled row index moves on,
+    // so count those up front to size the destination bitmap.
+    size_t newHeight = 0;
     size_t oldRow = 0;
     for ( size_t row = 0; row < m_height; ++row )
     {
-        for ( size_t col = 0; col < m_width * m_pixelSize; ++col )
+        if ( static_cast<size_t>( scaleFactor * row ) > oldRow )
+        {
+            oldRow = scaleFactor * row;
+            ++newHeight;
+        }
+    }
+    if ( newHeight == 0 )
+    {
+        throw std::out_of_range( "New width leaves no rows" );
+    }
+    Bitmap newBitmap = spareBitmap( newWidth, newHeight, m_pixelSize );
+
+    // Yes, I probably could do a rolling average
+    // The sizes are copied, as the compiler can't tell that the totals
+    // (unlike a vector's) don't overlap the members, and so would read
+    // them again after every store
+    const size_t rowSize = m_width * m_pixelSize;
+    const size_t newRowSize = newWidth * m_pixelSize;
+    const size_t height = m_height;
+    ScratchArena& arena = ScratchArena::forThread();
+    ScratchArena::Scope scope( arena );
+    size_t* runningTotals = arena.allocate<size_t>( newRowSize );
+    size_t* runningCounts = arena.allocate<size_t>( newRowSize );
+    std::fill_n( runningTotals, newRowSize, 0 );
+    std::fill_n( runningCounts, newRowSize, 0 );
+    size_t newRow = 0;
+    oldRow = 0;
+    for ( size_t row = 0; row < height; ++row )
+    {
+        const uint8_t* src = m_bitmap->getRow( row );
+        for ( size_t col = 0; col < rowSize; ++col )
         {
             size_t idx = scaleFactor * col;
-            runningTotals[ idx ] += m_bitmapData[row][col];
+            runningTotals[ idx ] += src[col];
             ++runningCounts[ idx ];
         }
         if ( static_cast<size_t>( scaleFactor * row ) > oldRow )
         {
             oldRow = scaleFactor * row;
-            std::vector<uint8_t> newLine;
-            newLine.reserve( newWidth * m_pixelSize );
-            for ( size_t i = 0; i < newWidth * m_pixelSize; ++i )
+            uint8_t* dst = newBitmap.getRow( newRow++ );
+            for ( size_t i = 0; i < newRowSize; ++i )
             {
-                newLine.push_back( runningTotals[i] / runningCounts[i] );
+                dst[i] = runningTotals[i] / runningCounts[i];
                 runningTotals[i] = 0;
                 runningCounts[i] = 0;
             }
-            vecNewBitmap.push_back( newLine );
         }
     }
-    m_bitmapData = vecNewBitmap;
-    m_height = m_bitmapData.size();
-    m_width = m_bitmapData[0].size() / m_pixelSize;
+    replaceBitmap( std::move( newBitmap ) );
 }
 
 void Image::test(  )
 {
-    
-
-    // We process the original bitmap line by line rather than
-    // calling getAverage() on every (new) pixel to ensure we make the
-    // most of data already in existing cache lines & attempt to
-    // allow branch prediction to work optimally. This has resulted
-    // in a three-times speedup when shrinking a 21Mpx file.
-
-    std::vector<std::vector<uint8_t>> vecNewBitmap;
-    vecNewBitmap.reserve( m_height );
-
+    // The left half is left as it is, so this can work in place
+    Bitmap& bitmap = pixels();
 
     for ( size_t row = 0; row < m_height; ++row )
     {
-        std::vector<uint8_t> newLine;
-        newLine.reserve( m_height * m_pixelSize );
+        uint8_t* dst = bitmap.getRow( row );
         int cta =0;
-        for ( size_t col = 0; col < m_width * m_pixelSize ; ++col )
+        for ( size_t col = ( m_width * m_pixelSize ) / 2; col < m_width * m_pixelSize ; ++col )
         {
-            if(col < (m_width * m_pixelSize)/2  ){
-                newLine.push_back(m_bitmapData[row][col]);
-            }
-            else{
-                if( m_pixelSize == 1 )
-                {
-                    newLine.push_back(0XFF);
-                }else{
-                    if(cta==0)  newLine.push_back(0XFF);
-                    if(cta==1)  newLine.push_back(0X00);
-                    if(cta==2)  newLine.push_back(0X00);
-                    cta++;
-                    if(cta==3)  cta=0;
-                }
+            if( m_pixelSize == 1 )
+            {
+                dst[col] = 0XFF;
+            }else{
+                if(cta==0)  dst[col] = 0XFF;
+                if(cta==1)  dst[col] = 0X00;
+                if(cta==2)  dst[col] = 0X00;
+                cta++;
+                if(cta==3)  cta=0;
             }
-            
         }
-        
-        vecNewBitmap.push_back( newLine );
-        
     }
-    m_bitmapData = vecNewBitmap;
-    m_height = m_bitmapData.size();
-    m_width = m_bitmapData[0].size() / m_pixelSize;
 }
 
 void Image::fsd(  )
 {
-    
-
-
-
-    std::vector<std::vector<uint8_t>> vecNewBitmap;
-    vecNewBitmap.reserve( m_height );
+    MARENGO_TRACE_SCOPE( "fsd" );
+    const kernels::Kernels& k = kernels::kernels();
+    ScratchArena& arena = ScratchArena::forThread();
+    ScratchArena::Scope scope( arena );
+    const BitmapView grayBitmap = arena.allocateBitmap( m_width, m_height, 1 );
 
     // to grayscale
     for ( size_t row = 0; row < m_height; ++row )
     {
-        std::vector<uint8_t> newLine;
-        newLine.reserve( m_width  );
-        for ( size_t col = 0; col < m_width * m_pixelSize; col+=3 )
+        if ( m_pixelSize == 1 )
         {
-            newLine.push_back( (m_bitmapData[row][col] + m_bitmapData[row][col+1]  + m_bitmapData[row][col+2] )/3 );
-        }        
-        vecNewBitmap.push_back( newLine );
+            std::copy_n( m_bitmap->getRow( row ), m_width, grayBitmap.row( row ) );
+        }
+        else
+        {
+            k.grayFromRgb( m_bitmap->getRow( row ), grayBitmap.row( row ), m_width );
+        }
     }
 
     //fsd
@@ -408,170 +885,156 @@ void Image::fsd(  )
     uint8_t error;
     for ( size_t row = 0; row < m_height; ++row )
     {
-        std::vector<uint8_t> newLine;
-        newLine.reserve( m_width * m_pixelSize  );
+        uint8_t* cur = grayBitmap.row( row );
+        uint8_t* next = grayBitmap.row( row + 1 );
     
         for ( size_t col = 0; col < m_width; ++col )
         {
             if( col == 0 || col == m_width - 1 || (row == m_height -1)  ){
-                vecNewBitmap[row][col] = 0XFF;
+                cur[col] = 0XFF;
             }else{
-                oldPixel = vecNewBitmap[row][col];
+                oldPixel = cur[col];
                 newPixel =  oldPixel <= 128 ? 0XFF : 0X00;
                 error = ( oldPixel - newPixel );
-                vecNewBitmap[row     ][col + 1 ] += error*7/16;
-                vecNewBitmap[row + 1 ][col + 1 ] += error*1/16;
-                vecNewBitmap[row + 1 ][col     ] += error*5/16; 
-                vecNewBitmap[row + 1 ][col - 1 ] += error*3/16; 
-                vecNewBitmap[row][col] = newPixel;
+                cur [col + 1 ] += error*7/16;
+                next[col + 1 ] += error*1/16;
+                next[col     ] += error*5/16; 
+                next[col - 1 ] += error*3/16; 
+                cur[col] = newPixel;
             }   
 
         }        
     }
 
-    std::vector<std::vector<uint8_t>> vecNewBitmapD;
-    vecNewBitmapD.reserve( m_height );
-    // to  3 chanels
+    // to  3 chanels, straight over the old pixels if they are RGB already
+    if ( m_pixelSize != 3 )
+    {
+        replaceBitmap( spareBitmap( m_width, m_height, 3 ) );
+        m_pixelSize = 3;
+        m_colourSpace = JCS_RGB;
+    }
+    Bitmap& bitmap = pixels();
     for ( size_t row = 0; row < m_height; ++row )
     {
-        std::vector<uint8_t> newLine;
-        newLine.reserve( m_width * m_pixelSize  );
-        for ( size_t col = 0; col < m_width; ++col )
-        {
-            newLine.push_back( vecNewBitmap[row][col]);
-            newLine.push_back( vecNewBitmap[row][col]);
-            newLine.push_back( vecNewBitmap[row][col]);
-        }        
-        vecNewBitmapD.push_back( newLine );
+        k.rgbFromGray( grayBitmap.row( row ), bitmap.getRow( row ), m_width );
     }
-
-
-
-
-
-
-    m_pixelSize=3;
-    m_bitmapData = vecNewBitmapD;
-    m_height = m_bitmapData.size();
-    m_width = m_bitmapData[0].size() / m_pixelSize;
 }
 
-void Image::fsdColor(  )
+void Image::fsdMono(  )
 {
-     std::vector<std::vector<uint8_t>>  palet = { {0X38,0X48,0X8d}, 
-                                                    {0X54,0X7a,0X49},
-                                                    {0X9f,0X4b,0X4e},
-                                                    {0X24,0X29,0X33},
-                                                    {0Xc9,0Xd1,0X68},
-                                                    {0Xb5,0X5d,0X4c},
-                                                    {0Xd3,0Xdd,0Xe4}
-                                                };
-  
-    int16_t deltaR;
-    int16_t deltaG;
-    int16_t deltaB;
-    int16_t rHat;
-
-    int idColor;
-    float auxDistance;
-    float shortDistance;
-    
-
+    MARENGO_TRACE_SCOPE( "fsdMono" );
+    const kernels::Kernels& k = kernels::kernels();
+    Bitmap monoBitmap = spareBitmap( m_width, m_height, 1 );
+
+    // Error owed to each pixel of this row and the next. Each next row
+    // entry is written exactly once, when nothing more can be added to it,
+    // so neither row ever needs clearing. The spare entry at each end
+    // takes what falls off the edges.
+    ScratchArena& arena = ScratchArena::forThread();
+    ScratchArena::Scope scope( arena );
+    int16_t* errorRows = arena.allocate<int16_t>( ( m_width + 2 ) * 2 );
+    std::fill_n( errorRows, ( m_width + 2 ) * 2, 0 );
+    int16_t* curError = &errorRows[1];
+    int16_t* nextError = &errorRows[ m_width + 3 ];
+    uint8_t* grayRow = arena.allocate<uint8_t>( m_width );
 
-    //fsd_color
-    int16_t newPixelR;
-    int16_t newPixelG;
-    int16_t newPixelB;
-    int16_t oldPixelR;
-    int16_t oldPixelG;
-    int16_t oldPixelB;
-    int16_t errorR;
-    int16_t errorG;
-    int16_t errorB;
     for ( size_t row = 0; row < m_height; ++row )
-    {    
-        for ( size_t col = 0; col < m_width * m_pixelSize ; col+=3 )
+    {
+        const uint8_t* gray = m_bitmap->getRow( row );
+        if ( m_pixelSize != 1 )
         {
-            //srgb
-            uint8_t r ;
-            uint8_t g ;
-            uint8_t b ;
-            
-
-            if( col == 0 || col >= ((m_width * m_pixelSize )- m_pixelSize) || (row == m_height -1)  ){
-                m_bitmapData[row][col] = palet[0][0];
-                m_bitmapData[row][col+1] = palet[0][1];
-                m_bitmapData[row][col+2] = palet[0][2];
-            }else{
-
-                r = m_bitmapData[row][col];
-                g = m_bitmapData[row][col + 1];
-                b = m_bitmapData[row][col + 2];
-
-                //Getting new color from palet by srgb distance
-                for(int idxPalet = 0; idxPalet < 7; idxPalet++){
-                    deltaR = r - palet[idxPalet][0];
-                    deltaG = g - palet[idxPalet][1];
-                    deltaB = b - palet[idxPalet][2];
-                    rHat = (r + palet[idxPalet][0]) / 2;
-
-                    if(rHat < 128){
-                        auxDistance = sqrt( (2 * deltaR*deltaR) + (4 * deltaG*deltaG) + (3 * deltaB*deltaB) );
-                    }else{
-                        auxDistance = sqrt( (3 * deltaR*deltaR) + (4 * deltaG*deltaG) + (2 * deltaB*deltaB) );
-                    }
-
-                    if(idxPalet == 0){
-                        shortDistance = auxDistance;
-                        idColor = idxPalet;
-                    }else{
-                        if(shortDistance > auxDistance){
-                            shortDistance = auxDistance;
-                            idColor = idxPalet;
-                        }
-                    }
-                }
-
-
-                oldPixelR = m_bitmapData[row][col];
-                oldPixelG = m_bitmapData[row][col + 1];
-                oldPixelB = m_bitmapData[row][col + 2];
+            k.grayFromRgb( gray, grayRow, m_width );
+            gray = grayRow;
+        }
+        uint8_t* dst = monoBitmap.getRow( row );
+        int right = 0;      // owed to the next pixel along
+        int belowLeft = 0;  // so far for the pixel below this one
+        int belowRight = 0; // so far for the one below the next pixel
+        for ( size_t col = 0; col < m_width; ++col )
+        {
+            const int value = gray[col] + curError[col] + right;
+            const uint8_t newPixel = value < 128 ? 0x00 : 0xFF;
+            const int error = value - newPixel;
+            // Split so the parts add back up to the whole error
+            right = error * 7 / 16;
+            const int e3 = error * 3 / 16;
+            const int e5 = error * 5 / 16;
+            nextError[col - 1] = belowLeft + e3;
+            belowLeft = belowRight + e5;
+            belowRight = error - right - e3 - e5;
+            dst[col] = newPixel;
+        }
+        nextError[ static_cast<ptrdiff_t>( m_width ) - 1 ] = belowLeft;
+        nextError[ m_width ] = belowRight;
+        std::swap( curError, nextError );
+    }
 
-                newPixelR = palet[idColor][0];
-                newPixelG = palet[idColor][1];
-                newPixelB = palet[idColor][2];
+    replaceBitmap( std::move( monoBitmap ) );
+    m_pixelSize = 1;
+    m_colourSpace = JCS_GRAYSCALE;
+}
 
-                errorR = oldPixelR - newPixelR;
-                errorG = oldPixelG - newPixelG;
-                errorB = oldPixelB - newPixelB;
+void Image::fsdColor(  )
+{
+    fsdColor( Palette::defaultPalette() );
+}
 
-                m_bitmapData[row     ][col + 0 + 3] += errorR*7/16;
-                m_bitmapData[row     ][col + 1 + 3] += errorG*7/16;
-                m_bitmapData[row     ][col + 2 + 3] += errorB*7/16;
+void Image::fsdColor( const Palette& palette, unsigned threads )
+{
+    fsdColor( palette, std::function<bool()>(), threads );
+}
 
-                m_bitmapData[row + 1 ][col + 0 + 3 ] += errorR*1/16;
-                m_bitmapData[row + 1 ][col + 1 + 3 ] += errorG*1/16;
-                m_bitmapData[row + 1 ][col + 2 + 3 ] += errorB*1/16;
-                
-                m_bitmapData[row + 1 ][col  + 0    ] += errorR*5/16; 
-                m_bitmapData[row + 1 ][col  + 1    ] += errorG*5/16; 
-                m_bitmapData[row + 1 ][col  + 2    ] += errorB*5/16; 
+bool Image::fsdColor( const Palette& palette, const std::function<bool()>& stop,
+                      unsigned threads )
+{
+    if ( m_pixelSize != 3 )
+    {
+        throw std::runtime_error( "fsdColor needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "fsdColor" );
+    const Quantizer& quantizer = palette.getQuantizer();
+    const kernels::Kernels& k = kernels::kernels();
 
-                m_bitmapData[row + 1 ][col - 0 - 3 ] += errorR*3/16; 
-                m_bitmapData[row + 1 ][col + 1 - 3 ] += errorG*3/16; 
-                m_bitmapData[row + 1 ][col + 2 - 3 ] += errorB*3/16; 
+    if ( threads == 0 )
+    {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
 
-                m_bitmapData[row][col] = newPixelR;
-                m_bitmapData[row][col+1] = newPixelG;
-                m_bitmapData[row][col+2] = newPixelB;
-            }        
-        }
+    // The first and last columns, and the whole last row, just get
+    // palette entry 0. The kernel takes care of that too.
+    // A pixel's error reaches one pixel right and down to the right of it,
+    // so a row can go as far as two pixels short of the row above.
+    Bitmap& bitmap = pixels();
+    MARENGO_TRACE_SCOPE( "fsdColor.diffuse" );
+    const auto work = [&]( size_t row, size_t begin, size_t end )
+        {
+            uint8_t* next = row + 1 < m_height ? bitmap.getRow( row + 1 ) : nullptr;
+            k.fsdColorRow( bitmap.getRow( row ), next, m_width, begin, end, quantizer );
+        };
+    // By reference, so the std::function doesn't allocate a copy per frame
+    if ( ! runWavefront( m_height, m_width, 2, threads, std::ref( work ), stop ) )
+    {
+        return false;
     }
+    MARENGO_TRACE_COUNT( "fsdColor.pixels", m_width * m_height );
+    return true;
+}
 
-    m_pixelSize=3;
-    m_bitmapData = m_bitmapData;
-    m_height = m_bitmapData.size();
-    m_width = m_bitmapData[0].size() / m_pixelSize;
+void Image::dither( const Palette& palette, Dither method, unsigned threads,
+                    Scan scan, Match match )
+{
+    if ( method == Dither::FloydSteinberg && scan == Scan::Raster
+         && match == Match::Redmean )
+    {
+        fsdColor( palette, threads );
+        return;
+    }
+    if ( m_pixelSize != 3 )
+    {
+        throw std::runtime_error( "dither needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "dither" );
+    ditherBitmap( pixels(), palette, method, threads, scan, match );
 }
 
 void Image::expand( size_t newWidth )
@@ -580,30 +1043,27 @@ void Image::expand( size_t newWidth )
     {
         return;
     }
+    MARENGO_TRACE_SCOPE( "expand" );
 
     float scaleFactor = static_cast<float>(newWidth) / m_width;
     size_t newHeight = scaleFactor * m_height;
-    std::vector<std::vector<uint8_t>> vecNewBitmap;
-    vecNewBitmap.reserve( newHeight );
+    Bitmap newBitmap = spareBitmap( newWidth, newHeight, m_pixelSize );
 
     for ( size_t row = 0; row < newHeight; ++row )
     {
         size_t oldRow = row / scaleFactor;
-        std::vector<uint8_t> vecNewLine( newWidth * m_pixelSize );
+        const uint8_t* src = m_bitmap->getRow( oldRow );
+        uint8_t* dst = newBitmap.getRow( row );
         for ( size_t col = 0; col < newWidth; ++col )
         {
             size_t oldCol = col / scaleFactor;
             for ( size_t n = 0; n < m_pixelSize; ++n )
             {
-                vecNewLine[ col * m_pixelSize + n ] =
-                    m_bitmapData[ oldRow ][ oldCol * m_pixelSize + n ];
+                dst[ col * m_pixelSize + n ] = src[ oldCol * m_pixelSize + n ];
             }
         }
-        vecNewBitmap.push_back( vecNewLine );
     }
-    m_bitmapData = vecNewBitmap;
-    m_height = m_bitmapData.size();
-    m_width = m_bitmapData[0].size() / m_pixelSize;
+    replaceBitmap( std::move( newBitmap ) );
 }
 
 void Image::resize( size_t newWidth )
@@ -618,7 +1078,189 @@ void Image::resize( size_t newWidth )
     }
 }
 
+void Image::resample( size_t newWidth, size_t newHeight, ResampleFilter filter )
+{
+    MARENGO_TRACE_SCOPE( "resample" );
+    replaceBitmap( jpeg::resample( *m_bitmap, newWidth, newHeight, filter ) );
+}
+
+void Image::replaceBitmap( Bitmap&& bitmap )
+{
+    m_width = bitmap.getWidth();
+    m_height = bitmap.getHeight();
+    if ( m_bitmap && m_bitmap.use_count() == 1 )
+    {
+        // Ours alone, so the shared_ptr needn't be made again, and the old
+        // pixels can go spare
+        m_bitmap->swap( bitmap );
+        if ( m_keepSpare )
+        {
+            m_spare = std::move( bitmap );
+        }
+    }
+    else
+    {
+        m_bitmap = std::make_shared<Bitmap>( std::move( bitmap ) );
+    }
+    m_summedArea.reset();
+}
+
+void Image::setKeepSpare( bool keep )
+{
+    m_keepSpare = keep;
+    if ( ! keep )
+    {
+        m_spare = Bitmap();
+    }
+}
+
+Bitmap Image::spareBitmap( size_t width, size_t height, size_t pixelSize )
+{
+    Bitmap bitmap;
+    bitmap.swap( m_spare );
+    bitmap.reset( width, height, pixelSize );
+    return bitmap;
+}
+
+struct Decoder::State
+{
+    ::jpeg_error_mgr errorMgr;
+    ::jpeg_decompress_struct info;
+
+    State()
+    {
+        info.err = ::jpeg_std_error( &errorMgr );
+        errorMgr.error_exit = throwJpegError;
+        ::jpeg_create_decompress( &info );
+    }
+    ~State()
+    {
+        ::jpeg_destroy_decompress( &info );
+    }
+};
+
+Decoder::Decoder()
+    : m_state( new State )
+{
+}
+
+Decoder::~Decoder()
+{
+}
+
+void Decoder::decode( const uint8_t* data, size_t size, Image& image,
+                      const LoadOptions& options )
+{
+    if ( size == 0 )
+    {
+        throw std::runtime_error( "Empty JPEG buffer" );
+    }
+    // Frames come one after another into the same image
+    image.setKeepSpare( true );
+    if ( options.codec == Codec::TurboJpeg )
+    {
+        // TurboJPEG keeps its own decompressor, one per thread
+        image.loadTurbo( data, size, options );
+        return;
+    }
+    ::jpeg_mem_src( &m_state->info, const_cast<unsigned char*>( data ), size );
+    try
+    {
+        image.decodeFrom( &m_state->info, options );
+    }
+    catch ( ... )
+    {
+        // Ready for the next one
+        ::jpeg_abort_decompress( &m_state->info );
+        throw;
+    }
+}
+
+struct Encoder::State
+{
+    ::jpeg_error_mgr errorMgr;
+    ::jpeg_compress_struct info;
+    // For save()
+    std::vector<uint8_t> buffer;
+
+    State()
+    {
+        info.err = ::jpeg_std_error( &errorMgr );
+        errorMgr.error_exit = throwJpegError;
+        ::jpeg_create_compress( &info );
+    }
+    ~State()
+    {
+        ::jpeg_destroy_compress( &info );
+    }
+};
+
+Encoder::Encoder( EncodePreset preset )
+    : m_state( new State )
+    , m_preset( preset )
+{
+}
+
+Encoder::~Encoder()
+{
+}
+
+void Encoder::encode( const Image& image, std::vector<uint8_t>& buffer,
+                      int quality )
+{
+    VectorDestination dest( buffer );
+    m_state->info.dest = &dest.mgr;
+    try
+    {
+        image.encodeTo( &m_state->info, quality, m_preset );
+    }
+    catch ( ... )
+    {
+        ::jpeg_abort_compress( &m_state->info );
+        throw;
+    }
+}
+
+void Encoder::save( const Image& image, const std::string& fileName, int quality )
+{
+    encode( image, m_state->buffer, quality );
+    auto fdt = []( FILE* fp )
+            {
+                fclose( fp );
+            };
+    std::unique_ptr<FILE, decltype(fdt)> outfile(
+            fopen( fileName.c_str(), "wb" ),
+            fdt
+            );
+    if ( outfile.get() == NULL )
+    {
+        throw std::runtime_error(
+            "Could not open " + fileName + " for writing"
+            );
+    }
+    writeAll( outfile.get(), m_state->buffer, fileName );
+    if ( fflush( outfile.get() ) != 0 )
+    {
+        throw std::runtime_error( "Could not write " + fileName );
+    }
+}
+
+EncodePreset encodePresetFromName( const std::string& name )
+{
+    if ( name == "default" )
+    {
+        return EncodePreset::Default;
+    }
+    if ( name == "fast" )
+    {
+        return EncodePreset::Fast;
+    }
+    if ( name == "archive" )
+    {
+        return EncodePreset::Archive;
+    }
+    throw std::invalid_argument( "Unknown encoder preset " + name );
+}
 
 } // namespace jpeg
 } // namespace marengo
-
@@ -1,35 +1,125 @@
 #pragma once
 
+#include "bitmap.h"
+#include "dither.h"
+#include "resample.h"
+#include "trace.h"
+
+#include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
-// forward declarations of jpeglib struct
+// forward declarations of jpeglib structs
 struct jpeg_error_mgr;
+struct jpeg_compress_struct;
+struct jpeg_decompress_struct;
 
 namespace marengo
 {
     namespace jpeg
     {
 
+        class Decoder;
+        class Encoder;
+        class Palette;
+        class SummedAreaTable;
+
+        // Which library decodes and encodes. LibJpeg is the classic jpeg_*
+        // API (libjpeg-turbo's, where that is what -ljpeg is); TurboJpeg
+        // is libjpeg-turbo's TurboJPEG API, which decodes and encodes a
+        // whole image in one call, and is only there in a build with it
+        // (make TURBOJPEG=1, see tjcodec.h). Asking for it otherwise throws.
+        enum class Codec
+        {
+            LibJpeg,
+            TurboJpeg
+        };
+
+        // How an Encoder trades encoding time against file size
+        enum class EncodePreset
+        {
+            // libjpeg's defaults, as Image::save() uses
+            Default,
+            // For preview frames: the fast integer DCT, standard Huffman
+            // tables and 4:2:0 chroma
+            Fast,
+            // For keeping: Huffman tables optimised for each image, and
+            // progressive. Noticeably slower, a few percent smaller.
+            Archive
+        };
+
+        // "default", "fast" or "archive". Will throw on anything else.
+        EncodePreset encodePresetFromName( const std::string& name );
+
+        // Optional settings for loading an Image
+        struct LoadOptions
+        {
+            // If non-zero, and smaller than the image, the image comes out
+            // this wide, as if shrink( targetWidth ) had been called. Most
+            // of the reduction is done by libjpeg while decoding (at 1/2,
+            // 1/4 or 1/8 scale), which is several times faster and needs
+            // far less memory than decoding at full size. The pixels will
+            // differ slightly from a full decode followed by shrink().
+            size_t targetWidth = 0;
+
+            // Loading from a file: map it into memory and decode from
+            // there, rather than reading it through stdio
+            bool mapFile = false;
+
+            Codec codec = Codec::LibJpeg;
+
+            // Trade a little accuracy for speed: the integer fast DCT,
+            // and chroma upsampled by plain repetition rather than
+            // interpolation. The pixels will differ slightly.
+            bool fastDct = false;
+            bool fastUpsample = false;
+        };
+
         class Image
         {
         public:
-            // Currently can only construct with an existing file.
+            // An empty 0 x 0 image, for a Decoder to decode frames into
+            Image();
+
+            // Loads an existing file.
             // Will throw if file cannot be loaded, or is in the wrong format,
             // or some other error is encountered.
             explicit Image(const std::string &fileName);
+            Image( const std::string& fileName, const LoadOptions& options );
+
+            // Decodes a JPEG which is already in memory, e.g. a camera frame
+            // or something received over the network. data is only read
+            // during construction, the Image doesn't keep hold of it.
+            Image( const uint8_t* data, size_t size,
+                   const LoadOptions& options = LoadOptions() );
 
             // We can construct from an existing image object. This allows us
             // to work on a copy (e.g. shrink then save) without affecting the
             // original we have in memory.
             Image(const Image &rhs);
 
-            // But assigment and move operations are currently disallowed
+            // How a copy gets its pixels. Deep copies them straight away.
+            // OnWrite shares them with the original until either image is
+            // changed, at which point that one takes its own copy first; so
+            // copying to shrink() or dither doesn't copy the frame at all.
+            enum class CopyMode
+            {
+                Deep,
+                OnWrite
+            };
+            Image( const Image& rhs, CopyMode mode );
+
+            // Moving hands over the pixels without copying them. The image
+            // moved from is left 0 x 0, fit only to be assigned to or
+            // destroyed.
+            Image( Image&& rhs ) noexcept;
+            Image& operator=( Image&& rhs ) noexcept;
+
+            // But copy assignment is currently disallowed
             Image &operator=(const Image &) = delete;
-            Image(Image &&) = delete;
-            Image &operator=(Image &&) = delete;
 
             ~Image();
 
@@ -37,15 +127,41 @@ namespace marengo
             // filename is supplied, writes to fileName supplied in load()
             // (if that was called, otherwise throws)
             // Quality's usable values are 0-100
-            void save(const std::string &fileName, int quality = 95) const;
+            void save( const std::string& fileName, int quality = 95,
+                       Codec codec = Codec::LibJpeg ) const;
+
+            // As save(), but encodes into buffer, which ends up the size of
+            // the JPEG. Pass the same buffer in each time (e.g. per frame):
+            // its capacity is kept and, once big enough, reused without any
+            // further allocation.
+            void saveToBuffer( std::vector<uint8_t>& buffer, int quality = 95,
+                               Codec codec = Codec::LibJpeg ) const;
 
             // Mainly for testing, writes an uncompressed PPM file
             void savePpm(const std::string &fileName) const;
 
+            // Writes a 1 bit per pixel PBM (P4) file, 8 pixels to a byte.
+            // Pixels darker than 128 (averaging R, G and B for colour
+            // images) are black. Meant for the output of fsdMono().
+            void savePbm( const std::string& fileName ) const;
+
             size_t getHeight() const { return m_height; }
             size_t getWidth() const { return m_width; }
             size_t getPixelSize() const { return m_pixelSize; }
 
+            // Direct access to the pixel rows. All rows live in one
+            // contiguous, aligned buffer; getStride() bytes apart.
+            // No bounds checking is done on y.
+            // The non-const getRow() takes a private copy of the pixels
+            // first if they are shared with a CopyMode::OnWrite copy.
+            uint8_t* getRow( size_t y ) { return pixels().getRow( y ); }
+            const uint8_t* getRow( size_t y ) const
+            {
+                return m_bitmap->getRow( y );
+            }
+            size_t getStride() const { return m_bitmap->getStride(); }
+            const Bitmap& getBitmap() const { return *m_bitmap; }
+
             // Will return a vector of pixel components. The vector's
             // size will be 1 for monochrome or 3 for RGB.
             // Elements for the latter will be in order R, G, B.
@@ -55,14 +171,47 @@ namespace marengo
             // For monochrome, will just return the pixel's value directly.
             uint8_t getLuminance(size_t x, size_t y) const;
 
+            // The same as getPixel() and getLuminance(), but inline, with
+            // no allocation and no bounds checking, for use in loops. For
+            // monochrome images all three components are the gray value.
+            std::array<uint8_t, 3> pixelAt( size_t x, size_t y ) const
+            {
+                const uint8_t* p = m_bitmap->getRow( y ) + x * m_pixelSize;
+                if ( m_pixelSize == 1 )
+                {
+                    return { { p[0], p[0], p[0] } };
+                }
+                return { { p[0], p[1], p[2] } };
+            }
+            uint8_t luminanceAt( size_t x, size_t y ) const
+            {
+                const uint8_t* p = m_bitmap->getRow( y ) + x * m_pixelSize;
+                if ( m_pixelSize == 1 )
+                {
+                    return p[0];
+                }
+                return static_cast<uint8_t>( ( p[0] * 2 + p[1] * 3 + p[2] ) / 6 );
+            }
+
             // Get average of a box of pixels, returns a vector<uint8_t> of
             // size 1 for monochrome or three for RGB.
             // Note x & y specify the top left pixel of the box.
             // If the box runs off the end of the row or column then it is
             // shifted left/up to fit which means averages may be a little
             // odd near the right edge / bottom :)
+            // Takes the same time whatever the box size once
+            // buildSummedAreaTable() has been called.
             std::vector<uint8_t> getAverage(size_t x, size_t y, size_t boxSize) const;
 
+            // Builds a summed-area table (see summedarea.h) for getAverage()
+            // to use, at 4 bytes per pixel component. It is thrown away as
+            // soon as the pixels change.
+            void buildSummedAreaTable();
+            const SummedAreaTable* getSummedAreaTable() const
+            {
+                return m_summedArea.get();
+            }
+
             // Shrink (resize smaller, retaining proportion). Does nothing
             // if the specified new width is larger than the existing width.
             // Simply averages pixels' values.
@@ -70,7 +219,38 @@ namespace marengo
 
             void test();
             void fsd();
+
+            // Black and white Floyd-Steinberg dither in a single pass. Gray
+            // levels are worked out on the fly (as fsd() does) for colour
+            // images, and the error is kept in wider, int16 rows so it never
+            // wraps. Unlike fsd() every pixel is dithered, edges included.
+            // The image becomes single channel grayscale holding just 0x00
+            // and 0xFF, so save() writes a grayscale JPEG and savePbm() a
+            // 1 bit file.
+            void fsdMono();
+            // Floyd-Steinberg dither to a colour palette. Without an
+            // argument, uses the built-in 7 colour palette. A Palette does
+            // its (fairly expensive) setup once, so reuse it between images.
+            // With threads > 1 the rows are dithered in parallel, as a
+            // wavefront (see wavefront.h); 0 means one per core. The output
+            // is the same whatever the thread count.
             void fsdColor(  );
+            void fsdColor( const Palette& palette, unsigned threads = 1 );
+            // The same, asking stop() before each row whether to carry on
+            // (on every thread, so it must be safe to call from several at
+            // once). If it says not to, returns false there and then,
+            // leaving the image part dithered.
+            bool fsdColor( const Palette& palette, const std::function<bool()>& stop,
+                           unsigned threads = 1 );
+
+            // The same, with whichever method and colour match you like
+            // (see dither.h and palette.h). Dither::FloydSteinberg with
+            // Scan::Raster and Match::Redmean is fsdColor() itself;
+            // everything else goes through ditherBitmap(), with its error
+            // in int16 rows. Will throw if the image isn't RGB.
+            void dither( const Palette& palette, Dither method,
+                         unsigned threads = 1, Scan scan = Scan::Raster,
+                         Match match = Match::Redmean );
 
             // Expand (resize larger). Simply pads out pixels.
             // Does nothing if the specified new width is less than, or
@@ -80,16 +260,144 @@ namespace marengo
             // Convenience function which either calls shrink or expand
             void resize(size_t newWidth);
 
+            // Whether the transforms which make new pixels (shrink(),
+            // expand(), fsd() of a grayscale image, fsdMono(), resample())
+            // keep the ones they replace, for the next one to reuse. With
+            // their scratch buffers from the thread's ScratchArena (see
+            // arena.h), a loop doing the same to every frame then stops
+            // allocating after the first. Images a Decoder decodes into
+            // keep them; others don't unless asked, as after e.g. shrink()
+            // the pixels kept are the bigger. false frees any kept.
+            void setKeepSpare( bool keep );
+
+            // Bytes held by the pixels kept, 0 if none
+            size_t getSpareCapacity() const { return m_spare.getCapacity(); }
+
+            // Resizes to exactly newWidth x newHeight with a proper filter
+            // (see resample.h). Slower than shrink()/expand() for the box
+            // filter's sake, but it looks a lot better, and the aspect ratio
+            // can change. Will throw if either size is zero.
+            void resample( size_t newWidth, size_t newHeight,
+                           ResampleFilter filter = ResampleFilter::Lanczos3 );
+
         private:
+            friend class Decoder;
+            friend class Encoder;
+
+            // The decode for all the constructors; setSource points libjpeg
+            // at the file or memory to read
+            void load(
+                const std::function<void( ::jpeg_decompress_struct* )>& setSource,
+                const LoadOptions& options
+                );
+            // The encode for save() and saveToBuffer()
+            void encode(
+                const std::function<void( ::jpeg_compress_struct* )>& setDestination,
+                int quality
+                ) const;
+
+            // What load() and encode() do once they have a struct set up,
+            // for Decoder and Encoder to call with theirs. decodeFrom()
+            // reuses the pixel buffer if it is the right size and not shared.
+            void decodeFrom( ::jpeg_decompress_struct* info, const LoadOptions& options );
+            void encodeTo( ::jpeg_compress_struct* info, int quality,
+                           EncodePreset preset = EncodePreset::Default ) const;
+
+            // The same through TurboJPEG, from and to memory
+            void loadTurbo( const uint8_t* data, size_t size, const LoadOptions& options );
+            void encodeTurbo( std::vector<uint8_t>& buffer, int quality ) const;
+
+            // The pixels, to write to. Unshares them first if need be.
+            Bitmap& pixels()
+            {
+                m_summedArea.reset();
+                if ( m_bitmap.use_count() > 1 )
+                {
+                    MARENGO_TRACE_COUNT( "image.unshared", 1 );
+                    m_bitmap = std::make_shared<Bitmap>( *m_bitmap );
+                }
+                return *m_bitmap;
+            }
+
+            // Swaps in a transform's result, size and all. The pixels it
+            // replaces are kept, if nobody else has them, for the next
+            // spareBitmap().
+            void replaceBitmap( Bitmap&& bitmap );
+
+            // A width x height bitmap for a transform's result, in the
+            // memory of the last one replaced if that is big enough
+            Bitmap spareBitmap( size_t width, size_t height, size_t pixelSize );
+
             // Note that m_errorMgr is a shared ptr and will be shared
             // between objects if one copy constructs from another
             std::shared_ptr<::jpeg_error_mgr> m_errorMgr;
-            std::vector<std::vector<uint8_t>> m_bitmapData;
+            // Only shared between CopyMode::OnWrite copies. Anything which
+            // changes pixels goes through pixels(), or replaces it.
+            std::shared_ptr<Bitmap> m_bitmap;
+            // Only there after buildSummedAreaTable(), until pixels change
+            std::shared_ptr<const SummedAreaTable> m_summedArea;
+            // The last pixels replaced, see spareBitmap()
+            Bitmap m_spare;
+            bool m_keepSpare = false;
             size_t m_width;
             size_t m_height;
             size_t m_pixelSize;
             int m_colourSpace;
         };
 
+        // Decodes one JPEG after another (e.g. camera frames) into the
+        // same Image, keeping the libjpeg decompressor, and the image's
+        // pixels if the size doesn't change, from one to the next. So
+        // after the first frame there is no libjpeg set up and no pixel
+        // buffer allocated per frame (unless options.targetWidth makes
+        // shrink() do some work).
+        // The result is the same as constructing Image( data, size, options ).
+        class Decoder
+        {
+        public:
+            Decoder();
+            ~Decoder();
+
+            Decoder( const Decoder& ) = delete;
+            Decoder& operator=( const Decoder& ) = delete;
+
+            // Will throw if data isn't a JPEG; the decoder is still fine to
+            // use afterwards, image is left with undefined pixels.
+            void decode( const uint8_t* data, size_t size, Image& image,
+                         const LoadOptions& options = LoadOptions() );
+
+        private:
+            struct State;
+            std::unique_ptr<State> m_state;
+        };
+
+        // Image::saveToBuffer() and save(), keeping the libjpeg compressor
+        // (and for save(), the buffer) from one image to the next, and
+        // encoding with preset
+        class Encoder
+        {
+        public:
+            explicit Encoder( EncodePreset preset = EncodePreset::Default );
+            ~Encoder();
+
+            Encoder( const Encoder& ) = delete;
+            Encoder& operator=( const Encoder& ) = delete;
+
+            EncodePreset getPreset() const { return m_preset; }
+            void setPreset( EncodePreset preset ) { m_preset = preset; }
+
+            void encode( const Image& image, std::vector<uint8_t>& buffer,
+                         int quality = 95 );
+
+            // Will throw if fileName can't be written
+            void save( const Image& image, const std::string& fileName,
+                       int quality = 95 );
+
+        private:
+            struct State;
+            std::unique_ptr<State> m_state;
+            EncodePreset m_preset;
+        };
+
     } // namespace jpeg
 } // namespace marengo
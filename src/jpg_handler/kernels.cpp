@@ -0,0 +1,930 @@
+#include "kernels.h"
+#include "quantizer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define MARENGO_X86 1
+#include <immintrin.h>
+// We build the x86 kernels with per-function target attributes rather
+// than -msse4.1/-mavx2 for the whole program, so one binary runs on any
+// x86 machine and picks its kernels at run time.
+#define MARENGO_TARGET_SSE41 __attribute__(( target( "sse4.1" ) ))
+#define MARENGO_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+// NEON is always there on aarch64. On 32-bit ARM it is only used when the
+// compiler has been told about it (e.g. -mfpu=neon-vfpv4).
+#define MARENGO_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace marengo
+{
+namespace jpeg
+{
+namespace kernels
+{
+
+namespace
+{
+
+//
+// Scalar reference versions
+//
+
+void grayFromRgbScalar( const uint8_t* rgb, uint8_t* gray, size_t width )
+{
+    for ( size_t x = 0; x < width; ++x, rgb += 3 )
+    {
+        gray[x] = ( rgb[0] + rgb[1] + rgb[2] ) / 3;
+    }
+}
+
+void rgbFromGrayScalar( const uint8_t* gray, uint8_t* rgb, size_t width )
+{
+    for ( size_t x = 0; x < width; ++x )
+    {
+        *rgb++ = gray[x];
+        *rgb++ = gray[x];
+        *rgb++ = gray[x];
+    }
+}
+
+void fsdColorRowScalar( uint8_t* cur, uint8_t* next, size_t width,
+                        size_t begin, size_t end, const Quantizer& q )
+{
+    const uint8_t* border = q.getColour( 0 );
+    const size_t rowSize = width * 3;
+
+    int16_t errorR;
+    int16_t errorG;
+    int16_t errorB;
+    for ( size_t col = begin * 3; col < end * 3; col += 3 )
+    {
+        if ( col == 0 || col >= rowSize - 3 || next == nullptr )
+        {
+            cur[col] = border[0];
+            cur[col+1] = border[1];
+            cur[col+2] = border[2];
+            continue;
+        }
+        const uint8_t* newPixel = q.getColour(
+            q.nearest( cur[col], cur[col + 1], cur[col + 2] ) );
+
+        errorR = cur[col] - newPixel[0];
+        errorG = cur[col + 1] - newPixel[1];
+        errorB = cur[col + 2] - newPixel[2];
+
+        cur [col + 0 + 3] += errorR*7/16;
+        cur [col + 1 + 3] += errorG*7/16;
+        cur [col + 2 + 3] += errorB*7/16;
+
+        next[col + 0 + 3 ] += errorR*1/16;
+        next[col + 1 + 3 ] += errorG*1/16;
+        next[col + 2 + 3 ] += errorB*1/16;
+
+        next[col  + 0    ] += errorR*5/16;
+        next[col  + 1    ] += errorG*5/16;
+        next[col  + 2    ] += errorB*5/16;
+
+        next[col - 0 - 3 ] += errorR*3/16;
+        next[col + 1 - 3 ] += errorG*3/16;
+        next[col + 2 - 3 ] += errorB*3/16;
+
+        cur[col] = newPixel[0];
+        cur[col+1] = newPixel[1];
+        cur[col+2] = newPixel[2];
+    }
+}
+
+uint8_t clampByte( int32_t v )
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Bytes [begin, end) of resampleRows()
+void resampleBytesScalar( const uint8_t* const* rows, const int16_t* weights,
+                          size_t taps, uint8_t* dst, size_t begin, size_t end )
+{
+    for ( size_t i = begin; i < end; ++i )
+    {
+        int32_t sum = 1 << ( kWeightBits - 1 );
+        for ( size_t t = 0; t < taps; ++t )
+        {
+            sum += weights[t] * rows[t][i];
+        }
+        dst[i] = clampByte( sum >> kWeightBits );
+    }
+}
+
+void resampleRowsScalar( const uint8_t* const* rows, const int16_t* weights,
+                         size_t taps, uint8_t* dst, size_t bytes )
+{
+    resampleBytesScalar( rows, weights, taps, dst, 0, bytes );
+}
+
+void fillBorder( uint8_t* cur, size_t begin, size_t end, const uint8_t* border )
+{
+    for ( size_t x = begin; x < end; ++x )
+    {
+        std::memcpy( cur + x * 3, border, 3 );
+    }
+}
+
+//
+// The vector versions all share this shape. Per pixel:
+//  - the palette search only runs when the Quantizer's cell for the colour
+//    has more than one candidate. For small palettes it then evaluates the
+//    distance to every entry at once, a register's worth at a time; big
+//    ones are better off with the Quantizer's own candidate list.
+//  - the error terms for all three channels and all four neighbours are
+//    scaled together as one vector of int16s. Bytes 0-8 come out as the
+//    additions for the three pixels below (left, centre, right) and bytes
+//    9-11 as the one for the pixel to the right, so the row below is
+//    updated with a single 16 byte load/add/store, and the pixel to the
+//    right just stays in a register until the next iteration picks it up.
+//    If the span stops short of the row end, that last carry is added
+//    into memory for whoever does the next span.
+//
+// Division is by 16 rounding towards zero, exactly like the int16
+// arithmetic in the scalar version, and the additions wrap mod 256 just
+// as the byte additions there do.
+//
+
+// Palettes up to this (padded) size skip the lookup table altogether and
+// are brute force searched in vector registers, which is branch free.
+// Bigger ones use the Quantizer's cells.
+constexpr size_t kVectorSearchMax = 8;
+
+// The search packs ( distance << 8 ) | index into one int32 so a plain
+// vector min finds the nearest entry and, on a tie, the lowest index.
+// Real distances never exceed 3 * 255^2 + 4 * 255^2 + 3 * 255^2 < 2^20;
+// only the padding entries get clamped.
+constexpr int32_t kKeyClamp = ( 1 << 23 ) - 1;
+
+#ifdef MARENGO_X86
+
+MARENGO_TARGET_SSE41
+inline __m128i div16Sse41( __m128i p )
+{
+    const __m128i bias = _mm_and_si128( _mm_srai_epi16( p, 15 ),
+                                        _mm_set1_epi16( 15 ) );
+    return _mm_srai_epi16( _mm_add_epi16( p, bias ), 4 );
+}
+
+MARENGO_TARGET_SSE41
+inline size_t nearestSse41( const Quantizer& q, int r, int g, int b )
+{
+    const size_t padded = q.getPaddedSize();
+    size_t idx;
+    if ( padded > kVectorSearchMax && q.lookup( r, g, b, idx ) )
+    {
+        return idx;
+    }
+    if ( padded > kVectorSearchMax )
+    {
+        return q.nearest( r, g, b );
+    }
+    const int32_t* pr = q.getPlane( 0 );
+    const int32_t* pg = q.getPlane( 1 );
+    const int32_t* pb = q.getPlane( 2 );
+    const __m128i vr = _mm_set1_epi32( r );
+    const __m128i vg = _mm_set1_epi32( g );
+    const __m128i vb = _mm_set1_epi32( b );
+    const __m128i limit = _mm_set1_epi32( 256 );
+    const __m128i clamp = _mm_set1_epi32( kKeyClamp );
+    const __m128i step = _mm_set1_epi32( 4 );
+    __m128i lane = _mm_setr_epi32( 0, 1, 2, 3 );
+    __m128i best = _mm_set1_epi32( INT_MAX );
+    for ( size_t i = 0; i < padded; i += 4 )
+    {
+        const __m128i cr = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pr + i ) );
+        const __m128i cg = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pg + i ) );
+        const __m128i cb = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + i ) );
+        const __m128i dR = _mm_sub_epi32( vr, cr );
+        const __m128i dG = _mm_sub_epi32( vg, cg );
+        const __m128i dB = _mm_sub_epi32( vb, cb );
+        const __m128i dR2 = _mm_mullo_epi32( dR, dR );
+        const __m128i dG2 = _mm_mullo_epi32( dG, dG );
+        const __m128i dB2 = _mm_mullo_epi32( dB, dB );
+        // ( r + pr ) / 2 < 128 picks the 2,4,3 weights, else 3,4,2
+        const __m128i low = _mm_cmplt_epi32( _mm_add_epi32( vr, cr ), limit );
+        __m128i d = _mm_add_epi32( _mm_slli_epi32( _mm_add_epi32( dR2, dB2 ), 1 ),
+                                   _mm_slli_epi32( dG2, 2 ) );
+        d = _mm_add_epi32( d, _mm_blendv_epi8( dR2, dB2, low ) );
+        const __m128i key = _mm_or_si128( _mm_slli_epi32( _mm_min_epi32( d, clamp ), 8 ), lane );
+        best = _mm_min_epi32( best, key );
+        lane = _mm_add_epi32( lane, step );
+    }
+    best = _mm_min_epi32( best, _mm_shuffle_epi32( best, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    best = _mm_min_epi32( best, _mm_shuffle_epi32( best, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    return _mm_cvtsi128_si32( best ) & 0xFF;
+}
+
+MARENGO_TARGET_SSE41
+void fsdColorRowSse41( uint8_t* cur, uint8_t* next, size_t width,
+                       size_t begin, size_t end, const Quantizer& q )
+{
+    const uint8_t* border = q.getColour( 0 );
+    if ( next == nullptr )
+    {
+        fillBorder( cur, begin, end, border );
+        return;
+    }
+    size_t x = begin;
+    if ( x == 0 && end > 0 )
+    {
+        std::memcpy( cur, border, 3 );
+        x = 1;
+    }
+    const size_t interiorEnd = std::max( x, std::min( end, width - 1 ) );
+
+    const __m128i lowByte = _mm_set1_epi16( 0xFF );
+    // int16 lanes 0-2 of the error (R, G, B) to [ R G B R G B R G ]
+    // and [ B R G B 0 0 0 0 ], to pair with the weights below
+    const __m128i spreadA = _mm_setr_epi8( 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3 );
+    const __m128i spreadB = _mm_setr_epi8( 4, 5, 0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m128i weightA = _mm_setr_epi16( 3, 3, 3, 5, 5, 5, 1, 1 );
+    const __m128i weightB = _mm_setr_epi16( 1, 7, 7, 7, 0, 0, 0, 0 );
+    const __m128i belowMask = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0 );
+
+    // What the pixel to the right is still owed (int16 lanes 0-2)
+    __m128i carry = _mm_setzero_si128();
+
+    for ( ; x < interiorEnd; ++x )
+    {
+        uint8_t* px = cur + x * 3;
+        uint32_t word;
+        std::memcpy( &word, px, 4 ); // the 4th byte is along for the ride
+        const __m128i v = _mm_and_si128(
+            _mm_add_epi16( _mm_cvtepu8_epi16( _mm_cvtsi32_si128( word ) ), carry ),
+            lowByte );
+        const size_t idx = nearestSse41( q, _mm_extract_epi16( v, 0 ),
+                                         _mm_extract_epi16( v, 1 ),
+                                         _mm_extract_epi16( v, 2 ) );
+        const uint32_t colour = q.getColourWord( idx );
+        const __m128i e = _mm_sub_epi16(
+            v, _mm_cvtepu8_epi16( _mm_cvtsi32_si128( colour ) ) );
+
+        const __m128i pA = _mm_and_si128(
+            div16Sse41( _mm_mullo_epi16( _mm_shuffle_epi8( e, spreadA ), weightA ) ),
+            lowByte );
+        const __m128i pB = _mm_and_si128(
+            div16Sse41( _mm_mullo_epi16( _mm_shuffle_epi8( e, spreadB ), weightB ) ),
+            lowByte );
+        const __m128i bytes = _mm_packus_epi16( pA, pB );
+
+        __m128i* below = reinterpret_cast<__m128i*>( next + x * 3 - 3 );
+        _mm_storeu_si128( below, _mm_add_epi8( _mm_loadu_si128( below ),
+                                               _mm_and_si128( bytes, belowMask ) ) );
+        carry = _mm_cvtepu8_epi16( _mm_srli_si128( bytes, 9 ) );
+
+        std::memcpy( px, &colour, 3 );
+    }
+    if ( begin < interiorEnd && interiorEnd + 1 < width )
+    {
+        uint8_t* px = cur + interiorEnd * 3;
+        const uint32_t owed = _mm_cvtsi128_si32(
+            _mm_packus_epi16( carry, _mm_setzero_si128() ) );
+        px[0] += owed & 0xFF;
+        px[1] += ( owed >> 8 ) & 0xFF;
+        px[2] += ( owed >> 16 ) & 0xFF;
+    }
+    if ( end == width && width > 1 )
+    {
+        std::memcpy( cur + ( width - 1 ) * 3, border, 3 );
+    }
+}
+
+MARENGO_TARGET_SSE41
+void grayFromRgbSse41( const uint8_t* rgb, uint8_t* gray, size_t width )
+{
+    // De-interleave 16 pixels (48 bytes) into R, G and B registers
+    const __m128i rA = _mm_setr_epi8( 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m128i rB = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 );
+    const __m128i rC = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 );
+    const __m128i gA = _mm_setr_epi8( 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m128i gB = _mm_setr_epi8( -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 );
+    const __m128i gC = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 );
+    const __m128i bA = _mm_setr_epi8( 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m128i bB = _mm_setr_epi8( -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 );
+    const __m128i bC = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 );
+    // x / 3 == ( x * 43691 ) >> 17 for every 16 bit x
+    const __m128i third = _mm_set1_epi16( static_cast<short>( 43691 ) );
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t x = 0;
+    for ( ; x + 16 <= width; x += 16, rgb += 48 )
+    {
+        const __m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rgb ) );
+        const __m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rgb + 16 ) );
+        const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rgb + 32 ) );
+        const __m128i r = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8( a, rA ),
+                                                      _mm_shuffle_epi8( b, rB ) ),
+                                        _mm_shuffle_epi8( c, rC ) );
+        const __m128i g = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8( a, gA ),
+                                                      _mm_shuffle_epi8( b, gB ) ),
+                                        _mm_shuffle_epi8( c, gC ) );
+        const __m128i bl = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8( a, bA ),
+                                                       _mm_shuffle_epi8( b, bB ) ),
+                                         _mm_shuffle_epi8( c, bC ) );
+        __m128i lo = _mm_add_epi16( _mm_add_epi16( _mm_unpacklo_epi8( r, zero ),
+                                                   _mm_unpacklo_epi8( g, zero ) ),
+                                    _mm_unpacklo_epi8( bl, zero ) );
+        __m128i hi = _mm_add_epi16( _mm_add_epi16( _mm_unpackhi_epi8( r, zero ),
+                                                   _mm_unpackhi_epi8( g, zero ) ),
+                                    _mm_unpackhi_epi8( bl, zero ) );
+        lo = _mm_srli_epi16( _mm_mulhi_epu16( lo, third ), 1 );
+        hi = _mm_srli_epi16( _mm_mulhi_epu16( hi, third ), 1 );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( gray + x ),
+                          _mm_packus_epi16( lo, hi ) );
+    }
+    grayFromRgbScalar( rgb, gray + x, width - x );
+}
+
+MARENGO_TARGET_SSE41
+void rgbFromGraySse41( const uint8_t* gray, uint8_t* rgb, size_t width )
+{
+    const __m128i s0 = _mm_setr_epi8( 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 );
+    const __m128i s1 = _mm_setr_epi8( 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 );
+    const __m128i s2 = _mm_setr_epi8( 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 );
+    size_t x = 0;
+    for ( ; x + 16 <= width; x += 16, rgb += 48 )
+    {
+        const __m128i g = _mm_loadu_si128( reinterpret_cast<const __m128i*>( gray + x ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( rgb ), _mm_shuffle_epi8( g, s0 ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( rgb + 16 ), _mm_shuffle_epi8( g, s1 ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( rgb + 32 ), _mm_shuffle_epi8( g, s2 ) );
+    }
+    rgbFromGrayScalar( gray + x, rgb, width - x );
+}
+
+MARENGO_TARGET_AVX2
+inline size_t nearestAvx2( const Quantizer& q, int r, int g, int b )
+{
+    const size_t padded = q.getPaddedSize();
+    size_t idx;
+    if ( padded > kVectorSearchMax && q.lookup( r, g, b, idx ) )
+    {
+        return idx;
+    }
+    if ( padded > kVectorSearchMax )
+    {
+        return q.nearest( r, g, b );
+    }
+    const int32_t* pr = q.getPlane( 0 );
+    const int32_t* pg = q.getPlane( 1 );
+    const int32_t* pb = q.getPlane( 2 );
+    const __m256i vr = _mm256_set1_epi32( r );
+    const __m256i vg = _mm256_set1_epi32( g );
+    const __m256i vb = _mm256_set1_epi32( b );
+    const __m256i limit = _mm256_set1_epi32( 256 );
+    const __m256i clamp = _mm256_set1_epi32( kKeyClamp );
+    const __m256i step = _mm256_set1_epi32( 8 );
+    __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+    __m256i best = _mm256_set1_epi32( INT_MAX );
+    for ( size_t i = 0; i < padded; i += 8 )
+    {
+        const __m256i cr = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( pr + i ) );
+        const __m256i cg = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( pg + i ) );
+        const __m256i cb = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( pb + i ) );
+        const __m256i dR = _mm256_sub_epi32( vr, cr );
+        const __m256i dG = _mm256_sub_epi32( vg, cg );
+        const __m256i dB = _mm256_sub_epi32( vb, cb );
+        const __m256i dR2 = _mm256_mullo_epi32( dR, dR );
+        const __m256i dG2 = _mm256_mullo_epi32( dG, dG );
+        const __m256i dB2 = _mm256_mullo_epi32( dB, dB );
+        const __m256i low = _mm256_cmpgt_epi32( limit, _mm256_add_epi32( vr, cr ) );
+        __m256i d = _mm256_add_epi32( _mm256_slli_epi32( _mm256_add_epi32( dR2, dB2 ), 1 ),
+                                      _mm256_slli_epi32( dG2, 2 ) );
+        d = _mm256_add_epi32( d, _mm256_blendv_epi8( dR2, dB2, low ) );
+        const __m256i key = _mm256_or_si256(
+            _mm256_slli_epi32( _mm256_min_epi32( d, clamp ), 8 ), lane );
+        best = _mm256_min_epi32( best, key );
+        lane = _mm256_add_epi32( lane, step );
+    }
+    __m128i m = _mm_min_epi32( _mm256_castsi256_si128( best ),
+                               _mm256_extracti128_si256( best, 1 ) );
+    m = _mm_min_epi32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    m = _mm_min_epi32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    return _mm_cvtsi128_si32( m ) & 0xFF;
+}
+
+MARENGO_TARGET_AVX2
+void fsdColorRowAvx2( uint8_t* cur, uint8_t* next, size_t width,
+                      size_t begin, size_t end, const Quantizer& q )
+{
+    const uint8_t* border = q.getColour( 0 );
+    if ( next == nullptr )
+    {
+        fillBorder( cur, begin, end, border );
+        return;
+    }
+    size_t x = begin;
+    if ( x == 0 && end > 0 )
+    {
+        std::memcpy( cur, border, 3 );
+        x = 1;
+    }
+    const size_t interiorEnd = std::max( x, std::min( end, width - 1 ) );
+
+    const __m128i lowByte = _mm_set1_epi16( 0xFF );
+    // As the SSE4.1 version, but both halves are built, scaled and
+    // divided side by side in one 256 bit register
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3,
+        4, 5, 0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m256i weight = _mm256_setr_epi16( 3, 3, 3, 5, 5, 5, 1, 1,
+                                              1, 7, 7, 7, 0, 0, 0, 0 );
+    const __m256i fifteen = _mm256_set1_epi16( 15 );
+    const __m256i lowBytes = _mm256_set1_epi16( 0xFF );
+    const __m128i belowMask = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0 );
+
+    __m128i carry = _mm_setzero_si128();
+
+    for ( ; x < interiorEnd; ++x )
+    {
+        uint8_t* px = cur + x * 3;
+        uint32_t word;
+        std::memcpy( &word, px, 4 );
+        const __m128i v = _mm_and_si128(
+            _mm_add_epi16( _mm_cvtepu8_epi16( _mm_cvtsi32_si128( word ) ), carry ),
+            lowByte );
+        const size_t idx = nearestAvx2( q, _mm_extract_epi16( v, 0 ),
+                                        _mm_extract_epi16( v, 1 ),
+                                        _mm_extract_epi16( v, 2 ) );
+        const uint32_t colour = q.getColourWord( idx );
+        const __m128i e = _mm_sub_epi16(
+            v, _mm_cvtepu8_epi16( _mm_cvtsi32_si128( colour ) ) );
+
+        __m256i p = _mm256_mullo_epi16(
+            _mm256_shuffle_epi8( _mm256_broadcastsi128_si256( e ), spread ), weight );
+        p = _mm256_srai_epi16(
+            _mm256_add_epi16( p, _mm256_and_si256( _mm256_srai_epi16( p, 15 ), fifteen ) ), 4 );
+        p = _mm256_and_si256( p, lowBytes );
+        const __m128i bytes = _mm_packus_epi16( _mm256_castsi256_si128( p ),
+                                                _mm256_extracti128_si256( p, 1 ) );
+
+        __m128i* below = reinterpret_cast<__m128i*>( next + x * 3 - 3 );
+        _mm_storeu_si128( below, _mm_add_epi8( _mm_loadu_si128( below ),
+                                               _mm_and_si128( bytes, belowMask ) ) );
+        carry = _mm_cvtepu8_epi16( _mm_srli_si128( bytes, 9 ) );
+
+        std::memcpy( px, &colour, 3 );
+    }
+    if ( begin < interiorEnd && interiorEnd + 1 < width )
+    {
+        uint8_t* px = cur + interiorEnd * 3;
+        const uint32_t owed = _mm_cvtsi128_si32(
+            _mm_packus_epi16( carry, _mm_setzero_si128() ) );
+        px[0] += owed & 0xFF;
+        px[1] += ( owed >> 8 ) & 0xFF;
+        px[2] += ( owed >> 16 ) & 0xFF;
+    }
+    if ( end == width && width > 1 )
+    {
+        std::memcpy( cur + ( width - 1 ) * 3, border, 3 );
+    }
+}
+
+// The resampling kernels work on two rows at once: their bytes are
+// interleaved, widened to int16 pairs and multiplied by a pair of weights
+// with one madd, which sums them into int32 as well.
+MARENGO_TARGET_SSE41
+void resampleRowsSse41( const uint8_t* const* rows, const int16_t* weights,
+                        size_t taps, uint8_t* dst, size_t bytes )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32( 1 << ( kWeightBits - 1 ) );
+    size_t x = 0;
+    for ( ; x + 16 <= bytes; x += 16 )
+    {
+        __m128i acc0 = half;
+        __m128i acc1 = half;
+        __m128i acc2 = half;
+        __m128i acc3 = half;
+        for ( size_t t = 0; t < taps; t += 2 )
+        {
+            const __m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rows[t] + x ) );
+            __m128i b = zero;
+            uint32_t pair = static_cast<uint16_t>( weights[t] );
+            if ( t + 1 < taps )
+            {
+                b = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rows[t + 1] + x ) );
+                pair |= static_cast<uint32_t>( static_cast<uint16_t>( weights[t + 1] ) ) << 16;
+            }
+            const __m128i w = _mm_set1_epi32( static_cast<int32_t>( pair ) );
+            const __m128i lo = _mm_unpacklo_epi8( a, b );
+            const __m128i hi = _mm_unpackhi_epi8( a, b );
+            acc0 = _mm_add_epi32( acc0, _mm_madd_epi16( _mm_unpacklo_epi8( lo, zero ), w ) );
+            acc1 = _mm_add_epi32( acc1, _mm_madd_epi16( _mm_unpackhi_epi8( lo, zero ), w ) );
+            acc2 = _mm_add_epi32( acc2, _mm_madd_epi16( _mm_unpacklo_epi8( hi, zero ), w ) );
+            acc3 = _mm_add_epi32( acc3, _mm_madd_epi16( _mm_unpackhi_epi8( hi, zero ), w ) );
+        }
+        // The saturating packs do the clamping to 0-255
+        const __m128i p01 = _mm_packs_epi32( _mm_srai_epi32( acc0, kWeightBits ),
+                                             _mm_srai_epi32( acc1, kWeightBits ) );
+        const __m128i p23 = _mm_packs_epi32( _mm_srai_epi32( acc2, kWeightBits ),
+                                             _mm_srai_epi32( acc3, kWeightBits ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + x ), _mm_packus_epi16( p01, p23 ) );
+    }
+    resampleBytesScalar( rows, weights, taps, dst, x, bytes );
+}
+
+MARENGO_TARGET_AVX2
+void resampleRowsAvx2( const uint8_t* const* rows, const int16_t* weights,
+                       size_t taps, uint8_t* dst, size_t bytes )
+{
+    // Same as the SSE4.1 version, 32 bytes at a time. The unpacks and
+    // packs all work within 128 bit lanes, so the bytes come out in order.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi32( 1 << ( kWeightBits - 1 ) );
+    size_t x = 0;
+    for ( ; x + 32 <= bytes; x += 32 )
+    {
+        __m256i acc0 = half;
+        __m256i acc1 = half;
+        __m256i acc2 = half;
+        __m256i acc3 = half;
+        for ( size_t t = 0; t < taps; t += 2 )
+        {
+            const __m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( rows[t] + x ) );
+            __m256i b = zero;
+            uint32_t pair = static_cast<uint16_t>( weights[t] );
+            if ( t + 1 < taps )
+            {
+                b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( rows[t + 1] + x ) );
+                pair |= static_cast<uint32_t>( static_cast<uint16_t>( weights[t + 1] ) ) << 16;
+            }
+            const __m256i w = _mm256_set1_epi32( static_cast<int32_t>( pair ) );
+            const __m256i lo = _mm256_unpacklo_epi8( a, b );
+            const __m256i hi = _mm256_unpackhi_epi8( a, b );
+            acc0 = _mm256_add_epi32( acc0, _mm256_madd_epi16( _mm256_unpacklo_epi8( lo, zero ), w ) );
+            acc1 = _mm256_add_epi32( acc1, _mm256_madd_epi16( _mm256_unpackhi_epi8( lo, zero ), w ) );
+            acc2 = _mm256_add_epi32( acc2, _mm256_madd_epi16( _mm256_unpacklo_epi8( hi, zero ), w ) );
+            acc3 = _mm256_add_epi32( acc3, _mm256_madd_epi16( _mm256_unpackhi_epi8( hi, zero ), w ) );
+        }
+        const __m256i p01 = _mm256_packs_epi32( _mm256_srai_epi32( acc0, kWeightBits ),
+                                                _mm256_srai_epi32( acc1, kWeightBits ) );
+        const __m256i p23 = _mm256_packs_epi32( _mm256_srai_epi32( acc2, kWeightBits ),
+                                                _mm256_srai_epi32( acc3, kWeightBits ) );
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>( dst + x ), _mm256_packus_epi16( p01, p23 ) );
+    }
+    resampleBytesScalar( rows, weights, taps, dst, x, bytes );
+}
+
+#endif // MARENGO_X86
+
+#ifdef MARENGO_NEON
+
+inline int16x8_t div16Neon( int16x8_t p )
+{
+    const int16x8_t bias = vandq_s16( vshrq_n_s16( p, 15 ), vdupq_n_s16( 15 ) );
+    return vshrq_n_s16( vaddq_s16( p, bias ), 4 );
+}
+
+inline size_t nearestNeon( const Quantizer& q, int r, int g, int b )
+{
+    const size_t padded = q.getPaddedSize();
+    size_t idx;
+    if ( padded > kVectorSearchMax && q.lookup( r, g, b, idx ) )
+    {
+        return idx;
+    }
+    if ( padded > kVectorSearchMax )
+    {
+        return q.nearest( r, g, b );
+    }
+    const int32_t* pr = q.getPlane( 0 );
+    const int32_t* pg = q.getPlane( 1 );
+    const int32_t* pb = q.getPlane( 2 );
+    const int32x4_t vr = vdupq_n_s32( r );
+    const int32x4_t vg = vdupq_n_s32( g );
+    const int32x4_t vb = vdupq_n_s32( b );
+    const int32x4_t limit = vdupq_n_s32( 256 );
+    const int32x4_t clamp = vdupq_n_s32( kKeyClamp );
+    const int32x4_t step = vdupq_n_s32( 4 );
+    static const int32_t firstLanes[4] = { 0, 1, 2, 3 };
+    int32x4_t lane = vld1q_s32( firstLanes );
+    int32x4_t best = vdupq_n_s32( INT_MAX );
+    for ( size_t i = 0; i < padded; i += 4 )
+    {
+        const int32x4_t cr = vld1q_s32( pr + i );
+        const int32x4_t dR = vsubq_s32( vr, cr );
+        const int32x4_t dG = vsubq_s32( vg, vld1q_s32( pg + i ) );
+        const int32x4_t dB = vsubq_s32( vb, vld1q_s32( pb + i ) );
+        const int32x4_t dR2 = vmulq_s32( dR, dR );
+        const int32x4_t dG2 = vmulq_s32( dG, dG );
+        const int32x4_t dB2 = vmulq_s32( dB, dB );
+        const uint32x4_t low = vcltq_s32( vaddq_s32( vr, cr ), limit );
+        int32x4_t d = vaddq_s32( vshlq_n_s32( vaddq_s32( dR2, dB2 ), 1 ),
+                                 vshlq_n_s32( dG2, 2 ) );
+        d = vaddq_s32( d, vbslq_s32( low, dB2, dR2 ) );
+        const int32x4_t key = vorrq_s32( vshlq_n_s32( vminq_s32( d, clamp ), 8 ), lane );
+        best = vminq_s32( best, key );
+        lane = vaddq_s32( lane, step );
+    }
+    int32x2_t m = vpmin_s32( vget_low_s32( best ), vget_high_s32( best ) );
+    m = vpmin_s32( m, m );
+    return vget_lane_s32( m, 0 ) & 0xFF;
+}
+
+void fsdColorRowNeon( uint8_t* cur, uint8_t* next, size_t width,
+                      size_t begin, size_t end, const Quantizer& q )
+{
+    const uint8_t* border = q.getColour( 0 );
+    if ( next == nullptr )
+    {
+        fillBorder( cur, begin, end, border );
+        return;
+    }
+    size_t x = begin;
+    if ( x == 0 && end > 0 )
+    {
+        std::memcpy( cur, border, 3 );
+        x = 1;
+    }
+    const size_t interiorEnd = std::max( x, std::min( end, width - 1 ) );
+
+    // Same layout as the x86 versions: int16 lanes 0-2 of the error are
+    // spread to [ R G B R G B R G ] and [ B R G B 0 0 0 0 ]
+    static const uint8_t spreadA[16] = { 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3 };
+    static const uint8_t spreadB[16] = { 4, 5, 0, 1, 2, 3, 4, 5, 255, 255, 255, 255, 255, 255, 255, 255 };
+    static const int16_t weightA[8] = { 3, 3, 3, 5, 5, 5, 1, 1 };
+    static const int16_t weightB[8] = { 1, 7, 7, 7, 0, 0, 0, 0 };
+    static const uint8_t belowMask[16] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0 };
+    const uint8x16_t vSpreadA = vld1q_u8( spreadA );
+    const uint8x16_t vSpreadB = vld1q_u8( spreadB );
+    const int16x8_t vWeightA = vld1q_s16( weightA );
+    const int16x8_t vWeightB = vld1q_s16( weightB );
+    const uint8x16_t vBelowMask = vld1q_u8( belowMask );
+
+    // What the pixel to the right is still owed (bytes 0-2)
+    uint8x8_t carry = vdup_n_u8( 0 );
+
+    for ( ; x < interiorEnd; ++x )
+    {
+        uint8_t* px = cur + x * 3;
+        uint32_t word;
+        std::memcpy( &word, px, 4 ); // the 4th byte is along for the ride
+        // Byte adds wrap mod 256, just like the scalar version's
+        const uint8x8_t v = vadd_u8( vreinterpret_u8_u32( vdup_n_u32( word ) ), carry );
+        const size_t idx = nearestNeon( q, vget_lane_u8( v, 0 ),
+                                        vget_lane_u8( v, 1 ),
+                                        vget_lane_u8( v, 2 ) );
+        const uint32_t colour = q.getColourWord( idx );
+        const int16x8_t e = vreinterpretq_s16_u16( vsubl_u8(
+            v, vreinterpret_u8_u32( vdup_n_u32( colour ) ) ) );
+
+        // Byte shuffle of the int16 lanes; out of range indices give 0.
+        // (vtbl2 rather than vqtbl1q so this builds for 32-bit ARM too.)
+        const uint8x16_t eb = vreinterpretq_u8_s16( e );
+        uint8x8x2_t table;
+        table.val[0] = vget_low_u8( eb );
+        table.val[1] = vget_high_u8( eb );
+        const int16x8_t sA = vreinterpretq_s16_u8( vcombine_u8(
+            vtbl2_u8( table, vget_low_u8( vSpreadA ) ),
+            vtbl2_u8( table, vget_high_u8( vSpreadA ) ) ) );
+        const int16x8_t sB = vreinterpretq_s16_u8( vcombine_u8(
+            vtbl2_u8( table, vget_low_u8( vSpreadB ) ),
+            vtbl2_u8( table, vget_high_u8( vSpreadB ) ) ) );
+        const int16x8_t pA = div16Neon( vmulq_s16( sA, vWeightA ) );
+        const int16x8_t pB = div16Neon( vmulq_s16( sB, vWeightB ) );
+        // vmovn keeps the low byte of each lane: the same as wrapping mod 256
+        const uint8x16_t bytes = vreinterpretq_u8_s8(
+            vcombine_s8( vmovn_s16( pA ), vmovn_s16( pB ) ) );
+
+        uint8_t* below = next + x * 3 - 3;
+        vst1q_u8( below, vaddq_u8( vld1q_u8( below ), vandq_u8( bytes, vBelowMask ) ) );
+        // bytes 9-11 down to 0-2 (12-15 are always 0)
+        carry = vget_low_u8( vextq_u8( bytes, vdupq_n_u8( 0 ), 9 ) );
+
+        std::memcpy( px, &colour, 3 );
+    }
+    if ( begin < interiorEnd && interiorEnd + 1 < width )
+    {
+        uint8_t* px = cur + interiorEnd * 3;
+        px[0] += vget_lane_u8( carry, 0 );
+        px[1] += vget_lane_u8( carry, 1 );
+        px[2] += vget_lane_u8( carry, 2 );
+    }
+    if ( end == width && width > 1 )
+    {
+        std::memcpy( cur + ( width - 1 ) * 3, border, 3 );
+    }
+}
+
+void grayFromRgbNeon( const uint8_t* rgb, uint8_t* gray, size_t width )
+{
+    size_t x = 0;
+    for ( ; x + 16 <= width; x += 16, rgb += 48 )
+    {
+        const uint8x16x3_t px = vld3q_u8( rgb );
+        const uint16x8_t lo = vaddw_u8( vaddl_u8( vget_low_u8( px.val[0] ),
+                                                  vget_low_u8( px.val[1] ) ),
+                                        vget_low_u8( px.val[2] ) );
+        const uint16x8_t hi = vaddw_u8( vaddl_u8( vget_high_u8( px.val[0] ),
+                                                  vget_high_u8( px.val[1] ) ),
+                                        vget_high_u8( px.val[2] ) );
+        // x / 3 == ( x * 43691 ) >> 17 for every 16 bit x
+        const uint16x4_t q0 = vshrn_n_u32( vmull_n_u16( vget_low_u16( lo ), 43691 ), 16 );
+        const uint16x4_t q1 = vshrn_n_u32( vmull_n_u16( vget_high_u16( lo ), 43691 ), 16 );
+        const uint16x4_t q2 = vshrn_n_u32( vmull_n_u16( vget_low_u16( hi ), 43691 ), 16 );
+        const uint16x4_t q3 = vshrn_n_u32( vmull_n_u16( vget_high_u16( hi ), 43691 ), 16 );
+        const uint16x8_t qlo = vshrq_n_u16( vcombine_u16( q0, q1 ), 1 );
+        const uint16x8_t qhi = vshrq_n_u16( vcombine_u16( q2, q3 ), 1 );
+        vst1q_u8( gray + x, vcombine_u8( vmovn_u16( qlo ), vmovn_u16( qhi ) ) );
+    }
+    grayFromRgbScalar( rgb, gray + x, width - x );
+}
+
+void rgbFromGrayNeon( const uint8_t* gray, uint8_t* rgb, size_t width )
+{
+    size_t x = 0;
+    for ( ; x + 16 <= width; x += 16, rgb += 48 )
+    {
+        const uint8x16_t g = vld1q_u8( gray + x );
+        uint8x16x3_t px;
+        px.val[0] = g;
+        px.val[1] = g;
+        px.val[2] = g;
+        vst3q_u8( rgb, px );
+    }
+    rgbFromGrayScalar( gray + x, rgb, width - x );
+}
+
+void resampleRowsNeon( const uint8_t* const* rows, const int16_t* weights,
+                       size_t taps, uint8_t* dst, size_t bytes )
+{
+    const int32x4_t half = vdupq_n_s32( 1 << ( kWeightBits - 1 ) );
+    size_t x = 0;
+    for ( ; x + 16 <= bytes; x += 16 )
+    {
+        int32x4_t acc0 = half;
+        int32x4_t acc1 = half;
+        int32x4_t acc2 = half;
+        int32x4_t acc3 = half;
+        for ( size_t t = 0; t < taps; ++t )
+        {
+            const uint8x16_t v = vld1q_u8( rows[t] + x );
+            const int16x8_t lo = vreinterpretq_s16_u16( vmovl_u8( vget_low_u8( v ) ) );
+            const int16x8_t hi = vreinterpretq_s16_u16( vmovl_u8( vget_high_u8( v ) ) );
+            acc0 = vmlal_n_s16( acc0, vget_low_s16( lo ), weights[t] );
+            acc1 = vmlal_n_s16( acc1, vget_high_s16( lo ), weights[t] );
+            acc2 = vmlal_n_s16( acc2, vget_low_s16( hi ), weights[t] );
+            acc3 = vmlal_n_s16( acc3, vget_high_s16( hi ), weights[t] );
+        }
+        const int16x8_t p01 = vcombine_s16( vqmovn_s32( vshrq_n_s32( acc0, kWeightBits ) ),
+                                            vqmovn_s32( vshrq_n_s32( acc1, kWeightBits ) ) );
+        const int16x8_t p23 = vcombine_s16( vqmovn_s32( vshrq_n_s32( acc2, kWeightBits ) ),
+                                            vqmovn_s32( vshrq_n_s32( acc3, kWeightBits ) ) );
+        vst1q_u8( dst + x, vcombine_u8( vqmovun_s16( p01 ), vqmovun_s16( p23 ) ) );
+    }
+    resampleBytesScalar( rows, weights, taps, dst, x, bytes );
+}
+
+#endif // MARENGO_NEON
+
+
+const Kernels scalarKernels = {
+    Isa::Scalar, "scalar",
+    grayFromRgbScalar, rgbFromGrayScalar, fsdColorRowScalar,
+    resampleRowsScalar
+};
+
+#ifdef MARENGO_X86
+const Kernels sse41Kernels = {
+    Isa::Sse41, "sse4.1",
+    grayFromRgbSse41, rgbFromGraySse41, fsdColorRowSse41,
+    resampleRowsSse41
+};
+// The byte shuffles gain nothing from 256 bit registers, so AVX2 only
+// takes over the palette search, the error diffusion and resampling.
+const Kernels avx2Kernels = {
+    Isa::Avx2, "avx2",
+    grayFromRgbSse41, rgbFromGraySse41, fsdColorRowAvx2,
+    resampleRowsAvx2
+};
+#endif
+
+#ifdef MARENGO_NEON
+const Kernels neonKernels = {
+    Isa::Neon, "neon",
+    grayFromRgbNeon, rgbFromGrayNeon, fsdColorRowNeon,
+    resampleRowsNeon
+};
+#endif
+
+Isa bestIsa()
+{
+    const char* env = std::getenv( "MARENGO_SIMD" );
+    if ( env != nullptr )
+    {
+        const std::string name( env );
+        for ( Isa isa : { Isa::Scalar, Isa::Sse41, Isa::Avx2, Isa::Neon } )
+        {
+            if ( isSupported( isa ) && name == kernelsFor( isa ).name )
+            {
+                return isa;
+            }
+        }
+    }
+    if ( isSupported( Isa::Avx2 ) )
+    {
+        return Isa::Avx2;
+    }
+    if ( isSupported( Isa::Sse41 ) )
+    {
+        return Isa::Sse41;
+    }
+    if ( isSupported( Isa::Neon ) )
+    {
+        return Isa::Neon;
+    }
+    return Isa::Scalar;
+}
+
+std::atomic<const Kernels*> current( nullptr );
+
+} // namespace
+
+bool isSupported( Isa isa )
+{
+    switch ( isa )
+    {
+    case Isa::Scalar:
+        return true;
+#ifdef MARENGO_X86
+    case Isa::Sse41:
+        return __builtin_cpu_supports( "sse4.1" );
+    case Isa::Avx2:
+        return __builtin_cpu_supports( "avx2" );
+#endif
+#ifdef MARENGO_NEON
+    case Isa::Neon:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const Kernels& kernelsFor( Isa isa )
+{
+    if ( ! isSupported( isa ) )
+    {
+        throw std::runtime_error( "SIMD kernels not supported on this CPU" );
+    }
+    switch ( isa )
+    {
+#ifdef MARENGO_X86
+    case Isa::Sse41:
+        return sse41Kernels;
+    case Isa::Avx2:
+        return avx2Kernels;
+#endif
+#ifdef MARENGO_NEON
+    case Isa::Neon:
+        return neonKernels;
+#endif
+    default:
+        return scalarKernels;
+    }
+}
+
+const Kernels& kernels()
+{
+    const Kernels* k = current.load( std::memory_order_acquire );
+    if ( k == nullptr )
+    {
+        static const Kernels& best = kernelsFor( bestIsa() );
+        // Lose quietly to a setIsa() which got in first
+        k = &best;
+        const Kernels* expected = nullptr;
+        if ( ! current.compare_exchange_strong( expected, k ) )
+        {
+            k = expected;
+        }
+    }
+    return *k;
+}
+
+void setIsa( Isa isa )
+{
+    current = &kernelsFor( isa );
+}
+
+} // namespace kernels
+} // namespace jpeg
+} // namespace marengo
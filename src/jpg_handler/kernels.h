@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Quantizer;
+
+        // The per-row inner loops of fsd(), fsdColor() and resample(), in a
+        // scalar version plus SIMD versions for whatever the CPU supports.
+        // The best one is picked at run time the first time kernels() is
+        // called. Every version gives byte for byte the same output as the
+        // scalar one, which is the reference.
+        namespace kernels
+        {
+
+            // Fixed point position of the resampling weights: 1.0 is
+            // 1 << kWeightBits
+            constexpr int kWeightBits = 14;
+
+            enum class Isa
+            {
+                Scalar,
+                Sse41,
+                Avx2,
+                Neon
+            };
+
+            struct Kernels
+            {
+                Isa isa;
+                const char* name;
+
+                // gray[x] = ( r + g + b ) / 3 for width RGB pixels
+                void ( *grayFromRgb )(
+                    const uint8_t* rgb, uint8_t* gray, size_t width );
+
+                // Copies each gray byte into R, G and B
+                void ( *rgbFromGray )(
+                    const uint8_t* gray, uint8_t* rgb, size_t width );
+
+                // Pixels [begin, end) of one row of fsdColor(): quantizes
+                // cur in place and pushes the error into cur (to the right)
+                // and next (below). Pass nullptr for next on the last row.
+                // The first and last pixels (and all of the last row) get
+                // palette entry 0. Spans of a row must be done left to
+                // right; 0, width does the lot.
+                // Rows must have Bitmap::kRowPadding bytes of slack, as the
+                // vector versions load/store whole registers. Within next,
+                // a span touches pixels begin - 1 up to end + 3.
+                void ( *fsdColorRow )( uint8_t* cur, uint8_t* next,
+                                       size_t width, size_t begin, size_t end,
+                                       const Quantizer& q );
+
+                // The vertical half of resampling: a weighted sum of taps
+                // rows, byte by byte,
+                //   dst[i] = sum( weights[t] * rows[t][i] ) >> kWeightBits
+                // rounded to nearest and clamped to 0-255.
+                void ( *resampleRows )( const uint8_t* const* rows,
+                                        const int16_t* weights, size_t taps,
+                                        uint8_t* dst, size_t bytes );
+            };
+
+            // The kernels in use. Chosen on first call: the best the CPU
+            // supports, unless the MARENGO_SIMD environment variable names
+            // another (scalar, sse4.1, avx2 or neon).
+            const Kernels& kernels();
+
+            // A specific set, e.g. to cross-check against the scalar one.
+            // Will throw if this build/CPU doesn't support it.
+            const Kernels& kernelsFor( Isa isa );
+
+            bool isSupported( Isa isa );
+
+            // Changes what kernels() returns. Not thread safe: call it
+            // before any dithering starts.
+            void setIsa( Isa isa );
+
+        } // namespace kernels
+    } // namespace jpeg
+} // namespace marengo
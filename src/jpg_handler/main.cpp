@@ -1,6 +1,26 @@
+#include "bands.h"
+#include "batch.h"
+#include "camera.h"
+#include "incremental.h"
+#include "indexed.h"
 #include "jpeg.h"
+#include "palette.h"
+#include "panel.h"
+#include "pipeline.h"
+#include "preview.h"
+#include "scanline.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 void display( uint8_t luma )
 {
@@ -12,48 +32,580 @@ void display( uint8_t luma )
     std::cout << ascii[val] << ascii[val];
 }
 
+// Writes to a temporary file and renames it into place, so anything
+// watching fileName never sees half a frame
+void saveAtomically( const std::string& fileName, const std::vector<uint8_t>& data )
+{
+    const std::string temp = fileName + ".tmp";
+    {
+        std::ofstream ofs( temp, std::ios::out | std::ios::binary );
+        ofs.write( reinterpret_cast<const char*>( data.data() ), data.size() );
+        if ( ! ofs )
+        {
+            throw std::runtime_error( "Could not write " + temp );
+        }
+    }
+    if ( std::rename( temp.c_str(), fileName.c_str() ) != 0 )
+    {
+        throw std::runtime_error( "Could not rename " + temp );
+    }
+}
+
+#ifdef MARENGO_TRACE
+// Writes out whatever the tracing build recorded, however main() returns
+struct TraceWriter
+{
+    std::string fileName;
+    ~TraceWriter()
+    {
+        if ( fileName.empty() )
+        {
+            return;
+        }
+        try
+        {
+            marengo::jpeg::trace::writeChromeTrace( fileName );
+        }
+        catch ( const std::exception& e )
+        {
+            std::cerr << e.what() << "\n";
+        }
+        marengo::jpeg::trace::writeStats( std::cerr );
+    }
+};
+#endif
+
+void printStats( const marengo::jpeg::PipelineStats& stats )
+{
+    const auto stage = []( const char* name, const marengo::jpeg::StageTiming& t,
+                           size_t frames )
+        {
+            std::cout << name << ": " << t.busyMs / frames << " ms/frame busy, "
+                      << t.waitMs / frames << " ms/frame waiting\n";
+        };
+    if ( stats.frames == 0 )
+    {
+        return;
+    }
+    std::cout << stats.frames << " frames, "
+              << stats.frames * 1000.0 / stats.totalMs << " fps\n";
+    stage( "decode", stats.decode, stats.frames );
+    stage( "dither", stats.dither, stats.frames );
+    stage( "encode", stats.encode, stats.frames );
+}
+
+void printStats( const marengo::jpeg::PreviewStats& stats )
+{
+    if ( stats.frames == 0 )
+    {
+        return;
+    }
+    std::cout << stats.frames << " frames, preview in "
+              << stats.previewMs / stats.frames << " ms; "
+              << stats.completed << " done at full size";
+    if ( stats.completed != 0 )
+    {
+        std::cout << " (" << stats.fullMs / stats.completed << " ms each)";
+    }
+    std::cout << ", " << stats.cancelled << " cancelled\n";
+}
+
+// Capture, dither, save, over and over (frames of them, or for ever if 0).
+// Everything that can be is set up once, before the first frame: the
+// camera's buffers, the libjpeg decoder and encoder, the palette tables,
+// the frame's pixels and the output buffer.
+// With pipeline, decode, dither and encode each get a thread of their own.
+// With previewWidth, each frame is first done that wide, to preview.jpg,
+// and then at full size in the background, unless the next frame comes
+// first. With panel, frames go straight to it rather than to result.jpg,
+// and with incremental only what changed is dithered and shown (or
+// saved) again (pixels within tolerance of the last frame's count as
+// unchanged).
+void runCamera( const std::string& device, size_t width, size_t height,
+                size_t frames, const marengo::jpeg::Palette& palette,
+                unsigned threads, const marengo::jpeg::LoadOptions& options,
+                bool pipeline, marengo::jpeg::EncodePreset preset,
+                size_t previewWidth, marengo::jpeg::PanelSink* panel,
+                bool incremental, unsigned tolerance )
+{
+    using namespace marengo::jpeg;
+    Camera camera( device, width, height );
+    if ( previewWidth != 0 )
+    {
+        PreviewRunner runner( palette, previewWidth,
+            []( const std::vector<uint8_t>& jpeg )
+            {
+                saveAtomically( "preview.jpg", jpeg );
+            },
+            []( const std::vector<uint8_t>& jpeg )
+            {
+                saveAtomically( "result.jpg", jpeg );
+            },
+            options, threads, 95, preset );
+        for ( size_t captured = 0; frames == 0 || captured < frames; ++captured )
+        {
+            camera.capture( [&runner]( const uint8_t* data, size_t size )
+                {
+                    runner.submit( data, size );
+                } );
+        }
+        runner.finish();
+        printStats( runner.getStats() );
+        return;
+    }
+    Decoder decoder;
+    size_t captured = 0;
+    // The camera's buffer goes back as soon as it is decoded
+    const auto capture = [&]( Image& frame )
+        {
+            if ( frames != 0 && captured == frames )
+            {
+                return false;
+            }
+            camera.capture( [&]( const uint8_t* data, size_t size )
+                {
+                    decoder.decode( data, size, frame, options );
+                } );
+            ++captured;
+            return true;
+        };
+    const auto save = []( const std::vector<uint8_t>& jpeg )
+        {
+            saveAtomically( "result.jpg", jpeg );
+        };
+
+    if ( pipeline )
+    {
+        printStats( runPipeline( capture, palette, threads, 95, save, 3, preset ) );
+        return;
+    }
+    Encoder encoder( preset );
+    Image frame;
+    std::vector<uint8_t> jpeg;
+    IncrementalDitherer ditherer( palette, tolerance );
+    // With incremental and no panel, the ditherer's output as an Image to
+    // encode, brought up to date a dirty rect at a time
+    Image dithered;
+    while ( capture( frame ) )
+    {
+        if ( incremental )
+        {
+            const std::vector<DirtyRect>& dirty = ditherer.dither( frame );
+            if ( panel != nullptr )
+            {
+                panel->show( ditherer.getOutput(), dirty );
+                continue;
+            }
+            if ( dirty.empty() )
+            {
+                // result.jpg already has it
+                continue;
+            }
+            const Bitmap& output = ditherer.getOutput();
+            if ( dithered.getWidth() != output.getWidth()
+                 || dithered.getHeight() != output.getHeight() )
+            {
+                dithered = Image( frame, Image::CopyMode::Deep );
+            }
+            for ( const DirtyRect& rect : dirty )
+            {
+                for ( size_t y = rect.y; y < rect.y + rect.height; ++y )
+                {
+                    std::memcpy( dithered.getRow( y ), output.getRow( y ),
+                                 output.getRowSize() );
+                }
+            }
+            encoder.encode( dithered, jpeg );
+            save( jpeg );
+            continue;
+        }
+        frame.fsdColor( palette, threads );
+        if ( panel != nullptr )
+        {
+            panel->show( frame );
+            continue;
+        }
+        encoder.encode( frame, jpeg );
+        save( jpeg );
+    }
+}
+
+void printUsage( const char* program )
+{
+    std::cout << "Usage: " << program
+              << " [--palette <file|rrggbb,rrggbb,...>] [--threads <n>]"
+              << " [--width <px>] [--dither <method>] [--serpentine] [--match <metric>]"
+              << " [--stream <out.jpg> [--budget <MB>]]"
+              << " [--mono] [--png] [--ascii] [--fb <device>] <jpeg file>\n"
+              << "       " << program
+              << " --camera <device> [--size <w>x<h>] [--frames <n>] [--pipeline | --preview <px> | [--fb <device>] [--incremental <tolerance>]]"
+              << " [--palette ...] [--threads <n>] [--width <px>] [--preset <name>]\n"
+              << "       " << program
+              << " --batch <dir|'glob'|list> [--out <dir>]"
+              << " [--palette ...] [--threads <n>] [--width <px>] [--preset <name>]\n";
+}
+
+// The number text is, as option's argument. Will throw
+// std::invalid_argument if text is anything else, or more than max:
+// stoul() alone would take "12px" as 12 and "-1" as the biggest number
+// there is, and a cast to something narrower would wrap.
+size_t parseNumber( const std::string& option, const std::string& text,
+                    size_t max = std::numeric_limits<size_t>::max() )
+{
+    size_t used = 0;
+    unsigned long value = 0;
+    if ( ! text.empty() && std::isdigit( static_cast<unsigned char>( text[0] ) ) )
+    {
+        try
+        {
+            value = std::stoul( text, &used );
+        }
+        catch ( const std::out_of_range& )
+        {
+            used = 0;
+        }
+    }
+    if ( used == 0 || used != text.size() )
+    {
+        throw std::invalid_argument( option + " needs a number, not \"" + text + "\"" );
+    }
+    if ( value > max )
+    {
+        throw std::invalid_argument(
+            option + " can be at most " + std::to_string( max ) + ", not " + text );
+    }
+    return value;
+}
+
 int main( int argc, char* argv[] )
 {
 
-    if ( argc < 2 )
+    std::string fileName;
+    std::string paletteSpec;
+    unsigned threads = 1;
+    std::string streamTo;
+    size_t width = 0;
+    bool mono = false;
+    bool png = false;
+    bool ascii = false;
+    std::string camera;
+    size_t captureWidth = 640;
+    size_t captureHeight = 480;
+    size_t frames = 0;
+    bool pipeline = false;
+    std::string batch;
+    std::string ditherName;
+    marengo::jpeg::Scan scan = marengo::jpeg::Scan::Raster;
+    std::string matchName;
+    std::string outDir = "dithered";
+    std::string traceFile;
+    size_t budget = 0;
+    std::string presetName;
+    size_t previewWidth = 0;
+    bool incremental = false;
+    unsigned tolerance = 0;
+    std::string framebuffer;
+    try
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string arg = argv[i];
+            if ( ( arg == "--palette" || arg == "-p" ) && i + 1 < argc )
+            {
+                // Either a palette file or a list like "000000,ffffff"
+                paletteSpec = argv[++i];
+            }
+            else if ( arg == "--stream" && i + 1 < argc )
+            {
+                // Dither straight from file to file, a row at a time
+                streamTo = argv[++i];
+            }
+            else if ( ( arg == "--width" || arg == "-w" ) && i + 1 < argc )
+            {
+                // Shrink to this width, mostly while decoding. With --stream,
+                // resampled (Lanczos3) a band of rows at a time.
+                width = parseNumber( arg, argv[++i] );
+            }
+            else if ( arg == "--dither" && i + 1 < argc )
+            {
+                // fs (the default), atkinson, jjn, stucki, sierra-lite,
+                // bayer or blue-noise
+                ditherName = argv[++i];
+            }
+            else if ( arg == "--match" && i + 1 < argc )
+            {
+                // How the nearest colour is picked: redmean (the default),
+                // cielab or oklab
+                matchName = argv[++i];
+            }
+            else if ( arg == "--serpentine" )
+            {
+                // Error diffusion goes back and forth, rather than always
+                // left to right
+                scan = marengo::jpeg::Scan::Serpentine;
+            }
+            else if ( arg == "--budget" && i + 1 < argc )
+            {
+                // With --stream --width: MB of rows to hold in memory, past
+                // which the rest go to a scratch file. No more than fits in
+                // a size_t as bytes.
+                budget = parseNumber( arg, argv[++i],
+                                      std::numeric_limits<size_t>::max() >> 20 );
+            }
+            else if ( arg == "--preset" && i + 1 < argc )
+            {
+                // How --camera and --batch encode: default, fast (the
+                // default for --camera) or archive
+                presetName = argv[++i];
+            }
+            else if ( arg == "--mono" )
+            {
+                // Black and white, saved as result.pbm
+                mono = true;
+            }
+            else if ( arg == "--png" )
+            {
+                // Palette indices, saved as result.png
+                png = true;
+            }
+            else if ( arg == "--ascii" )
+            {
+                // Print the result as ASCII art too (best with --width)
+                ascii = true;
+            }
+            else if ( arg == "--camera" && i + 1 < argc )
+            {
+                // Keep capturing from a V4L2 device, e.g. /dev/video0
+                camera = argv[++i];
+            }
+            else if ( arg == "--size" && i + 1 < argc )
+            {
+                // Capture size, e.g. 1280x720
+                const std::string size = argv[++i];
+                const size_t x = size.find( 'x' );
+                captureWidth = parseNumber( arg, size.substr( 0, x ) );
+                captureHeight = x == std::string::npos
+                    ? 0 : parseNumber( arg, size.substr( x + 1 ) );
+            }
+            else if ( arg == "--frames" && i + 1 < argc )
+            {
+                // Stop after this many frames; 0 (the default) never stops
+                frames = parseNumber( arg, argv[++i] );
+            }
+            else if ( arg == "--pipeline" )
+            {
+                // With --camera: decode, dither and encode on separate threads
+                pipeline = true;
+            }
+            else if ( arg == "--preview" && i + 1 < argc )
+            {
+                // With --camera: a quick preview this wide first, then the
+                // full size frame in the background
+                previewWidth = parseNumber( arg, argv[++i] );
+            }
+            else if ( arg == "--fb" && i + 1 < argc )
+            {
+                // Show the result on a framebuffer, e.g. /dev/fb0, rather
+                // than saving it
+                framebuffer = argv[++i];
+            }
+            else if ( arg == "--incremental" && i + 1 < argc )
+            {
+                // With --camera (but not --pipeline or --preview): only
+                // re-dither and save or show rows from the first one
+                // changed, treating channels within this of the last
+                // frame's as unchanged (0 for exact, up to 255)
+                incremental = true;
+                tolerance = static_cast<unsigned>( parseNumber( arg, argv[++i], 255 ) );
+            }
+            else if ( arg == "--batch" && i + 1 < argc )
+            {
+                // A directory, a quoted glob or a list of files to dither
+                batch = argv[++i];
+            }
+            else if ( arg == "--out" && i + 1 < argc )
+            {
+                // Where --batch saves to
+                outDir = argv[++i];
+            }
+            else if ( arg == "--trace" && i + 1 < argc )
+            {
+                // Chrome trace JSON to write, with the totals on stderr.
+                // Needs a tracing build (make trace).
+                traceFile = argv[++i];
+            }
+            else if ( ( arg == "--threads" || arg == "-t" ) && i + 1 < argc )
+            {
+                // 0 for one per core. With --batch, files at once; otherwise
+                // threads per image
+                threads = static_cast<unsigned>( parseNumber(
+                    arg, argv[++i], std::numeric_limits<unsigned>::max() ) );
+            }
+            else
+            {
+                fileName = arg;
+            }
+        }
+    }
+    catch ( const std::invalid_argument& e )
+    {
+        std::cout << e.what() << "\n";
+        printUsage( argv[0] );
+        return 1;
+    }
+    if ( incremental && ( camera.empty() || pipeline || previewWidth != 0 ) )
+    {
+        std::cout << "--incremental needs --camera, without --pipeline or --preview\n";
+        printUsage( argv[0] );
+        return 1;
+    }
+    if ( fileName.empty() && camera.empty() && batch.empty() )
     {
         std::cout << "No jpeg file specified\n";
+        printUsage( argv[0] );
         return 1;
     }
+#ifdef MARENGO_TRACE
+    TraceWriter traceWriter{ traceFile };
+#else
+    if ( ! traceFile.empty() )
+    {
+        std::cerr << "--trace needs a tracing build (make trace)\n";
+    }
+#endif
     try
     {
         using namespace marengo::jpeg;
+        const Match match = matchName.empty() ? Match::Redmean
+                                              : matchFromName( matchName );
+        // Build the palette (and its lookup tables) once, up front
+        std::unique_ptr<Palette> palette;
+        if ( ! paletteSpec.empty() )
+        {
+            palette.reset( new Palette( Palette::fromArgument( paletteSpec ) ) );
+        }
+
+        std::unique_ptr<PanelSink> panel;
+        if ( ! framebuffer.empty() )
+        {
+            panel = PanelSink::openFramebuffer(
+                framebuffer, palette ? *palette : Palette::defaultPalette() );
+        }
+
+        if ( ! camera.empty() )
+        {
+            LoadOptions options;
+            options.targetWidth = width;
+            runCamera( camera, captureWidth, captureHeight, frames,
+                       palette ? *palette : Palette::defaultPalette(),
+                       threads, options, pipeline,
+                       presetName.empty() ? EncodePreset::Fast
+                                          : encodePresetFromName( presetName ),
+                       previewWidth, panel.get(), incremental, tolerance );
+            return 0;
+        }
+
+        if ( ! batch.empty() )
+        {
+            LoadOptions options;
+            options.targetWidth = width;
+            const BatchStats stats = runBatch(
+                listJpegs( batch ), outDir,
+                palette ? *palette : Palette::defaultPalette(), options, threads, 95,
+                presetName.empty() ? EncodePreset::Default
+                                   : encodePresetFromName( presetName ) );
+            std::cout << stats.images << " images (" << stats.failed << " failed) in "
+                      << stats.seconds << " s: "
+                      << stats.images / stats.seconds << " images/s, "
+                      << stats.megapixels / stats.seconds << " MP/s\n";
+            return stats.failed == 0 ? 0 : 1;
+        }
+
+        if ( ! streamTo.empty() )
+        {
+            const Palette& colours = palette ? *palette : Palette::defaultPalette();
+            const Dither method = ditherName.empty() ? Dither::FloydSteinberg
+                                                     : ditherFromName( ditherName );
+            if ( width != 0 )
+            {
+                BandOptions options;
+                if ( budget != 0 )
+                {
+                    options.memoryBudget = budget << 20;
+                }
+                DecodeSource decode( fileName );
+                const size_t height = std::max<size_t>(
+                    1, decode.getHeight() * width / decode.getWidth() );
+                ResampleSource resample( decode, width, height,
+                                         ResampleFilter::Lanczos3, options );
+                DitherSource dither( resample, colours, method, scan, match );
+                writeJpeg( dither, streamTo );
+            }
+            else if ( ditherName.empty() && scan == Scan::Raster && match == Match::Redmean )
+            {
+                fsdColorStream( fileName, streamTo, colours );
+            }
+            else
+            {
+                ditherStream( fileName, streamTo, colours, method, scan, match );
+            }
+            return 0;
+        }
+
         // Constructor expects a filename to load:
-        Image imgOriginal( argv[1] );
+        LoadOptions options;
+        options.targetWidth = width;
+        Image imgOriginal( fileName, options );
 
         // Copy construct a second version so we can
         // shrink non-destructively. Not really necessary
         // here, but just to show it can be done :)
-        Image img = imgOriginal;
+        // OnWrite shares the pixels until one of them changes them.
+        Image img( imgOriginal, Image::CopyMode::OnWrite );
 
         // Shrink proportionally to a specific width (in px)
         //img.shrink( 160 );
-        img.fsdColor(  );
+        if ( mono )
+        {
+            img.fsdMono();
+            img.savePbm( "result.pbm" );
+            return 0;
+        }
+        const Palette& colours = palette ? *palette : Palette::defaultPalette();
+        const Dither method = ditherName.empty() ? Dither::FloydSteinberg
+                                                 : ditherFromName( ditherName );
+        img.dither( colours, method, threads, scan, match );
+        if ( png )
+        {
+            IndexedImage::fromImage( img, colours ).savePng( "result.png" );
+            return 0;
+        }
+        if ( panel )
+        {
+            panel->show( img );
+            return 0;
+        }
 
         // Display the image in ASCII, just for fun.
-       /* std::size_t height = img.getHeight();
-        std::size_t width  = img.getWidth();
-        for ( std::size_t y = 0; y < height; ++y )
+        if ( ascii )
         {
-            for ( std::size_t x = 0; x < width; ++x )
+            for ( std::size_t y = 0; y < img.getHeight(); ++y )
             {
-                uint8_t luma = img.getLuminance( x, y );
-                display( luma );
+                for ( std::size_t x = 0; x < img.getWidth(); ++x )
+                {
+                    uint8_t luma = img.luminanceAt( x, y );
+                    display( luma );
+                }
+                std::cout << "\n";
             }
-            std::cout << "\n";
-        }
 
-        std::cout << "\nImage height: " << img.getHeight();
-        std::cout << "\nImage width : " << img.getWidth();
-        // Pixel "Size" is 3 bytes for colour images (i.e. R,G, & B)
-        // and 1 byte for monochrome.
-        std::cout << "\nImage px sz : " << img.getPixelSize();
-        std::cout << std::endl;*/
+            std::cout << "\nImage height: " << img.getHeight();
+            std::cout << "\nImage width : " << img.getWidth();
+            // Pixel "Size" is 3 bytes for colour images (i.e. R,G, & B)
+            // and 1 byte for monochrome.
+            std::cout << "\nImage px sz : " << img.getPixelSize();
+            std::cout << std::endl;
+        }
 
 
        // img.save("result.jpg",atoi(argv[2]));
@@ -0,0 +1,397 @@
+#include "palette.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+constexpr size_t Palette::kMaxColours;
+constexpr size_t Palette::kKdTreeThreshold;
+
+namespace
+{
+
+const uint8_t defaultColours[] = {
+    0X38, 0X48, 0X8d, // blue
+    0X54, 0X7a, 0X49, // green
+    0X9f, 0X4b, 0X4e, // red
+    0X24, 0X29, 0X33, // black
+    0Xc9, 0Xd1, 0X68, // yellow
+    0Xb5, 0X5d, 0X4c, // orange
+    0Xd3, 0Xdd, 0Xe4  // white
+};
+
+// Parses "#rrggbb", "0xrrggbb" or "rrggbb". Returns false if tok isn't one
+bool parseHex( const std::string& tok, std::vector<uint8_t>& out )
+{
+    size_t pos = 0;
+    if ( tok.size() > 0 && tok[0] == '#' )
+    {
+        pos = 1;
+    }
+    else if ( tok.size() > 1 && tok[0] == '0' && ( tok[1] == 'x' || tok[1] == 'X' ) )
+    {
+        pos = 2;
+    }
+    if ( tok.size() - pos != 6 )
+    {
+        return false;
+    }
+    for ( size_t i = pos; i < tok.size(); ++i )
+    {
+        if ( ! std::isxdigit( static_cast<unsigned char>( tok[i] ) ) )
+        {
+            return false;
+        }
+    }
+    const unsigned long v = std::stoul( tok.substr( pos ), nullptr, 16 );
+    out.push_back( ( v >> 16 ) & 0xFF );
+    out.push_back( ( v >> 8 ) & 0xFF );
+    out.push_back( v & 0xFF );
+    return true;
+}
+
+// Parses three decimal components at the start of line (e.g. GIMP palettes)
+bool parseDecimal( const std::string& line, std::vector<uint8_t>& out )
+{
+    std::istringstream iss( line );
+    int r, g, b;
+    if ( ! ( iss >> r >> g >> b ) )
+    {
+        return false;
+    }
+    if ( r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255 )
+    {
+        return false;
+    }
+    out.push_back( r );
+    out.push_back( g );
+    out.push_back( b );
+    return true;
+}
+
+Palette makePalette( const std::vector<uint8_t>& colours )
+{
+    return Palette( colours.data(), colours.size() / 3 );
+}
+
+float labF( float t )
+{
+    const float delta = 6.0f / 29.0f;
+    if ( t > delta * delta * delta )
+    {
+        return std::cbrt( t );
+    }
+    return t / ( 3.0f * delta * delta ) + 4.0f / 29.0f;
+}
+
+float srgbToLinear( uint8_t v )
+{
+    const float c = v / 255.0f;
+    if ( c <= 0.04045f )
+    {
+        return c / 12.92f;
+    }
+    return std::pow( ( c + 0.055f ) / 1.055f, 2.4f );
+}
+
+// srgbToLinear() for every byte, so converting a colour costs three table
+// reads rather than three pow()s
+const float* linearTable()
+{
+    static const std::array<float, 256> table = []()
+        {
+            std::array<float, 256> t;
+            for ( int v = 0; v < 256; ++v )
+            {
+                t[v] = srgbToLinear( static_cast<uint8_t>( v ) );
+            }
+            return t;
+        }();
+    return table.data();
+}
+
+float labDistance( const float* p, const float* q )
+{
+    const float dL = p[0] - q[0];
+    const float da = p[1] - q[1];
+    const float db = p[2] - q[2];
+    return dL * dL + da * da + db * db;
+}
+
+} // namespace
+
+Palette::Palette( const uint8_t* colours, size_t count )
+    : m_count( count )
+    , m_quantizer( colours, count ) // also validates count
+    , m_caches( std::make_shared<Caches>() )
+{
+    std::copy( colours, colours + count * 3, m_colours.begin() );
+    for ( size_t i = 0; i < m_count; ++i )
+    {
+        const uint8_t* c = getColour( i );
+        rgbToLab( c[0], c[1], c[2], &m_lab[ i * 3 ] );
+        rgbToOkLab( c[0], c[1], c[2], &m_okLab[ i * 3 ] );
+    }
+    if ( m_count > kKdTreeThreshold )
+    {
+        for ( KdTree* tree : { &m_labTree, &m_okLabTree } )
+        {
+            tree->resize( m_count );
+            for ( size_t i = 0; i < m_count; ++i )
+            {
+                ( *tree )[i].entry = static_cast<uint8_t>( i );
+            }
+        }
+        buildKdTree( m_labTree, m_lab.data(), 0, m_count );
+        buildKdTree( m_okLabTree, m_okLab.data(), 0, m_count );
+    }
+}
+
+Match matchFromName( const std::string& name )
+{
+    if ( name == "redmean" )
+    {
+        return Match::Redmean;
+    }
+    if ( name == "cielab" || name == "lab" )
+    {
+        return Match::CieLab;
+    }
+    if ( name == "oklab" )
+    {
+        return Match::OkLab;
+    }
+    throw std::runtime_error( "Unknown colour match: " + name );
+}
+
+const Palette& Palette::defaultPalette()
+{
+    static const Palette palette(
+        defaultColours, sizeof( defaultColours ) / 3 );
+    return palette;
+}
+
+Palette Palette::fromFile( const std::string& fileName )
+{
+    std::ifstream ifs( fileName );
+    if ( ! ifs )
+    {
+        throw std::runtime_error( "Could not open " + fileName );
+    }
+    std::vector<uint8_t> colours;
+    std::string line;
+    size_t lineNo = 0;
+    while ( std::getline( ifs, line ) )
+    {
+        ++lineNo;
+        std::istringstream iss( line );
+        std::string first;
+        if ( ! ( iss >> first ) )
+        {
+            continue; // blank
+        }
+        if ( parseHex( first, colours ) || parseDecimal( line, colours ) )
+        {
+            continue;
+        }
+        // GIMP palette header lines
+        if ( first[0] == '#' || first[0] == ';' || first == "GIMP"
+             || first == "Name:" || first == "Columns:" )
+        {
+            continue;
+        }
+        throw std::runtime_error(
+            fileName + ":" + std::to_string( lineNo )
+            + ": not a colour: " + line
+            );
+    }
+    return makePalette( colours );
+}
+
+Palette Palette::fromString( const std::string& list )
+{
+    std::string spaced( list );
+    std::replace( spaced.begin(), spaced.end(), ',', ' ' );
+    std::istringstream iss( spaced );
+    std::vector<uint8_t> colours;
+    std::string tok;
+    while ( iss >> tok )
+    {
+        if ( ! parseHex( tok, colours ) )
+        {
+            throw std::runtime_error( "Not a hex colour: " + tok );
+        }
+    }
+    return makePalette( colours );
+}
+
+Palette Palette::fromArgument( const std::string& spec )
+{
+    if ( std::ifstream( spec ) )
+    {
+        return fromFile( spec );
+    }
+    return fromString( spec );
+}
+
+size_t Palette::nearestLab( float L, float a, float b ) const
+{
+    const float lab[3] = { L, a, b };
+    return nearestIn( m_labTree, m_lab.data(), lab );
+}
+
+size_t Palette::nearestOkLab( float L, float a, float b ) const
+{
+    const float lab[3] = { L, a, b };
+    return nearestIn( m_okLabTree, m_okLab.data(), lab );
+}
+
+size_t Palette::nearestToLab( uint8_t r, uint8_t g, uint8_t b ) const
+{
+    float lab[3];
+    rgbToLab( r, g, b, lab );
+    return nearestIn( m_labTree, m_lab.data(), lab );
+}
+
+size_t Palette::nearestToOkLab( uint8_t r, uint8_t g, uint8_t b ) const
+{
+    float lab[3];
+    rgbToOkLab( r, g, b, lab );
+    return nearestIn( m_okLabTree, m_okLab.data(), lab );
+}
+
+size_t Palette::nearestIn( const KdTree& tree, const float* coords,
+                           const float* point ) const
+{
+    size_t best = 0;
+    float bestDistance = std::numeric_limits<float>::max();
+    if ( tree.empty() )
+    {
+        for ( size_t i = 0; i < m_count; ++i )
+        {
+            const float d = labDistance( point, coords + i * 3 );
+            if ( d < bestDistance )
+            {
+                bestDistance = d;
+                best = i;
+            }
+        }
+        return best;
+    }
+    best = m_count;
+    searchKdTree( tree, coords, 0, m_count, point, best, bestDistance );
+    return best;
+}
+
+void Palette::rgbToLab( uint8_t r, uint8_t g, uint8_t b, float* lab )
+{
+    const float* linear = linearTable();
+    const float lr = linear[r];
+    const float lg = linear[g];
+    const float lb = linear[b];
+    // linear sRGB to XYZ, normalised to the D65 white point
+    const float x = ( 0.4124564f * lr + 0.3575761f * lg + 0.1804375f * lb ) / 0.95047f;
+    const float y = ( 0.2126729f * lr + 0.7151522f * lg + 0.0721750f * lb );
+    const float z = ( 0.0193339f * lr + 0.1191920f * lg + 0.9503041f * lb ) / 1.08883f;
+    const float fx = labF( x );
+    const float fy = labF( y );
+    const float fz = labF( z );
+    lab[0] = 116.0f * fy - 16.0f;
+    lab[1] = 500.0f * ( fx - fy );
+    lab[2] = 200.0f * ( fy - fz );
+}
+
+void Palette::rgbToOkLab( uint8_t r, uint8_t g, uint8_t b, float* lab )
+{
+    const float* linear = linearTable();
+    const float lr = linear[r];
+    const float lg = linear[g];
+    const float lb = linear[b];
+    // Björn Ottosson's matrices: linear sRGB to cone responses, cube root,
+    // then to L, a, b
+    const float l = std::cbrt( 0.4122214708f * lr + 0.5363325363f * lg + 0.0514459929f * lb );
+    const float m = std::cbrt( 0.2119034982f * lr + 0.6806995451f * lg + 0.1073969566f * lb );
+    const float s = std::cbrt( 0.0883024619f * lr + 0.2817188376f * lg + 0.6299787005f * lb );
+    lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+void Palette::buildKdTree( KdTree& tree, const float* coords,
+                           size_t lo, size_t hi )
+{
+    if ( hi <= lo )
+    {
+        return;
+    }
+    // split on whichever axis has the widest spread in this range
+    uint8_t axis = 0;
+    float widest = -1.0f;
+    for ( uint8_t a = 0; a < 3; ++a )
+    {
+        float mn = std::numeric_limits<float>::max();
+        float mx = std::numeric_limits<float>::lowest();
+        for ( size_t i = lo; i < hi; ++i )
+        {
+            const float v = coords[ tree[i].entry * 3 + a ];
+            mn = std::min( mn, v );
+            mx = std::max( mx, v );
+        }
+        if ( mx - mn > widest )
+        {
+            widest = mx - mn;
+            axis = a;
+        }
+    }
+    const size_t mid = lo + ( hi - lo ) / 2;
+    std::nth_element(
+        tree.begin() + lo, tree.begin() + mid, tree.begin() + hi,
+        [coords, axis]( const KdNode& l, const KdNode& r )
+        {
+            return coords[ l.entry * 3 + axis ] < coords[ r.entry * 3 + axis ];
+        } );
+    tree[mid].axis = axis;
+    tree[mid].split = coords[ tree[mid].entry * 3 + axis ];
+    buildKdTree( tree, coords, lo, mid );
+    buildKdTree( tree, coords, mid + 1, hi );
+}
+
+void Palette::searchKdTree( const KdTree& tree, const float* coords,
+                            size_t lo, size_t hi, const float* lab,
+                            size_t& best, float& bestDistance ) const
+{
+    if ( hi <= lo )
+    {
+        return;
+    }
+    const size_t mid = lo + ( hi - lo ) / 2;
+    const KdNode& node = tree[mid];
+    const float d = labDistance( lab, coords + node.entry * 3 );
+    if ( d < bestDistance || ( d == bestDistance && node.entry < best ) )
+    {
+        bestDistance = d;
+        best = node.entry;
+    }
+    const float diff = lab[ node.axis ] - node.split;
+    const bool leftFirst = diff < 0.0f;
+    searchKdTree( tree, coords, leftFirst ? lo : mid + 1, leftFirst ? mid : hi,
+                  lab, best, bestDistance );
+    // <= rather than < so an equally near, lower index entry isn't missed
+    if ( diff * diff <= bestDistance )
+    {
+        searchKdTree( tree, coords, leftFirst ? mid + 1 : lo, leftFirst ? hi : mid,
+                      lab, best, bestDistance );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
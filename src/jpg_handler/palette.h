@@ -0,0 +1,175 @@
+#pragma once
+
+#include "colourcache.h"
+#include "quantizer.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // How "nearest" palette colour is measured.
+        // Redmean is a weighted RGB distance, fast (see Quantizer) and what
+        // fsdColor() has always used. CieLab and OkLab are distances in
+        // those perceptual spaces: better at keeping hue and lightness
+        // apart, especially with big or uneven palettes, and OkLab is the
+        // more even of the two for blues and saturated colours.
+        enum class Match
+        {
+            Redmean,
+            CieLab,
+            OkLab
+        };
+
+        // "redmean", "cielab" (or "lab") or "oklab". Will throw on
+        // anything else.
+        Match matchFromName( const std::string& name );
+
+        // A set of up to kMaxColours RGB colours to dither to.
+        //
+        // Colours live in one flat array, and everything we derive from
+        // them (the Quantizer lookup table, CIELAB and OKLab coordinates
+        // and, for bigger palettes, k-d trees over those) is worked out
+        // once when the palette is built. So build it once and hand it to
+        // as many images as you like.
+        class Palette
+        {
+        public:
+            static constexpr size_t kMaxColours = Quantizer::kMaxColours;
+            // Palettes larger than this search Lab space with the k-d tree
+            static constexpr size_t kKdTreeThreshold = 16;
+
+            // colours holds count RGB triplets, back to back.
+            // Will throw if count is zero or larger than kMaxColours.
+            Palette( const uint8_t* colours, size_t count );
+
+            // The 7 colour palette fsdColor() has always used
+            static const Palette& defaultPalette();
+
+            // Reads a palette file. Each line is one colour, either as hex
+            // ("#38488d", "0x38488d" or "38488d") or as three decimal
+            // numbers ("56 72 141"), optionally followed by a name. This
+            // means GIMP .gpl files load as-is. Blank lines and lines
+            // starting with '#' or ';' which aren't colours are skipped.
+            // Will throw if the file cannot be read or a line can't be parsed.
+            static Palette fromFile( const std::string& fileName );
+
+            // Parses a comma (or space) separated list of hex colours,
+            // e.g. "000000,ffffff,ff0000"
+            static Palette fromString( const std::string& colours );
+
+            // For command line use: loads spec as a file if there is one
+            // by that name, otherwise parses it as a list of colours.
+            static Palette fromArgument( const std::string& spec );
+
+            size_t size() const { return m_count; }
+
+            // Pointer to the 3 bytes (R, G, B) of entry idx
+            const uint8_t* getColour( size_t idx ) const
+            {
+                return &m_colours[ idx * 3 ];
+            }
+
+            // Pointer to the 3 floats (L*, a*, b*) of entry idx
+            const float* getLab( size_t idx ) const
+            {
+                return &m_lab[ idx * 3 ];
+            }
+
+            // Pointer to the 3 floats (L, a, b) of entry idx in OKLab
+            const float* getOkLab( size_t idx ) const
+            {
+                return &m_okLab[ idx * 3 ];
+            }
+
+            const Quantizer& getQuantizer() const { return m_quantizer; }
+
+            // Nearest entry by the redmean distance fsdColor() uses
+            size_t nearest( uint8_t r, uint8_t g, uint8_t b ) const
+            {
+                return m_quantizer.nearest( r, g, b );
+            }
+
+            // Nearest entry by match. The perceptual ones convert the
+            // colour (through a lookup table to linear light) and search,
+            // then remember the answer in a ColourCache shared by all the
+            // threads using this palette, and by its copies. So a colour
+            // seen before, e.g. in the last camera frame, costs a table
+            // read, not far off Redmean.
+            size_t nearest( uint8_t r, uint8_t g, uint8_t b, Match match ) const
+            {
+                if ( match == Match::Redmean )
+                {
+                    return m_quantizer.nearest( r, g, b );
+                }
+                const ColourCache& cache =
+                    match == Match::CieLab ? m_caches->cieLab : m_caches->okLab;
+                size_t idx;
+                if ( cache.find( r, g, b, idx ) )
+                {
+                    return idx;
+                }
+                idx = match == Match::CieLab ? nearestToLab( r, g, b )
+                                             : nearestToOkLab( r, g, b );
+                cache.store( r, g, b, idx );
+                return idx;
+            }
+
+            // Nearest entry by plain Euclidean distance in CIELAB (i.e.
+            // CIE76 delta-E). Lowest index wins a tie.
+            size_t nearestLab( float L, float a, float b ) const;
+
+            // The same in OKLab
+            size_t nearestOkLab( float L, float a, float b ) const;
+
+            // sRGB (D65) to CIELAB
+            static void rgbToLab( uint8_t r, uint8_t g, uint8_t b, float* lab );
+
+            // sRGB to OKLab
+            static void rgbToOkLab( uint8_t r, uint8_t g, uint8_t b, float* lab );
+
+        private:
+            struct KdNode
+            {
+                float split;
+                uint8_t axis;
+                uint8_t entry;
+            };
+            // Implicit tree: each [lo, hi) range has its node at the middle
+            using KdTree = std::vector<KdNode>;
+
+            struct Caches
+            {
+                ColourCache cieLab;
+                ColourCache okLab;
+            };
+
+            size_t nearestToLab( uint8_t r, uint8_t g, uint8_t b ) const;
+            size_t nearestToOkLab( uint8_t r, uint8_t g, uint8_t b ) const;
+            size_t nearestIn( const KdTree& tree, const float* coords,
+                              const float* point ) const;
+            void buildKdTree( KdTree& tree, const float* coords,
+                              size_t lo, size_t hi );
+            void searchKdTree( const KdTree& tree, const float* coords,
+                               size_t lo, size_t hi, const float* point,
+                               size_t& best, float& bestDistance ) const;
+
+            std::array<uint8_t, kMaxColours * 3> m_colours;
+            std::array<float, kMaxColours * 3> m_lab;
+            std::array<float, kMaxColours * 3> m_okLab;
+            size_t m_count;
+            Quantizer m_quantizer;
+            KdTree m_labTree;
+            KdTree m_okLabTree;
+            std::shared_ptr<Caches> m_caches;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,418 @@
+#include "panel.h"
+#include "bands.h"
+#include "jpeg.h"
+#include "palette.h"
+#include "quantizer.h"
+#include "trace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+bool isIndexed( PanelFormat format )
+{
+    return bitsPerPixel( format ) <= 8;
+}
+
+// The PanelFormat of a framebuffer, going by what the driver says
+PanelFormat framebufferFormat( const ::fb_var_screeninfo& var,
+                               const ::fb_fix_screeninfo& fix )
+{
+    switch ( fix.visual )
+    {
+    case FB_VISUAL_TRUECOLOR:
+    case FB_VISUAL_DIRECTCOLOR:
+        if ( var.bits_per_pixel == 16 && var.red.offset == 11
+             && var.green.offset == 5 && var.blue.offset == 0 )
+        {
+            return PanelFormat::Rgb565;
+        }
+        if ( ( var.bits_per_pixel == 24 || var.bits_per_pixel == 32 )
+             && var.red.offset == 16 && var.green.offset == 8 && var.blue.offset == 0 )
+        {
+            return var.bits_per_pixel == 24 ? PanelFormat::Rgb888
+                                            : PanelFormat::Xrgb8888;
+        }
+        break;
+    case FB_VISUAL_MONO01:
+    case FB_VISUAL_MONO10:
+        if ( var.bits_per_pixel == 1 )
+        {
+            return PanelFormat::Indexed1;
+        }
+        break;
+    case FB_VISUAL_PSEUDOCOLOR:
+    case FB_VISUAL_STATIC_PSEUDOCOLOR:
+        switch ( var.bits_per_pixel )
+        {
+        case 1: return PanelFormat::Indexed1;
+        case 2: return PanelFormat::Indexed2;
+        case 4: return PanelFormat::Indexed4;
+        case 8: return PanelFormat::Indexed8;
+        default: break;
+        }
+        break;
+    default:
+        break;
+    }
+    throw std::runtime_error(
+        "Unsupported framebuffer format: visual " + std::to_string( fix.visual )
+        + ", " + std::to_string( var.bits_per_pixel )
+        + " bits per pixel, red at bit " + std::to_string( var.red.offset ) );
+}
+
+// So index i shows as palette colour i. Will throw if the driver won't.
+void loadColourMap( int fd, const Palette& palette, const std::string& device )
+{
+    std::vector<uint16_t> red( palette.size() );
+    std::vector<uint16_t> green( palette.size() );
+    std::vector<uint16_t> blue( palette.size() );
+    for ( size_t i = 0; i < palette.size(); ++i )
+    {
+        const uint8_t* c = palette.getColour( i );
+        // 8 bits to 16, so 0xFF is 0xFFFF
+        red[i] = c[0] * 0x101;
+        green[i] = c[1] * 0x101;
+        blue[i] = c[2] * 0x101;
+    }
+    ::fb_cmap cmap = {};
+    cmap.start = 0;
+    cmap.len = static_cast<uint32_t>( palette.size() );
+    cmap.red = red.data();
+    cmap.green = green.data();
+    cmap.blue = blue.data();
+    if ( ::ioctl( fd, FBIOPUTCMAP, &cmap ) != 0 )
+    {
+        throw std::runtime_error(
+            "Could not load the palette into " + device + "'s colour map: "
+            + std::strerror( errno ) );
+    }
+}
+
+// What to write for each palette entry on a fixed colour map: the index of
+// the map entry with that colour. Will throw if a colour isn't in the map.
+std::vector<uint8_t> staticColourValues( int fd, unsigned bits, const Palette& palette,
+                                         const std::string& device )
+{
+    const size_t entries = size_t( 1 ) << bits;
+    std::vector<uint16_t> red( entries );
+    std::vector<uint16_t> green( entries );
+    std::vector<uint16_t> blue( entries );
+    ::fb_cmap cmap = {};
+    cmap.start = 0;
+    cmap.len = static_cast<uint32_t>( entries );
+    cmap.red = red.data();
+    cmap.green = green.data();
+    cmap.blue = blue.data();
+    if ( ::ioctl( fd, FBIOGETCMAP, &cmap ) != 0 )
+    {
+        throw std::runtime_error(
+            "Could not read " + device + "'s colour map: " + std::strerror( errno ) );
+    }
+    std::vector<uint8_t> values( palette.size() );
+    for ( size_t i = 0; i < palette.size(); ++i )
+    {
+        const uint8_t* c = palette.getColour( i );
+        size_t entry = 0;
+        // The top 8 bits of each 16, as loadColourMap() widens them
+        while ( entry < cmap.len
+                && ( red[entry] >> 8 != c[0] || green[entry] >> 8 != c[1]
+                     || blue[entry] >> 8 != c[2] ) )
+        {
+            ++entry;
+        }
+        if ( entry == cmap.len )
+        {
+            throw std::runtime_error(
+                "Palette colour " + std::to_string( i ) + " isn't in " + device
+                + "'s fixed colour map" );
+        }
+        values[i] = static_cast<uint8_t>( entry );
+    }
+    return values;
+}
+
+// What to write for each entry of a palette of at most 2 on a mono panel:
+// the darker one is black, which is a 1 bit where oneIsBlack
+std::vector<uint8_t> monoValues( const Palette& palette, bool oneIsBlack,
+                                 const std::string& device )
+{
+    if ( palette.size() > 2 )
+    {
+        throw std::runtime_error(
+            device + " is black and white, so needs a 2 colour palette" );
+    }
+    const auto brightness = [&palette]( size_t idx )
+        {
+            if ( idx >= palette.size() )
+            {
+                return 0;
+            }
+            const uint8_t* c = palette.getColour( idx );
+            return c[0] + c[1] + c[2];
+        };
+    const uint8_t black = brightness( 0 ) <= brightness( 1 ) ? 0 : 1;
+    const uint8_t blackBit = oneIsBlack ? 1 : 0;
+    std::vector<uint8_t> values( palette.size() );
+    for ( size_t i = 0; i < palette.size(); ++i )
+    {
+        values[i] = i == black ? blackBit : 1 - blackBit;
+    }
+    return values;
+}
+
+} // namespace
+
+unsigned bitsPerPixel( PanelFormat format )
+{
+    switch ( format )
+    {
+    case PanelFormat::Rgb565: return 16;
+    case PanelFormat::Rgb888: return 24;
+    case PanelFormat::Xrgb8888: return 32;
+    case PanelFormat::Indexed1: return 1;
+    case PanelFormat::Indexed2: return 2;
+    case PanelFormat::Indexed4: return 4;
+    case PanelFormat::Indexed8: return 8;
+    }
+    return 0;
+}
+
+PanelSink::PanelSink( uint8_t* buffer, size_t width, size_t height,
+                      size_t stride, PanelFormat format, const Palette& palette )
+    : m_buffer( buffer )
+    , m_width( width )
+    , m_height( height )
+    , m_stride( stride )
+    , m_format( format )
+    , m_palette( palette )
+{
+    const unsigned bits = bitsPerPixel( format );
+    if ( ( width * bits + 7 ) / 8 > stride )
+    {
+        throw std::invalid_argument( "Panel rows don't fit in their stride" );
+    }
+    if ( isIndexed( format ) && palette.size() > ( 1u << bits ) )
+    {
+        throw std::invalid_argument(
+            "Palette too big for " + std::to_string( bits ) + " bits per pixel" );
+    }
+    if ( isIndexed( format ) )
+    {
+        m_values.resize( palette.size() );
+        std::iota( m_values.begin(), m_values.end(), 0 );
+    }
+}
+
+PanelSink::~PanelSink()
+{
+    if ( m_mapped != nullptr )
+    {
+        ::munmap( m_mapped, m_mappedSize );
+    }
+}
+
+std::unique_ptr<PanelSink> PanelSink::openFramebuffer( const std::string& device,
+                                                       const Palette& palette )
+{
+    const int fd = ::open( device.c_str(), O_RDWR );
+    if ( fd < 0 )
+    {
+        throw std::runtime_error(
+            "Could not open " + device + ": " + std::strerror( errno ) );
+    }
+    // Closed whatever happens; the mapping keeps the device open
+    struct Closer
+    {
+        int fd;
+        ~Closer() { ::close( fd ); }
+    } closer{ fd };
+
+    ::fb_var_screeninfo var;
+    ::fb_fix_screeninfo fix;
+    if ( ::ioctl( fd, FBIOGET_VSCREENINFO, &var ) != 0
+         || ::ioctl( fd, FBIOGET_FSCREENINFO, &fix ) != 0 )
+    {
+        throw std::runtime_error( device + " is not a framebuffer" );
+    }
+    const PanelFormat format = framebufferFormat( var, fix );
+
+    void* mapped = ::mmap( nullptr, fix.smem_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0 );
+    if ( mapped == MAP_FAILED )
+    {
+        throw std::runtime_error(
+            "Could not map " + device + ": " + std::strerror( errno ) );
+    }
+    // The visible screen, wherever panning has it
+    uint8_t* screen = static_cast<uint8_t*>( mapped )
+        + var.yoffset * fix.line_length + var.xoffset * var.bits_per_pixel / 8;
+    std::unique_ptr<PanelSink> sink;
+    try
+    {
+        sink.reset( new PanelSink( screen, var.xres, var.yres, fix.line_length,
+                                   format, palette ) );
+    }
+    catch ( ... )
+    {
+        ::munmap( mapped, fix.smem_len );
+        throw;
+    }
+    sink->m_mapped = mapped;
+    sink->m_mappedSize = fix.smem_len;
+    // Where the colour map can't be set, what is written follows the map
+    switch ( fix.visual )
+    {
+    case FB_VISUAL_PSEUDOCOLOR:
+        loadColourMap( fd, palette, device );
+        break;
+    case FB_VISUAL_STATIC_PSEUDOCOLOR:
+        sink->m_values = staticColourValues( fd, var.bits_per_pixel, palette, device );
+        break;
+    case FB_VISUAL_MONO01:
+    case FB_VISUAL_MONO10:
+        sink->m_values = monoValues( palette, fix.visual == FB_VISUAL_MONO01, device );
+        break;
+    default:
+        break;
+    }
+    return sink;
+}
+
+void PanelSink::writeRow( size_t y, const uint8_t* rgb, size_t width )
+{
+    if ( y >= m_height )
+    {
+        throw std::out_of_range( "Row is off the panel" );
+    }
+    width = std::min( width, m_width );
+    uint8_t* dst = m_buffer + y * m_stride;
+    switch ( m_format )
+    {
+    case PanelFormat::Rgb565:
+        for ( size_t x = 0; x < width; ++x, rgb += 3, dst += 2 )
+        {
+            const unsigned word = ( ( rgb[0] & 0xF8 ) << 8 )
+                | ( ( rgb[1] & 0xFC ) << 3 ) | ( rgb[2] >> 3 );
+            dst[0] = static_cast<uint8_t>( word );
+            dst[1] = static_cast<uint8_t>( word >> 8 );
+        }
+        break;
+    case PanelFormat::Rgb888:
+        for ( size_t x = 0; x < width; ++x, rgb += 3, dst += 3 )
+        {
+            dst[0] = rgb[2];
+            dst[1] = rgb[1];
+            dst[2] = rgb[0];
+        }
+        break;
+    case PanelFormat::Xrgb8888:
+        for ( size_t x = 0; x < width; ++x, rgb += 3, dst += 4 )
+        {
+            dst[0] = rgb[2];
+            dst[1] = rgb[1];
+            dst[2] = rgb[0];
+            dst[3] = 0xFF;
+        }
+        break;
+    default:
+    {
+        // Packed a byte at a time, as IndexedImage::fromImage() does. A
+        // last partial byte keeps whatever pixels it has past the edge.
+        const Quantizer& quantizer = m_palette.getQuantizer();
+        const unsigned bits = bitsPerPixel( m_format );
+        unsigned byte = 0;
+        unsigned used = 0;
+        for ( size_t x = 0; x < width; ++x, rgb += 3 )
+        {
+            byte = ( byte << bits )
+                | m_values[ quantizer.nearest( rgb[0], rgb[1], rgb[2] ) ];
+            used += bits;
+            if ( used == 8 )
+            {
+                *dst++ = static_cast<uint8_t>( byte );
+                byte = 0;
+                used = 0;
+            }
+        }
+        if ( used > 0 )
+        {
+            const unsigned keep = 0xFFu >> used;
+            *dst = static_cast<uint8_t>( ( byte << ( 8 - used ) ) | ( *dst & keep ) );
+        }
+        break;
+    }
+    }
+}
+
+void PanelSink::show( const Image& image )
+{
+    if ( image.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "A panel needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "panel.show" );
+    const size_t rows = std::min( m_height, image.getHeight() );
+    for ( size_t y = 0; y < rows; ++y )
+    {
+        writeRow( y, image.getRow( y ), image.getWidth() );
+    }
+}
+
+void PanelSink::show( const Bitmap& bitmap )
+{
+    show( bitmap, { { 0, 0, bitmap.getWidth(), bitmap.getHeight() } } );
+}
+
+void PanelSink::show( const Bitmap& bitmap, const std::vector<DirtyRect>& dirty )
+{
+    if ( bitmap.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "A panel needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "panel.show" );
+    const size_t height = std::min( m_height, bitmap.getHeight() );
+    for ( const DirtyRect& rect : dirty )
+    {
+        const size_t end = std::min( height, rect.y + rect.height );
+        for ( size_t y = rect.y; y < end; ++y )
+        {
+            writeRow( y, bitmap.getRow( y ), bitmap.getWidth() );
+        }
+    }
+}
+
+void PanelSink::show( RowSource& source )
+{
+    if ( source.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "A panel needs an RGB image" );
+    }
+    MARENGO_TRACE_SCOPE( "panel.show" );
+    const size_t rows = std::min( m_height, source.getHeight() - source.getScanline() );
+    for ( size_t y = 0; y < rows; ++y )
+    {
+        writeRow( y, source.next(), source.getWidth() );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Bitmap;
+        class Image;
+        class Palette;
+        class RowSource;
+
+        // Pixel layouts a panel's memory can have. The RGB ones are as DRM
+        // names them: little-endian words, so Rgb565 is a 16 bit word with
+        // red in the top 5 bits, and Xrgb8888 is the bytes B, G, R, 0xFF.
+        // The indexed ones are palette indices packed first pixel in the
+        // top bits, as IndexedImage has them.
+        enum class PanelFormat
+        {
+            Rgb565,
+            Rgb888,
+            Xrgb8888,
+            Indexed1,
+            Indexed2,
+            Indexed4,
+            Indexed8
+        };
+
+        // Bits per pixel of format
+        unsigned bitsPerPixel( PanelFormat format );
+
+        // Part of an image, in pixels, e.g. what changed since the last
+        // frame, for a panel which can refresh just that (as e-ink can)
+        struct DirtyRect
+        {
+            size_t x;
+            size_t y;
+            size_t width;
+            size_t height;
+        };
+
+        // Shows dithered images on a display by writing their pixels
+        // straight into its memory in its own format: a Linux framebuffer
+        // (e.g. /dev/fb0, for an SPI LCD or e-ink panel), mapped into
+        // memory, or a buffer of the caller's (e.g. one an SPI transfer
+        // goes out of). So showing a result is a conversion per pixel,
+        // rather than encoding a JPEG for something else to decode.
+        //
+        // Pixels are RGB rows, as Image and RowSource have them. For the
+        // indexed formats each becomes the index of its nearest palette
+        // entry, which after dithering to the palette is an exact match.
+        // Anything past the panel's edge is cropped.
+        class PanelSink
+        {
+        public:
+            // Writes into height rows of stride bytes at buffer, which the
+            // caller keeps alive. Will throw if a row of width pixels won't
+            // fit in stride, or the palette in an indexed format.
+            PanelSink( uint8_t* buffer, size_t width, size_t height,
+                       size_t stride, PanelFormat format,
+                       const Palette& palette );
+            ~PanelSink();
+
+            PanelSink( const PanelSink& ) = delete;
+            PanelSink& operator=( const PanelSink& ) = delete;
+
+            // Maps a framebuffer device, taking its size and format from
+            // the driver. For one with a colour map, palette is loaded into
+            // it. With a fixed map, each palette colour is written as the
+            // index of that colour in the map, and on a black and white
+            // panel (where palette must have 2 colours at most) the darker
+            // one is written as black, whichever bit that is. Will throw if
+            // the device can't be opened or mapped, has a format not in
+            // PanelFormat, or can't show the palette's colours.
+            static std::unique_ptr<PanelSink> openFramebuffer(
+                const std::string& device, const Palette& palette );
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getStride() const { return m_stride; }
+            PanelFormat getFormat() const { return m_format; }
+
+            // Converts width RGB pixels into row y. Will throw if y is off
+            // the panel.
+            void writeRow( size_t y, const uint8_t* rgb, size_t width );
+
+            // The image (which must be RGB) at the top left corner
+            void show( const Image& image );
+
+            // The same for a bitmap
+            void show( const Bitmap& bitmap );
+
+            // Just the rows of bitmap that dirty covers (whole rows, which
+            // is what packed formats need), leaving the rest of the panel
+            // as it was. Rects are cropped to the panel.
+            void show( const Bitmap& bitmap, const std::vector<DirtyRect>& dirty );
+
+            // Every row source has left, as they come, e.g. from a
+            // DitherSource (see bands.h), so no whole image is ever held
+            void show( RowSource& source );
+
+        private:
+            uint8_t* m_buffer;
+            size_t m_width;
+            size_t m_height;
+            size_t m_stride;
+            PanelFormat m_format;
+            const Palette& m_palette;
+            // For the indexed formats, what is written for each palette
+            // entry: its index, unless a framebuffer's map says otherwise
+            std::vector<uint8_t> m_values;
+            // Only for a mapped framebuffer
+            void* m_mapped = nullptr;
+            size_t m_mappedSize = 0;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,221 @@
+#include "pipeline.h"
+#include "jpeg.h"
+#include "spsc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+double msSince( Clock::time_point start )
+{
+    return std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+}
+
+struct Frame
+{
+    Image image;
+    std::vector<uint8_t> jpeg;
+};
+
+// Waits are usually a frame or so long (a camera at 30 fps, or the slowest
+// stage), far too long to spin through, so after a few yields the waiting
+// thread sleeps and leaves the core to the ones doing work.
+void pause( unsigned& tries )
+{
+    if ( ++tries < 64 )
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+    }
+}
+
+// Blocking versions of tryPush() / tryPop(), timed into waitMs. They give
+// up (returning false) once stop is set.
+bool push( SpscQueue<Frame*>& queue, Frame* frame,
+           const std::atomic<bool>& stop, double& waitMs )
+{
+    if ( queue.tryPush( frame ) )
+    {
+        return true;
+    }
+    const Clock::time_point start = Clock::now();
+    unsigned tries = 0;
+    while ( ! queue.tryPush( frame ) )
+    {
+        if ( stop.load( std::memory_order_relaxed ) )
+        {
+            return false;
+        }
+        pause( tries );
+    }
+    waitMs += msSince( start );
+    return true;
+}
+
+bool pop( SpscQueue<Frame*>& queue, Frame*& frame,
+          const std::atomic<bool>& stop, double& waitMs )
+{
+    if ( queue.tryPop( frame ) )
+    {
+        return true;
+    }
+    const Clock::time_point start = Clock::now();
+    unsigned tries = 0;
+    while ( ! queue.tryPop( frame ) )
+    {
+        if ( stop.load( std::memory_order_relaxed ) )
+        {
+            return false;
+        }
+        pause( tries );
+    }
+    waitMs += msSince( start );
+    return true;
+}
+
+} // namespace
+
+PipelineStats runPipeline(
+    const std::function<bool( Image& frame )>& decode,
+    const Palette& palette, unsigned ditherThreads, int quality,
+    const std::function<void( const std::vector<uint8_t>& jpeg )>& sink,
+    size_t depth,
+    EncodePreset preset
+    )
+{
+    depth = std::max<size_t>( depth, 1 );
+    std::vector<Frame> frames( depth );
+    // Every queue can hold every frame, so pushes only wait on a stop
+    SpscQueue<Frame*> freeFrames( depth );
+    SpscQueue<Frame*> decoded( depth + 1 );
+    SpscQueue<Frame*> dithered( depth + 1 );
+    for ( Frame& frame : frames )
+    {
+        freeFrames.tryPush( &frame );
+    }
+
+    PipelineStats stats;
+    std::atomic<bool> stop{ false };
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    // Runs a stage, and stops the rest if it throws
+    auto guard = [&]( const std::function<void()>& stage )
+        {
+            return [&, stage]()
+                {
+                    try
+                    {
+                        stage();
+                    }
+                    catch ( ... )
+                    {
+                        std::lock_guard<std::mutex> lock( errorMutex );
+                        if ( ! error )
+                        {
+                            error = std::current_exception();
+                        }
+                        stop.store( true );
+                    }
+                };
+        };
+
+    // A null frame marks the end of the stream
+    auto decodeStage = [&]()
+        {
+            StageTiming& timing = stats.decode;
+            for ( ;; )
+            {
+                Frame* frame = nullptr;
+                if ( ! pop( freeFrames, frame, stop, timing.waitMs ) )
+                {
+                    return;
+                }
+                const Clock::time_point start = Clock::now();
+                const bool more = decode( frame->image );
+                timing.busyMs += msSince( start );
+                if ( ! push( decoded, more ? frame : nullptr, stop, timing.waitMs )
+                     || ! more )
+                {
+                    return;
+                }
+            }
+        };
+    auto ditherStage = [&]()
+        {
+            StageTiming& timing = stats.dither;
+            for ( ;; )
+            {
+                Frame* frame = nullptr;
+                if ( ! pop( decoded, frame, stop, timing.waitMs ) )
+                {
+                    return;
+                }
+                if ( frame != nullptr )
+                {
+                    const Clock::time_point start = Clock::now();
+                    frame->image.fsdColor( palette, ditherThreads );
+                    timing.busyMs += msSince( start );
+                }
+                if ( ! push( dithered, frame, stop, timing.waitMs )
+                     || frame == nullptr )
+                {
+                    return;
+                }
+            }
+        };
+    auto encodeStage = [&]()
+        {
+            StageTiming& timing = stats.encode;
+            Encoder encoder( preset );
+            for ( ;; )
+            {
+                Frame* frame = nullptr;
+                if ( ! pop( dithered, frame, stop, timing.waitMs )
+                     || frame == nullptr )
+                {
+                    return;
+                }
+                const Clock::time_point start = Clock::now();
+                encoder.encode( frame->image, frame->jpeg, quality );
+                sink( frame->jpeg );
+                timing.busyMs += msSince( start );
+                ++stats.frames;
+                if ( ! push( freeFrames, frame, stop, timing.waitMs ) )
+                {
+                    return;
+                }
+            }
+        };
+
+    const Clock::time_point start = Clock::now();
+    std::thread decodeThread( guard( decodeStage ) );
+    std::thread ditherThread( guard( ditherStage ) );
+    guard( encodeStage )();
+    decodeThread.join();
+    ditherThread.join();
+    stats.totalMs = msSince( start );
+    if ( error )
+    {
+        std::rethrow_exception( error );
+    }
+    return stats;
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "jpeg.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Palette;
+
+        // Where a pipeline stage's time went, in milliseconds
+        struct StageTiming
+        {
+            double busyMs = 0; // doing its own work
+            double waitMs = 0; // waiting for the stage before or after it
+        };
+
+        struct PipelineStats
+        {
+            size_t frames = 0;
+            double totalMs = 0;
+            StageTiming decode;
+            StageTiming dither;
+            StageTiming encode;
+        };
+
+        // Decodes, dithers (fsdColor) and encodes a stream of frames with
+        // each of the three on its own thread, so one frame can be
+        // decoded while the one before it is dithered and the one before
+        // that encoded. Once it gets going, a frame is done each time the
+        // slowest stage finishes one, rather than each time all three do.
+        //
+        // depth frames (each an Image and a JPEG buffer, reused over and
+        // over) go round in a loop: free -> decode -> dither -> encode ->
+        // free, handed on through SpscQueues. When all of them are in use
+        // the decode stage waits, so nothing piles up if the dither or
+        // encode can't keep up.
+        //
+        // decode( frame ) runs on the decode thread and fills frame in
+        // (e.g. from a Camera through a Decoder), returning false once
+        // there are no more frames. sink( jpeg ) runs on the encode thread
+        // with each finished frame, in order. ditherThreads goes to
+        // fsdColor(). Frames are encoded with preset.
+        //
+        // If any stage throws, the others stop and the exception is
+        // rethrown here once all the threads are done.
+        PipelineStats runPipeline(
+            const std::function<bool( Image& frame )>& decode,
+            const Palette& palette, unsigned ditherThreads, int quality,
+            const std::function<void( const std::vector<uint8_t>& jpeg )>& sink,
+            size_t depth = 3,
+            EncodePreset preset = EncodePreset::Default
+            );
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,218 @@
+#include "preview.h"
+#include "jpeg.h"
+#include "palette.h"
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+double msSince( Clock::time_point start )
+{
+    return std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+}
+
+} // namespace
+
+struct PreviewRunner::State
+{
+    const Palette& palette;
+    Sink preview;
+    Sink full;
+    int quality;
+    LoadOptions previewOptions;
+    LoadOptions fullOptions;
+    unsigned threads;
+
+    // The caller's side
+    Decoder previewDecoder;
+    Encoder previewEncoder{ EncodePreset::Fast };
+    Image previewImage;
+    std::vector<uint8_t> previewJpeg;
+
+    // Shared, under mutex. generation goes up with every frame, so a job
+    // knows it has been overtaken when it no longer matches.
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<uint8_t> pending;
+    bool hasPending = false;
+    bool busy = false;
+    bool stop = false;
+    std::atomic<uint64_t> generation{ 0 };
+    std::exception_ptr error;
+    PreviewStats stats;
+
+    // The background thread's
+    Decoder fullDecoder;
+    Encoder fullEncoder;
+    Image fullImage;
+    std::vector<uint8_t> working;
+    std::vector<uint8_t> fullJpeg;
+    std::thread thread;
+
+    State( const Palette& p, size_t previewWidth, const Sink& previewSink,
+           const Sink& fullSink, const LoadOptions& options, unsigned t, int q,
+           EncodePreset preset )
+        : palette( p )
+        , preview( previewSink )
+        , full( fullSink )
+        , quality( q )
+        , fullOptions( options )
+        , threads( t )
+        , fullEncoder( preset )
+    {
+        previewOptions.targetWidth = previewWidth;
+    }
+
+    void run()
+    {
+        for ( ;; )
+        {
+            uint64_t mine;
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                wake.wait( lock, [this]() { return stop || hasPending; } );
+                if ( stop )
+                {
+                    return;
+                }
+                working.swap( pending );
+                hasPending = false;
+                busy = true;
+                mine = generation.load();
+            }
+            const auto overtaken = [this, mine]()
+                {
+                    return generation.load( std::memory_order_relaxed ) != mine;
+                };
+            const Clock::time_point start = Clock::now();
+            bool done = false;
+            try
+            {
+                MARENGO_TRACE_SCOPE( "preview.full" );
+                fullDecoder.decode( working.data(), working.size(), fullImage,
+                                    fullOptions );
+                if ( ! overtaken() && fullImage.fsdColor( palette, overtaken, threads )
+                     && ! overtaken() )
+                {
+                    fullEncoder.encode( fullImage, fullJpeg, quality );
+                    full( fullJpeg );
+                    done = true;
+                }
+            }
+            catch ( ... )
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock( mutex );
+            busy = false;
+            if ( done )
+            {
+                ++stats.completed;
+                stats.fullMs += msSince( start );
+            }
+            else if ( ! error )
+            {
+                ++stats.cancelled;
+            }
+            idle.notify_all();
+        }
+    }
+
+    void rethrow()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( error )
+        {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception( e );
+        }
+    }
+};
+
+PreviewRunner::PreviewRunner( const Palette& palette, size_t previewWidth,
+                              const Sink& preview, const Sink& full,
+                              const LoadOptions& options, unsigned threads,
+                              int quality, EncodePreset preset )
+    : m_state( new State( palette, previewWidth, preview, full, options, threads,
+                          quality, preset ) )
+{
+    m_state->thread = std::thread( [this]() { m_state->run(); } );
+}
+
+PreviewRunner::~PreviewRunner()
+{
+    {
+        std::lock_guard<std::mutex> lock( m_state->mutex );
+        m_state->stop = true;
+        // so a job in hand stops too
+        ++m_state->generation;
+    }
+    m_state->wake.notify_one();
+    m_state->thread.join();
+}
+
+void PreviewRunner::submit( const uint8_t* data, size_t size )
+{
+    State& s = *m_state;
+    s.rethrow();
+    const Clock::time_point start = Clock::now();
+    {
+        MARENGO_TRACE_SCOPE( "preview.small" );
+        s.previewDecoder.decode( data, size, s.previewImage, s.previewOptions );
+        s.previewImage.fsdColor( s.palette );
+        s.previewEncoder.encode( s.previewImage, s.previewJpeg, s.quality );
+        s.preview( s.previewJpeg );
+    }
+    const double ms = msSince( start );
+
+    {
+        std::lock_guard<std::mutex> lock( s.mutex );
+        ++s.stats.frames;
+        s.stats.previewMs += ms;
+        if ( s.hasPending )
+        {
+            // never got started
+            ++s.stats.cancelled;
+        }
+        s.pending.assign( data, data + size );
+        s.hasPending = true;
+        ++s.generation;
+    }
+    s.wake.notify_one();
+}
+
+void PreviewRunner::finish()
+{
+    State& s = *m_state;
+    {
+        std::unique_lock<std::mutex> lock( s.mutex );
+        s.idle.wait( lock, [&s]() { return ! s.hasPending && ! s.busy; } );
+    }
+    s.rethrow();
+}
+
+PreviewStats PreviewRunner::getStats() const
+{
+    std::lock_guard<std::mutex> lock( m_state->mutex );
+    return m_state->stats;
+}
+
+} // namespace jpeg
+} // namespace marengo
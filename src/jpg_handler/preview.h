@@ -0,0 +1,73 @@
+#pragma once
+
+#include "jpeg.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Palette;
+
+        struct PreviewStats
+        {
+            size_t frames = 0;    // submitted
+            size_t completed = 0; // full size results handed out
+            size_t cancelled = 0; // full size jobs a newer frame replaced
+            double previewMs = 0; // all submit()s, each to its preview's sink
+            double fullMs = 0;    // all completed full size jobs
+        };
+
+        // Two tier output for live capture, so something shows up as soon
+        // as a frame arrives: submit() decodes the frame small (DCT scaled,
+        // then shrink(), see LoadOptions::targetWidth), dithers and encodes
+        // it with EncodePreset::Fast, and hands it to preview before it
+        // returns. The full size decode (with options), fsdColor() on
+        // threads threads (0 for one per core) and encode with preset
+        // happen in the background, and the result goes to full.
+        //
+        // Only the newest frame is worth finishing: a submit() cancels the
+        // full size job still in hand (it stops within a few rows of its
+        // dither), and a frame that was still waiting is simply dropped.
+        //
+        // preview runs on the thread calling submit(), full on the
+        // background one. If the background job throws, the next submit()
+        // or finish() rethrows it.
+        class PreviewRunner
+        {
+        public:
+            using Sink = std::function<void( const std::vector<uint8_t>& jpeg )>;
+
+            PreviewRunner( const Palette& palette, size_t previewWidth,
+                           const Sink& preview, const Sink& full,
+                           const LoadOptions& options = LoadOptions(),
+                           unsigned threads = 1, int quality = 95,
+                           EncodePreset preset = EncodePreset::Default );
+            // Cancels whatever is left and waits for the thread
+            ~PreviewRunner();
+
+            PreviewRunner( const PreviewRunner& ) = delete;
+            PreviewRunner& operator=( const PreviewRunner& ) = delete;
+
+            // data is only read during the call, so can go straight back
+            // (e.g. to the camera) afterwards
+            void submit( const uint8_t* data, size_t size );
+
+            // Waits until the last frame submitted is done at full size
+            void finish();
+
+            PreviewStats getStats() const;
+
+        private:
+            struct State;
+            std::unique_ptr<State> m_state;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
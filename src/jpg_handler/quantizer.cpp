@@ -0,0 +1,167 @@
+#include "quantizer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+constexpr size_t Quantizer::kMaxColours;
+constexpr int Quantizer::kCellBits;
+constexpr size_t Quantizer::kPlaneLanes;
+
+namespace
+{
+
+// Smallest and largest |v - p| for v in [lo, hi]
+void axisRange( int lo, int hi, int p, int32_t& minD, int32_t& maxD )
+{
+    minD = p < lo ? lo - p : ( p > hi ? p - hi : 0 );
+    maxD = std::max( std::abs( lo - p ), std::abs( hi - p ) );
+}
+
+} // namespace
+
+Quantizer::Quantizer( const uint8_t* colours, size_t count )
+    : m_colours( colours, colours + count * 3 )
+    , m_count( count )
+{
+    if ( count == 0 )
+    {
+        throw std::out_of_range( "Palette cannot be empty" );
+    }
+    if ( count > kMaxColours )
+    {
+        throw std::out_of_range( "Too many palette colours" );
+    }
+    MARENGO_TRACE_SCOPE( "quantizer.build" );
+    buildCells();
+
+    // Far enough away that it always loses, yet the distance still
+    // fits an int32 (10 * 10000^2)
+    const int32_t unreachable = 10000;
+    m_paddedCount = ( m_count + kPlaneLanes - 1 ) / kPlaneLanes * kPlaneLanes;
+    m_planes.assign( m_paddedCount * 3, unreachable );
+    for ( size_t i = 0; i < m_count; ++i )
+    {
+        for ( int ch = 0; ch < 3; ++ch )
+        {
+            m_planes[ ch * m_paddedCount + i ] = m_colours[ i * 3 + ch ];
+        }
+        m_words.push_back( m_colours[ i * 3 ]
+                           | ( m_colours[ i * 3 + 1 ] << 8 )
+                           | ( m_colours[ i * 3 + 2 ] << 16 ) );
+    }
+}
+
+void Quantizer::buildCells()
+{
+    const int cellsPerAxis = 1 << kCellBits;
+    const int cellSize = 256 / cellsPerAxis;
+
+    m_cells.assign( cellsPerAxis * cellsPerAxis * cellsPerAxis, 0 );
+    m_candidates.clear();
+
+    std::vector<int32_t> lower( m_count );
+    std::vector<uint8_t> list;
+    list.reserve( m_count );
+
+    for ( int cr = 0; cr < cellsPerAxis; ++cr )
+    {
+        const int rLo = cr * cellSize;
+        const int rHi = rLo + cellSize - 1;
+        for ( int cg = 0; cg < cellsPerAxis; ++cg )
+        {
+            const int gLo = cg * cellSize;
+            const int gHi = gLo + cellSize - 1;
+            for ( int cb = 0; cb < cellsPerAxis; ++cb )
+            {
+                const int bLo = cb * cellSize;
+                const int bHi = bLo + cellSize - 1;
+
+                // Bound each entry's distance over the whole cell. The
+                // redmean weights depend on (r + pr), so if the cell
+                // straddles the switch-over we bound with both sets.
+                int32_t bestUpper = std::numeric_limits<int32_t>::max();
+                for ( size_t i = 0; i < m_count; ++i )
+                {
+                    const uint8_t* c = getColour( i );
+                    int32_t minR, maxR, minG, maxG, minB, maxB;
+                    axisRange( rLo, rHi, c[0], minR, maxR );
+                    axisRange( gLo, gHi, c[1], minG, maxG );
+                    axisRange( bLo, bHi, c[2], minB, maxB );
+
+                    const bool mayBeLow = ( rLo + c[0] ) / 2 < 128;
+                    const bool mayBeHigh = ( rHi + c[0] ) / 2 >= 128;
+                    const int wRmin = mayBeLow ? 2 : 3;
+                    const int wRmax = mayBeHigh ? 3 : 2;
+                    const int wBmin = mayBeHigh ? 2 : 3;
+                    const int wBmax = mayBeLow ? 3 : 2;
+
+                    lower[i] = wRmin * minR * minR + 4 * minG * minG
+                             + wBmin * minB * minB;
+                    const int32_t upper = wRmax * maxR * maxR
+                                        + 4 * maxG * maxG
+                                        + wBmax * maxB * maxB;
+                    bestUpper = std::min( bestUpper, upper );
+                }
+
+                // Anything whose best case is worse than some other
+                // entry's worst case can never be the nearest here.
+                list.clear();
+                for ( size_t i = 0; i < m_count; ++i )
+                {
+                    if ( lower[i] <= bestUpper )
+                    {
+                        list.push_back( static_cast<uint8_t>( i ) );
+                    }
+                }
+
+                uint32_t& cell = m_cells[ ( cr << ( 2 * kCellBits ) )
+                                          | ( cg << kCellBits ) | cb ];
+                if ( list.size() == 1 )
+                {
+                    cell = static_cast<uint32_t>( list[0] ) << 8;
+                }
+                else
+                {
+                    cell = ( static_cast<uint32_t>( m_candidates.size() ) << 8 )
+                         | static_cast<uint32_t>( list.size() - 1 );
+                    m_candidates.insert(
+                        m_candidates.end(), list.begin(), list.end() );
+                }
+            }
+        }
+    }
+}
+
+size_t Quantizer::search( uint32_t cell, uint8_t r, uint8_t g, uint8_t b ) const
+{
+    const uint8_t* cand = &m_candidates[ cell >> 8 ];
+    const size_t count = ( cell & 0xFF ) + 1;
+
+    // Candidates are in ascending palette order, so a strict < keeps
+    // the lowest index on a tie, just as a full search would.
+    size_t best = cand[0];
+    const uint8_t* c = getColour( best );
+    int32_t bestDistance = distance( r, g, b, c[0], c[1], c[2] );
+    for ( size_t n = 1; n < count; ++n )
+    {
+        c = getColour( cand[n] );
+        const int32_t d = distance( r, g, b, c[0], c[1], c[2] );
+        if ( d < bestDistance )
+        {
+            bestDistance = d;
+            best = cand[n];
+        }
+    }
+    return best;
+}
+
+} // namespace jpeg
+} // namespace marengo
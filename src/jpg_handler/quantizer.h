@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Finds the nearest palette entry for an RGB colour, using the
+        // same "redmean" weighted distance fsdColor() has always used.
+        //
+        // Built once per palette and then shared between frames/images.
+        // RGB space is split into 32x32x32 cells (5 bits per channel) and
+        // for each cell we keep only the palette entries which could
+        // possibly win for some colour inside it. Most cells end up with a
+        // single candidate, so the lookup is one table read. The rest do an
+        // exact integer search over their (short) candidate list. There is
+        // no sqrt anywhere, and the answer is always identical to a brute
+        // force search, including which entry wins a tie (the lowest index).
+        class Quantizer
+        {
+        public:
+            static constexpr size_t kMaxColours = 256;
+            static constexpr int kCellBits = 5;
+
+            // colours holds count RGB triplets, back to back.
+            // Will throw if count is zero or larger than kMaxColours.
+            Quantizer( const uint8_t* colours, size_t count );
+
+            size_t size() const { return m_count; }
+
+            // Pointer to the 3 bytes (R, G, B) of a palette entry
+            const uint8_t* getColour( size_t idx ) const
+            {
+                return &m_colours[ idx * 3 ];
+            }
+
+            // Index of the nearest palette entry
+            size_t nearest( uint8_t r, uint8_t g, uint8_t b ) const
+            {
+                const uint32_t cell = m_cells[ cellIndex( r, g, b ) ];
+                if ( ( cell & 0xFF ) == 0 )
+                {   // only one candidate, stored inline
+                    return cell >> 8;
+                }
+                return search( cell, r, g, b );
+            }
+
+            // Just the table read: returns true, and sets idx, when the
+            // colour's cell has a single candidate. Otherwise the caller
+            // has to search (e.g. with a SIMD kernel, over getPlane()).
+            bool lookup( uint8_t r, uint8_t g, uint8_t b, size_t& idx ) const
+            {
+                const uint32_t cell = m_cells[ cellIndex( r, g, b ) ];
+                idx = cell >> 8;
+                return ( cell & 0xFF ) == 0;
+            }
+
+            // The palette again, one channel (0 = R, 1 = G, 2 = B) per
+            // array, as int32. Padded to a multiple of kPlaneLanes entries
+            // with a colour too far away to ever be chosen, so vector code
+            // can always work in whole registers.
+            static constexpr size_t kPlaneLanes = 8;
+            const int32_t* getPlane( int channel ) const
+            {
+                return &m_planes[ channel * m_paddedCount ];
+            }
+            size_t getPaddedSize() const { return m_paddedCount; }
+
+            // Entry idx packed as R | G << 8 | B << 16, which vector code
+            // can move straight into a register
+            uint32_t getColourWord( size_t idx ) const { return m_words[idx]; }
+
+            // The squared redmean distance, as integers. Comparing these
+            // gives the same ordering as comparing their square roots.
+            static int32_t distance(
+                int r, int g, int b, int pr, int pg, int pb )
+            {
+                const int32_t dR = r - pr;
+                const int32_t dG = g - pg;
+                const int32_t dB = b - pb;
+                if ( ( r + pr ) / 2 < 128 )
+                {
+                    return 2 * dR * dR + 4 * dG * dG + 3 * dB * dB;
+                }
+                return 3 * dR * dR + 4 * dG * dG + 2 * dB * dB;
+            }
+
+        private:
+            static size_t cellIndex( uint8_t r, uint8_t g, uint8_t b )
+            {
+                return ( static_cast<size_t>( r >> ( 8 - kCellBits ) ) << ( 2 * kCellBits ) )
+                     | ( static_cast<size_t>( g >> ( 8 - kCellBits ) ) << kCellBits )
+                     | ( b >> ( 8 - kCellBits ) );
+            }
+
+            size_t search( uint32_t cell, uint8_t r, uint8_t g, uint8_t b ) const;
+            void buildCells();
+
+            std::vector<uint8_t> m_colours; // RGB triplets
+            size_t m_count;
+            // Per cell: (candidate count - 1) in the low 8 bits. The upper
+            // bits hold the palette index itself when there is just the one
+            // candidate, otherwise the offset of the list in m_candidates.
+            std::vector<uint32_t> m_cells;
+            std::vector<uint8_t> m_candidates;
+            size_t m_paddedCount;
+            std::vector<int32_t> m_planes;
+            std::vector<uint32_t> m_words;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
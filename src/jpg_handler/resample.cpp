@@ -0,0 +1,225 @@
+#include "resample.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+const double kPi = 3.14159265358979323846;
+
+double support( ResampleFilter filter )
+{
+    switch ( filter )
+    {
+        case ResampleFilter::Box:      return 0.5;
+        case ResampleFilter::Bilinear: return 1.0;
+        case ResampleFilter::Lanczos3: return 3.0;
+    }
+    return 1.0;
+}
+
+double sinc( double x )
+{
+    if ( x == 0.0 )
+    {
+        return 1.0;
+    }
+    x *= kPi;
+    return std::sin( x ) / x;
+}
+
+double weightAt( ResampleFilter filter, double x )
+{
+    switch ( filter )
+    {
+        case ResampleFilter::Box:
+            return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+        case ResampleFilter::Bilinear:
+            return std::max( 0.0, 1.0 - std::fabs( x ) );
+        case ResampleFilter::Lanczos3:
+            return std::fabs( x ) < 3.0 ? sinc( x ) * sinc( x / 3.0 ) : 0.0;
+    }
+    return 0.0;
+}
+
+uint8_t clampByte( int32_t v )
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Resamples each row of src across, to dst's width
+void resampleAcross( const Bitmap& src, Bitmap& dst, const ResampleWeights& table )
+{
+    for ( size_t row = 0; row < src.getHeight(); ++row )
+    {
+        resampleRow( src.getRow( row ), dst.getRow( row ), dst.getWidth(),
+                     src.getPixelSize(), table );
+    }
+}
+
+// Resamples src down, to dst's height, a whole row at a time
+void resampleDown( const Bitmap& src, Bitmap& dst, const ResampleWeights& table )
+{
+    const kernels::Kernels& k = kernels::kernels();
+    std::vector<const uint8_t*> rows( table.taps );
+    for ( size_t y = 0; y < dst.getHeight(); ++y )
+    {
+        for ( size_t t = 0; t < table.taps; ++t )
+        {
+            rows[t] = src.getRow( table.first[y] + t );
+        }
+        k.resampleRows( rows.data(), &table.weights[ y * table.taps ],
+                        table.taps, dst.getRow( y ), dst.getRowSize() );
+    }
+}
+
+} // namespace
+
+ResampleWeights resampleWeights( size_t srcSize, size_t dstSize,
+                                 ResampleFilter filter )
+{
+    const double scale = static_cast<double>( srcSize ) / dstSize;
+    // Shrinking stretches the filter over the source, to take in every
+    // pixel which falls under an output one
+    const double stretch = std::max( scale, 1.0 );
+    const double radius = support( filter ) * stretch;
+
+    ResampleWeights table;
+    table.taps = std::min<size_t>( srcSize, static_cast<size_t>( std::ceil( radius ) ) * 2 + 1 );
+    table.first.resize( dstSize );
+    table.weights.assign( dstSize * table.taps, 0 );
+
+    std::vector<double> w( table.taps );
+    for ( size_t i = 0; i < dstSize; ++i )
+    {
+        // Pixel centres are at +0.5
+        const double centre = ( i + 0.5 ) * scale;
+        const double lo = std::floor( centre - radius );
+        size_t first = lo < 0.0 ? 0 : static_cast<size_t>( lo );
+        first = std::min( first, srcSize - table.taps );
+        table.first[i] = first;
+
+        double sum = 0.0;
+        for ( size_t t = 0; t < table.taps; ++t )
+        {
+            w[t] = weightAt( filter, ( first + t + 0.5 - centre ) / stretch );
+            sum += w[t];
+        }
+        if ( sum == 0.0 )
+        {   // can only happen to the box filter, right in between pixels
+            const size_t nearest = std::min(
+                static_cast<size_t>( centre ), srcSize - 1 ) - first;
+            w[ std::min( nearest, table.taps - 1 ) ] = sum = 1.0;
+        }
+
+        // Round to fixed point, then put whatever rounding lost or gained
+        // onto the biggest weight so they still add up to exactly 1.0
+        int16_t* out = &table.weights[ i * table.taps ];
+        int total = 0;
+        size_t biggest = 0;
+        for ( size_t t = 0; t < table.taps; ++t )
+        {
+            out[t] = static_cast<int16_t>(
+                std::lround( w[t] / sum * ( 1 << kernels::kWeightBits ) ) );
+            total += out[t];
+            if ( std::abs( out[t] ) > std::abs( out[biggest] ) )
+            {
+                biggest = t;
+            }
+        }
+        out[biggest] += ( 1 << kernels::kWeightBits ) - total;
+    }
+    return table;
+}
+
+void resampleRow( const uint8_t* in, uint8_t* out, size_t width,
+                  size_t pixelSize, const ResampleWeights& table )
+{
+    const int32_t half = 1 << ( kernels::kWeightBits - 1 );
+    for ( size_t x = 0; x < width; ++x )
+    {
+        const uint8_t* p = in + table.first[x] * pixelSize;
+        const int16_t* w = &table.weights[ x * table.taps ];
+        if ( pixelSize == 3 )
+        {   // the usual case, with the channels side by side
+            int32_t r = half;
+            int32_t g = half;
+            int32_t b = half;
+            for ( size_t t = 0; t < table.taps; ++t, p += 3 )
+            {
+                r += w[t] * p[0];
+                g += w[t] * p[1];
+                b += w[t] * p[2];
+            }
+            *out++ = clampByte( r >> kernels::kWeightBits );
+            *out++ = clampByte( g >> kernels::kWeightBits );
+            *out++ = clampByte( b >> kernels::kWeightBits );
+            continue;
+        }
+        for ( size_t c = 0; c < pixelSize; ++c )
+        {
+            int32_t sum = half;
+            for ( size_t t = 0; t < table.taps; ++t )
+            {
+                sum += w[t] * p[ t * pixelSize + c ];
+            }
+            *out++ = clampByte( sum >> kernels::kWeightBits );
+        }
+    }
+}
+
+Bitmap resample( const Bitmap& src, size_t width, size_t height,
+                 ResampleFilter filter )
+{
+    if ( width == 0 || height == 0 )
+    {
+        throw std::out_of_range( "Resampled size cannot be zero" );
+    }
+    if ( src.empty() )
+    {
+        throw std::out_of_range( "Cannot resample an empty bitmap" );
+    }
+
+    const ResampleWeights across = resampleWeights( src.getWidth(), width, filter );
+    const ResampleWeights down = resampleWeights( src.getHeight(), height, filter );
+    const size_t pixelSize = src.getPixelSize();
+    Bitmap dst( width, height, pixelSize );
+
+    // The passes can go in either order; the intermediate is the new width
+    // by the old height, or the other way round. Pick whichever does less
+    // work, counting the (scalar) across pass as a few times dearer per
+    // tap than the (vector) down one.
+    const size_t scalarCost = 4;
+    const double acrossFirst =
+        static_cast<double>( src.getHeight() ) * width * across.taps * scalarCost
+        + static_cast<double>( height ) * width * down.taps;
+    const double downFirst =
+        static_cast<double>( height ) * src.getWidth() * down.taps
+        + static_cast<double>( height ) * width * across.taps * scalarCost;
+    if ( acrossFirst <= downFirst )
+    {
+        Bitmap tmp( width, src.getHeight(), pixelSize );
+        resampleAcross( src, tmp, across );
+        resampleDown( tmp, dst, down );
+    }
+    else
+    {
+        Bitmap tmp( src.getWidth(), height, pixelSize );
+        resampleDown( src, tmp, down );
+        resampleAcross( tmp, dst, across );
+    }
+    return dst;
+}
+
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "bitmap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        enum class ResampleFilter
+        {
+            Box,      // averages whole source pixels; nearest when enlarging
+            Bilinear, // a.k.a. triangle
+            Lanczos3  // sharpest, at 6 taps per axis (more when shrinking)
+        };
+
+        // Resamples src to any width x height, aspect ratio included.
+        //
+        // The filter is applied across and down separately, each from a
+        // table of 14 bit fixed point weights worked out once per axis, so
+        // the per-pixel work is integer multiply-adds only. The vertical
+        // pass, a weighted sum of whole rows, uses the SIMD kernels.
+        // When shrinking, the filter is widened to cover every source
+        // pixel, so this doesn't alias the way point sampling does.
+        // Will throw if width or height is zero.
+        Bitmap resample( const Bitmap& src, size_t width, size_t height,
+                         ResampleFilter filter );
+
+        // The pieces resample() is made of, for code which resamples a
+        // row at a time (see bands.h).
+
+        // For each output position along one axis: the first source
+        // position it reads and taps weights from there on. Every output
+        // position reads the same number of taps (the unused ones weigh
+        // 0), so the loops over them need no special cases. first never
+        // goes down from one position to the next.
+        struct ResampleWeights
+        {
+            size_t taps;
+            std::vector<size_t> first;
+            std::vector<int16_t> weights; // taps per output position
+        };
+        ResampleWeights resampleWeights( size_t srcSize, size_t dstSize,
+                                         ResampleFilter filter );
+
+        // One row across, from in to width pixels in out
+        void resampleRow( const uint8_t* in, uint8_t* out, size_t width,
+                          size_t pixelSize, const ResampleWeights& table );
+
+    } // namespace jpeg
+} // namespace marengo
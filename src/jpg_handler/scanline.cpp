@@ -0,0 +1,292 @@
+#include "scanline.h"
+#include "bitmap.h"
+#include "kernels.h"
+#include "palette.h"
+
+#include <cstdio>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+// As in Image: without this libjpeg prints the message and calls exit()
+void throwJpegError( ::j_common_ptr cinfo )
+{
+    char jpegLastErrorMsg[JMSG_LENGTH_MAX];
+    ( *( cinfo->err->format_message ) )( cinfo, jpegLastErrorMsg );
+    throw std::runtime_error( jpegLastErrorMsg );
+}
+
+} // namespace
+
+struct ScanlineReader::State
+{
+    ::jpeg_error_mgr errorMgr;
+    ::jpeg_decompress_struct info;
+    FILE* file = nullptr;
+    bool created = false;
+
+    ~State()
+    {
+        if ( created )
+        {
+            ::jpeg_destroy_decompress( &info );
+        }
+        if ( file != nullptr )
+        {
+            fclose( file );
+        }
+    }
+};
+
+ScanlineReader::ScanlineReader( const std::string& fileName )
+    : m_state( new State )
+{
+    m_state->file = fopen( fileName.c_str(), "rb" );
+    if ( m_state->file == NULL )
+    {
+        throw std::runtime_error( "Could not open " + fileName );
+    }
+    m_state->info.err = ::jpeg_std_error( &m_state->errorMgr );
+    m_state->errorMgr.error_exit = throwJpegError;
+    ::jpeg_create_decompress( &m_state->info );
+    m_state->created = true;
+    ::jpeg_stdio_src( &m_state->info, m_state->file );
+
+    int rc = ::jpeg_read_header( &m_state->info, TRUE );
+    if ( rc != 1 )
+    {
+        throw std::runtime_error(
+            "File does not seem to be a normal JPEG"
+            );
+    }
+    ::jpeg_start_decompress( &m_state->info );
+
+    m_width       = m_state->info.output_width;
+    m_height      = m_state->info.output_height;
+    m_pixelSize   = m_state->info.output_components;
+    m_colourSpace = m_state->info.out_color_space;
+}
+
+ScanlineReader::~ScanlineReader()
+{
+}
+
+size_t ScanlineReader::getScanline() const
+{
+    return m_state->info.output_scanline;
+}
+
+void ScanlineReader::readRow( uint8_t* row )
+{
+    if ( getScanline() >= m_height )
+    {
+        throw std::out_of_range( "Read past the last scanline" );
+    }
+    readRows( &row, 1 );
+}
+
+size_t ScanlineReader::readRows( uint8_t* const* rows, size_t count )
+{
+    count = std::min( count, m_height - getScanline() );
+    size_t done = 0;
+    while ( done < count )
+    {
+        done += ::jpeg_read_scanlines(
+            &m_state->info, const_cast<::JSAMPARRAY>( rows + done ), count - done );
+    }
+    if ( count > 0 && getScanline() == m_height )
+    {
+        ::jpeg_finish_decompress( &m_state->info );
+    }
+    return count;
+}
+
+size_t ScanlineReader::getBatchRows() const
+{
+    return m_state->info.rec_outbuf_height;
+}
+
+struct ScanlineWriter::State
+{
+    ::jpeg_error_mgr errorMgr;
+    ::jpeg_compress_struct info;
+    FILE* file = nullptr;
+    bool created = false;
+
+    ~State()
+    {
+        if ( created )
+        {
+            ::jpeg_destroy_compress( &info );
+        }
+        if ( file != nullptr )
+        {
+            fclose( file );
+        }
+    }
+};
+
+ScanlineWriter::ScanlineWriter( const std::string& fileName,
+                                size_t width, size_t height, size_t pixelSize,
+                                int colourSpace, int quality )
+    : m_state( new State )
+    , m_height( height )
+{
+    quality = std::max( 0, std::min( quality, 100 ) );
+    m_state->file = fopen( fileName.c_str(), "wb" );
+    if ( m_state->file == NULL )
+    {
+        throw std::runtime_error(
+            "Could not open " + fileName + " for writing"
+            );
+    }
+    m_state->info.err = ::jpeg_std_error( &m_state->errorMgr );
+    m_state->errorMgr.error_exit = throwJpegError;
+    ::jpeg_create_compress( &m_state->info );
+    m_state->created = true;
+    ::jpeg_stdio_dest( &m_state->info, m_state->file );
+    m_state->info.image_width = width;
+    m_state->info.image_height = height;
+    m_state->info.input_components = pixelSize;
+    m_state->info.in_color_space = static_cast<::J_COLOR_SPACE>( colourSpace );
+    ::jpeg_set_defaults( &m_state->info );
+    ::jpeg_set_quality( &m_state->info, quality, TRUE );
+    ::jpeg_start_compress( &m_state->info, TRUE );
+}
+
+ScanlineWriter::~ScanlineWriter()
+{
+}
+
+size_t ScanlineWriter::getScanline() const
+{
+    return m_state->info.next_scanline;
+}
+
+void ScanlineWriter::writeRow( const uint8_t* row )
+{
+    writeRows( &row, 1 );
+}
+
+void ScanlineWriter::writeRows( const uint8_t* const* rows, size_t count )
+{
+    if ( count > m_height - getScanline() )
+    {
+        throw std::out_of_range( "Wrote past the last scanline" );
+    }
+    // libjpeg wants non-const pointers but only reads through them
+    ::jpeg_write_scanlines(
+        &m_state->info, const_cast<::JSAMPARRAY>( rows ), count );
+    if ( count > 0 && getScanline() == m_height )
+    {
+        ::jpeg_finish_compress( &m_state->info );
+    }
+}
+
+void fsdColorStream( const std::string& inFile,
+                     const std::string& outFile,
+                     const Palette& palette,
+                     int quality )
+{
+    ScanlineReader reader( inFile );
+    if ( reader.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "fsdColor needs an RGB image" );
+    }
+    const size_t width = reader.getWidth();
+    const size_t height = reader.getHeight();
+    ScanlineWriter writer( outFile, width, height, 3,
+                           reader.getColourSpace(), quality );
+    if ( height == 0 )
+    {
+        return;
+    }
+
+    const Quantizer& quantizer = palette.getQuantizer();
+    const kernels::Kernels& k = kernels::kernels();
+
+    // Rows come in and go out batch rows at a time, the size libjpeg works
+    // in. Row r lives in ring row r % ( batch + 1 ): one extra so the row
+    // after the batch is there to take its error. Bitmap rows come with the
+    // padding the vector kernels need.
+    const size_t batch = std::max<size_t>( reader.getBatchRows(), 1 );
+    const size_t ringRows = batch + 1;
+    Bitmap ring( width, ringRows, 3 );
+    std::vector<uint8_t*> in( batch );
+    std::vector<uint8_t*> out( batch );
+
+    reader.readRow( ring.getRow( 0 ) );
+    for ( size_t first = 0; first < height; first += batch )
+    {
+        const size_t count = std::min( batch, height - first );
+        for ( size_t i = 0; i < count; ++i )
+        {
+            in[i] = ring.getRow( ( first + 1 + i ) % ringRows );
+            out[i] = ring.getRow( ( first + i ) % ringRows );
+        }
+        // the last batch has one row fewer to read
+        reader.readRows( in.data(), count );
+        for ( size_t i = 0; i < count; ++i )
+        {
+            const size_t row = first + i;
+            uint8_t* next = row + 1 < height ? in[i] : nullptr;
+            k.fsdColorRow( out[i], next, width, 0, width, quantizer );
+        }
+        writer.writeRows( out.data(), count );
+    }
+}
+
+void ditherStream( const std::string& inFile,
+                   const std::string& outFile,
+                   const Palette& palette,
+                   Dither method,
+                   Scan scan,
+                   Match match,
+                   int quality )
+{
+    ScanlineReader reader( inFile );
+    if ( reader.getPixelSize() != 3 )
+    {
+        throw std::runtime_error( "dither needs an RGB image" );
+    }
+    const size_t width = reader.getWidth();
+    const size_t height = reader.getHeight();
+    ScanlineWriter writer( outFile, width, height, 3,
+                           reader.getColourSpace(), quality );
+
+    // No error lives in the rows here, so the rows read are left alone and
+    // the dithered ones go to rows of their own
+    RowDitherer ditherer( width, palette, method, scan, match );
+    const size_t batch = std::max<size_t>( reader.getBatchRows(), 1 );
+    Bitmap rows( width, 2 * batch, 3 );
+    std::vector<uint8_t*> in( batch );
+    std::vector<uint8_t*> out( batch );
+    for ( size_t i = 0; i < batch; ++i )
+    {
+        in[i] = rows.getRow( i );
+        out[i] = rows.getRow( batch + i );
+    }
+    for ( size_t first = 0; first < height; first += batch )
+    {
+        const size_t count = std::min( batch, height - first );
+        reader.readRows( in.data(), count );
+        for ( size_t i = 0; i < count; ++i )
+        {
+            ditherer.ditherRow( in[i], out[i] );
+        }
+        writer.writeRows( out.data(), count );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
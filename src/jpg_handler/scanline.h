@@ -0,0 +1,118 @@
+#pragma once
+
+#include "dither.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        class Palette;
+
+        // Decodes a JPEG file one scanline at a time, for when holding
+        // the whole image (as Image does) would take too much memory.
+        // Will throw if the file cannot be opened or isn't a JPEG.
+        class ScanlineReader
+        {
+        public:
+            explicit ScanlineReader( const std::string& fileName );
+            ~ScanlineReader();
+
+            ScanlineReader( const ScanlineReader& ) = delete;
+            ScanlineReader& operator=( const ScanlineReader& ) = delete;
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getPixelSize() const { return m_pixelSize; }
+            int getColourSpace() const { return m_colourSpace; }
+
+            // How many rows have been read so far
+            size_t getScanline() const;
+
+            // Decodes the next row into row, which needs room for
+            // getWidth() * getPixelSize() bytes. Will throw if every row
+            // has already been read.
+            void readRow( uint8_t* row );
+
+            // Decodes up to count rows, one into each of rows[], in as few
+            // libjpeg calls as possible. Returns how many were read: all
+            // count unless that runs past the last row.
+            size_t readRows( uint8_t* const* rows, size_t count );
+
+            // The number of rows libjpeg decodes at a time
+            // (rec_outbuf_height). Batches of a multiple of this many
+            // rows are the cheapest to read.
+            size_t getBatchRows() const;
+
+        private:
+            struct State;
+            std::unique_ptr<State> m_state;
+            size_t m_width;
+            size_t m_height;
+            size_t m_pixelSize;
+            int m_colourSpace;
+        };
+
+        // Encodes a JPEG file one scanline at a time. Rows go in top to
+        // bottom; once the last one is written the file is finished off.
+        // If the writer goes away before then (e.g. because something
+        // threw) the file is left incomplete.
+        class ScanlineWriter
+        {
+        public:
+            // colourSpace is a libjpeg J_COLOR_SPACE, as given by
+            // ScanlineReader::getColourSpace(). quality is clamped to 0-100.
+            ScanlineWriter( const std::string& fileName,
+                            size_t width, size_t height, size_t pixelSize,
+                            int colourSpace, int quality );
+            ~ScanlineWriter();
+
+            ScanlineWriter( const ScanlineWriter& ) = delete;
+            ScanlineWriter& operator=( const ScanlineWriter& ) = delete;
+
+            // How many rows have been written so far
+            size_t getScanline() const;
+
+            // Will throw if every row has already been written
+            void writeRow( const uint8_t* row );
+
+            // Encodes count rows in one libjpeg call. Will throw if that
+            // would go past the last row.
+            void writeRows( const uint8_t* const* rows, size_t count );
+
+        private:
+            struct State;
+            std::unique_ptr<State> m_state;
+            size_t m_height;
+        };
+
+        // Image( inFile ), fsdColor( palette ) and save( outFile, quality )
+        // in one go, giving the same file, but only holding a few rows:
+        // rows are read, dithered into the row below and written straight
+        // out, a libjpeg batch at a time. Memory use depends on the width
+        // only.
+        // Will throw if inFile isn't an RGB JPEG.
+        void fsdColorStream( const std::string& inFile,
+                             const std::string& outFile,
+                             const Palette& palette,
+                             int quality = 95 );
+
+        // The same for any of the dither methods (see dither.h), through
+        // a RowDitherer, so the error stays in its own int16 rows and the
+        // rows read are never written to.
+        // Will throw if inFile isn't an RGB JPEG.
+        void ditherStream( const std::string& inFile,
+                           const std::string& outFile,
+                           const Palette& palette,
+                           Dither method,
+                           Scan scan = Scan::Raster,
+                           Match match = Match::Redmean,
+                           int quality = 95 );
+
+    } // namespace jpeg
+} // namespace marengo
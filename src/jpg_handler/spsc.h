@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // A bounded queue for exactly one thread pushing and one thread
+        // popping, with no locks: each side only writes its own index, and
+        // a release store of it publishes the slot to the other side.
+        // Meant for handing pointers (e.g. frames) between pipeline
+        // stages, so T should be cheap to copy.
+        //
+        // Neither call blocks; a full queue is how a stage finds out the
+        // next one is behind (backpressure), and it is up to the caller
+        // whether to wait.
+        template <typename T>
+        class SpscQueue
+        {
+        public:
+            // One slot is kept empty to tell full from empty
+            explicit SpscQueue( size_t capacity )
+                : m_slots( capacity + 1 )
+            {
+            }
+
+            SpscQueue( const SpscQueue& ) = delete;
+            SpscQueue& operator=( const SpscQueue& ) = delete;
+
+            size_t capacity() const { return m_slots.size() - 1; }
+
+            // Producer only. False if the queue is full.
+            bool tryPush( const T& item )
+            {
+                const size_t tail = m_tail.load( std::memory_order_relaxed );
+                const size_t next = tail + 1 == m_slots.size() ? 0 : tail + 1;
+                if ( next == m_head.load( std::memory_order_acquire ) )
+                {
+                    return false;
+                }
+                m_slots[tail] = item;
+                m_tail.store( next, std::memory_order_release );
+                return true;
+            }
+
+            // Consumer only. False if the queue is empty.
+            bool tryPop( T& item )
+            {
+                const size_t head = m_head.load( std::memory_order_relaxed );
+                if ( head == m_tail.load( std::memory_order_acquire ) )
+                {
+                    return false;
+                }
+                item = m_slots[head];
+                m_head.store( head + 1 == m_slots.size() ? 0 : head + 1,
+                              std::memory_order_release );
+                return true;
+            }
+
+        private:
+            std::vector<T> m_slots;
+            // On separate cache lines, so the two threads don't keep
+            // taking the line off each other
+            alignas( 64 ) std::atomic<size_t> m_head{ 0 }; // next to pop
+            alignas( 64 ) std::atomic<size_t> m_tail{ 0 }; // next to push
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,35 @@
+#include "summedarea.h"
+
+namespace marengo
+{
+namespace jpeg
+{
+
+SummedAreaTable::SummedAreaTable( const Bitmap& bitmap )
+    : m_width( bitmap.getWidth() )
+    , m_height( bitmap.getHeight() )
+    , m_pixelSize( bitmap.getPixelSize() )
+    , m_sums( ( m_width + 1 ) * ( m_height + 1 ) * m_pixelSize, 0 )
+{
+    const size_t rowSums = ( m_width + 1 ) * m_pixelSize;
+    for ( size_t y = 0; y < m_height; ++y )
+    {
+        const uint8_t* src = bitmap.getRow( y );
+        const uint32_t* above = &m_sums[ y * rowSums ];
+        uint32_t* out = &m_sums[ ( y + 1 ) * rowSums ];
+        // Running sum along this row, plus the table entry above
+        for ( size_t c = 0; c < m_pixelSize; ++c )
+        {
+            uint32_t run = 0;
+            for ( size_t x = 0; x < m_width; ++x )
+            {
+                const size_t i = ( x + 1 ) * m_pixelSize + c;
+                run += src[ x * m_pixelSize + c ];
+                out[i] = above[i] + run;
+            }
+        }
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
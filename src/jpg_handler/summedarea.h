@@ -0,0 +1,70 @@
+#pragma once
+
+#include "bitmap.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // A summed-area table (integral image): for every pixel, the sum of
+        // everything above and to the left of it, per channel. After one
+        // pass to build it, the sum or average of any box takes four reads
+        // however big the box.
+        //
+        // Sums are kept as uint32, 4 bytes per channel per pixel. They wrap
+        // on big images, but the wrapping cancels out in box sums, which
+        // are exact for any box smaller than 2^32 / 255 (about 16 million)
+        // pixels.
+        class SummedAreaTable
+        {
+        public:
+            explicit SummedAreaTable( const Bitmap& bitmap );
+
+            size_t getWidth() const { return m_width; }
+            size_t getHeight() const { return m_height; }
+            size_t getPixelSize() const { return m_pixelSize; }
+
+            // Sum of channel c over the w x h box with its top left at
+            // x, y. No bounds checking is done.
+            uint32_t sum( size_t x, size_t y, size_t w, size_t h, size_t c ) const
+            {
+                return at( x + w, y + h, c ) - at( x, y + h, c )
+                     - at( x + w, y, c ) + at( x, y, c );
+            }
+
+            // Per channel average over the box, rounded down. Unused
+            // channels (e.g. 1 and 2 for monochrome) are 0.
+            std::array<uint8_t, 3> average( size_t x, size_t y,
+                                            size_t w, size_t h ) const
+            {
+                std::array<uint8_t, 3> avg{ { 0, 0, 0 } };
+                const size_t area = w * h;
+                for ( size_t c = 0; c < m_pixelSize && c < 3; ++c )
+                {
+                    avg[c] = sum( x, y, w, h, c ) / area;
+                }
+                return avg;
+            }
+
+        private:
+            // The sum above and left of x, y (exclusive). Row and column 0
+            // are all zeros, so there are no edge cases.
+            uint32_t at( size_t x, size_t y, size_t c ) const
+            {
+                return m_sums[ ( y * ( m_width + 1 ) + x ) * m_pixelSize + c ];
+            }
+
+            size_t m_width;
+            size_t m_height;
+            size_t m_pixelSize;
+            std::vector<uint32_t> m_sums;
+        };
+
+    } // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,201 @@
+#include "tjcodec.h"
+
+#include <cstdio>
+#include <jpeglib.h>
+
+#include <stdexcept>
+#include <string>
+
+#ifdef MARENGO_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+namespace marengo
+{
+namespace jpeg
+{
+namespace tj
+{
+
+#ifdef MARENGO_TURBOJPEG
+
+namespace
+{
+
+// A TurboJPEG instance, destroyed with its thread
+class Handle
+{
+public:
+    explicit Handle( int type )
+        : m_handle( ::tj3Init( type ) )
+    {
+        if ( m_handle == nullptr )
+        {
+            throw std::runtime_error( "Could not create a TurboJPEG instance" );
+        }
+    }
+    ~Handle() { ::tj3Destroy( m_handle ); }
+
+    Handle( const Handle& ) = delete;
+    Handle& operator=( const Handle& ) = delete;
+
+    operator ::tjhandle() const { return m_handle; }
+
+    // TurboJPEG returns -1 for warnings too; only errors throw
+    void check( int rc ) const
+    {
+        if ( rc != 0 && ::tj3GetErrorCode( m_handle ) == TJERR_FATAL )
+        {
+            throw std::runtime_error( ::tj3GetErrorStr( m_handle ) );
+        }
+    }
+
+private:
+    ::tjhandle m_handle;
+};
+
+} // namespace
+
+bool available()
+{
+    return true;
+}
+
+void decode( const uint8_t* data, size_t size, size_t targetWidth,
+             bool fastDct, bool fastUpsample, Bitmap& bitmap, int& colourSpace )
+{
+    thread_local Handle handle( TJINIT_DECOMPRESS );
+    handle.check( ::tj3DecompressHeader( handle, data, size ) );
+
+    int pixelFormat = TJPF_RGB;
+    size_t pixelSize = 3;
+    colourSpace = JCS_RGB;
+    switch ( ::tj3Get( handle, TJPARAM_COLORSPACE ) )
+    {
+    case TJCS_GRAY:
+        pixelFormat = TJPF_GRAY;
+        pixelSize = 1;
+        colourSpace = JCS_GRAYSCALE;
+        break;
+    case TJCS_CMYK:
+    case TJCS_YCCK:
+        pixelFormat = TJPF_CMYK;
+        pixelSize = 4;
+        colourSpace = JCS_CMYK;
+        break;
+    default:
+        break;
+    }
+
+    const int width = ::tj3Get( handle, TJPARAM_JPEGWIDTH );
+    const int height = ::tj3Get( handle, TJPARAM_JPEGHEIGHT );
+    ::tjscalingfactor scale = TJUNSCALED;
+    if ( targetWidth > 0 )
+    {
+        for ( int denom = 8; denom > 1; denom /= 2 )
+        {
+            const ::tjscalingfactor f = { 1, denom };
+            if ( static_cast<size_t>( TJSCALED( width, f ) ) >= targetWidth )
+            {
+                scale = f;
+                break;
+            }
+        }
+    }
+    handle.check( ::tj3SetScalingFactor( handle, scale ) );
+    handle.check( ::tj3Set( handle, TJPARAM_FASTDCT, fastDct ? 1 : 0 ) );
+    handle.check( ::tj3Set( handle, TJPARAM_FASTUPSAMPLE, fastUpsample ? 1 : 0 ) );
+
+    const size_t outWidth = TJSCALED( width, scale );
+    const size_t outHeight = TJSCALED( height, scale );
+    if ( bitmap.getWidth() != outWidth || bitmap.getHeight() != outHeight
+         || bitmap.getPixelSize() != pixelSize )
+    {
+        bitmap.reset( outWidth, outHeight, pixelSize );
+    }
+    // Straight into the bitmap, padded rows and all
+    handle.check( ::tj3Decompress8( handle, data, size, bitmap.getData(),
+                                    static_cast<int>( bitmap.getStride() ),
+                                    pixelFormat ) );
+}
+
+void encode( const Bitmap& bitmap, int colourSpace, int quality,
+             std::vector<uint8_t>& buffer )
+{
+    thread_local Handle handle( TJINIT_COMPRESS );
+
+    int pixelFormat;
+    int subsampling;
+    switch ( colourSpace )
+    {
+    case JCS_GRAYSCALE:
+        pixelFormat = TJPF_GRAY;
+        subsampling = TJSAMP_GRAY;
+        break;
+    case JCS_RGB:
+        pixelFormat = TJPF_RGB;
+        subsampling = TJSAMP_420;
+        break;
+    case JCS_CMYK:
+        pixelFormat = TJPF_CMYK;
+        subsampling = TJSAMP_444;
+        break;
+    default:
+        throw std::runtime_error( "TurboJPEG can't encode colour space "
+                                  + std::to_string( colourSpace ) );
+    }
+    handle.check( ::tj3Set( handle, TJPARAM_QUALITY, quality ) );
+    handle.check( ::tj3Set( handle, TJPARAM_SUBSAMP, subsampling ) );
+
+    // Into a buffer big enough for the worst case, which is kept, so the
+    // encoder never has to grow it
+    const size_t worst = ::tj3JPEGBufSize( bitmap.getWidth(), bitmap.getHeight(),
+                                           subsampling );
+    if ( worst == 0 )
+    {
+        throw std::runtime_error( ::tj3GetErrorStr( handle ) );
+    }
+    buffer.resize( worst );
+    unsigned char* out = buffer.data();
+    size_t size = worst;
+    handle.check( ::tj3Set( handle, TJPARAM_NOREALLOC, 1 ) );
+    handle.check( ::tj3Compress8( handle, bitmap.getData(),
+                                  static_cast<int>( bitmap.getWidth() ),
+                                  static_cast<int>( bitmap.getStride() ),
+                                  static_cast<int>( bitmap.getHeight() ),
+                                  pixelFormat, &out, &size ) );
+    buffer.resize( size );
+}
+
+#else
+
+namespace
+{
+
+[[noreturn]] void unavailable()
+{
+    throw std::runtime_error( "This build has no TurboJPEG (make TURBOJPEG=1)" );
+}
+
+} // namespace
+
+bool available()
+{
+    return false;
+}
+
+void decode( const uint8_t*, size_t, size_t, bool, bool, Bitmap&, int& )
+{
+    unavailable();
+}
+
+void encode( const Bitmap&, int, int, std::vector<uint8_t>& )
+{
+    unavailable();
+}
+
+#endif
+
+} // namespace tj
+} // namespace jpeg
+} // namespace marengo
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "bitmap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Image's decode and encode through libjpeg-turbo's TurboJPEG API
+        // (version 3, the tj3 functions), for when Codec::TurboJpeg is
+        // asked for. It is only there in a build with TurboJPEG
+        // (make TURBOJPEG=1); otherwise every call throws.
+        //
+        // Each thread keeps one TurboJPEG decompressor and compressor, made
+        // the first time it needs them.
+        namespace tj
+        {
+
+            // Whether this build has TurboJPEG
+            bool available();
+
+            // Decodes straight into bitmap, which is only reallocated if it
+            // isn't already the right size. Scales, as libjpeg does for
+            // LoadOptions::targetWidth, by the smallest of 1/2, 1/4 and 1/8
+            // that still leaves targetWidth pixels (if it is non-zero).
+            // Sets colourSpace to the libjpeg J_COLOR_SPACE of the pixels.
+            // Will throw if data isn't a JPEG TurboJPEG can decode.
+            void decode( const uint8_t* data, size_t size, size_t targetWidth,
+                         bool fastDct, bool fastUpsample, Bitmap& bitmap,
+                         int& colourSpace );
+
+            // Encodes bitmap, whose pixels are in colourSpace (grayscale,
+            // RGB or CMYK), with libjpeg's default subsampling for it.
+            // buffer ends up the size of the JPEG.
+            void encode( const Bitmap& bitmap, int colourSpace, int quality,
+                         std::vector<uint8_t>& buffer );
+
+        } // namespace tj
+    } // namespace jpeg
+} // namespace marengo
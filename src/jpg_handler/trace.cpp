@@ -0,0 +1,227 @@
+#include "trace.h"
+
+#ifdef MARENGO_TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+namespace trace
+{
+
+namespace
+{
+
+const size_t kMaxEvents = 1000000;
+
+struct Event
+{
+    const char* name;
+    uint64_t start;
+    // A span's length, or a count's value
+    int64_t value;
+    bool isCount;
+};
+
+struct Total
+{
+    uint64_t calls = 0;
+    int64_t total = 0;
+    int64_t max = 0;
+};
+
+// One per thread which has recorded anything. Only that thread adds to it,
+// the mutex is for the dumps, so it is all but never contended.
+struct ThreadLog
+{
+    std::mutex mutex;
+    unsigned id;
+    std::vector<Event> events;
+    std::map<const char*, Total> spans;
+    std::map<const char*, Total> counts;
+};
+
+// Logs outlive their threads, so nothing is lost when a pool finishes
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> logs;
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+ThreadLog& threadLog()
+{
+    thread_local ThreadLog* log = nullptr;
+    if ( log == nullptr )
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock( r.mutex );
+        r.logs.emplace_back( new ThreadLog );
+        log = r.logs.back().get();
+        log->id = static_cast<unsigned>( r.logs.size() );
+    }
+    return *log;
+}
+
+void add( std::map<const char*, Total>& totals, const char* name, int64_t value )
+{
+    Total& t = totals[name];
+    ++t.calls;
+    t.total += value;
+    t.max = std::max( t.max, value );
+}
+
+// Totals are kept per literal address; the same name may have several
+// (one per translation unit), so they are merged by string to report
+void merge( std::map<std::string, Total>& into,
+            const std::map<const char*, Total>& from )
+{
+    for ( const auto& entry : from )
+    {
+        Total& t = into[entry.first];
+        t.calls += entry.second.calls;
+        t.total += entry.second.total;
+        t.max = std::max( t.max, entry.second.max );
+    }
+}
+
+} // namespace
+
+uint64_t now()
+{
+    return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+void record( const char* name, uint64_t start, uint64_t end )
+{
+    ThreadLog& log = threadLog();
+    const int64_t length = static_cast<int64_t>( end - start );
+    std::lock_guard<std::mutex> lock( log.mutex );
+    add( log.spans, name, length );
+    if ( log.events.size() < kMaxEvents )
+    {
+        log.events.push_back( { name, start, length, false } );
+    }
+}
+
+void count( const char* name, int64_t value )
+{
+    ThreadLog& log = threadLog();
+    const uint64_t when = now();
+    std::lock_guard<std::mutex> lock( log.mutex );
+    add( log.counts, name, value );
+    if ( log.events.size() < kMaxEvents )
+    {
+        log.events.push_back( { name, when, value, true } );
+    }
+}
+
+void writeChromeTrace( const std::string& fileName )
+{
+    struct Tagged
+    {
+        Event event;
+        unsigned thread;
+    };
+    std::vector<Tagged> all;
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock( r.mutex );
+        for ( const auto& log : r.logs )
+        {
+            std::lock_guard<std::mutex> logLock( log->mutex );
+            for ( const Event& e : log->events )
+            {
+                all.push_back( { e, log->id } );
+            }
+        }
+    }
+    // Counters are shown as running totals, so they need to be in order
+    std::sort( all.begin(), all.end(),
+               []( const Tagged& a, const Tagged& b )
+               {
+                   return a.event.start < b.event.start;
+               } );
+    const uint64_t origin = all.empty() ? 0 : all.front().event.start;
+
+    std::ofstream ofs( fileName );
+    ofs << std::fixed << std::setprecision( 3 ) << "{\"traceEvents\":[\n";
+    std::map<std::string, int64_t> running;
+    bool first = true;
+    for ( const Tagged& t : all )
+    {
+        const Event& e = t.event;
+        ofs << ( first ? "" : ",\n" ) << "{\"name\":\"" << e.name
+            << "\",\"pid\":1,\"tid\":" << t.thread
+            << ",\"ts\":" << ( e.start - origin ) / 1000.0;
+        if ( e.isCount )
+        {
+            int64_t& total = running[e.name];
+            total += e.value;
+            ofs << ",\"ph\":\"C\",\"args\":{\"value\":" << total << "}}";
+        }
+        else
+        {
+            ofs << ",\"ph\":\"X\",\"dur\":" << e.value / 1000.0 << "}";
+        }
+        first = false;
+    }
+    ofs << "\n]}\n";
+    ofs.close();
+    if ( ! ofs )
+    {
+        throw std::runtime_error( "Could not write " + fileName );
+    }
+}
+
+void writeStats( std::ostream& os )
+{
+    std::map<std::string, Total> spans;
+    std::map<std::string, Total> counts;
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock( r.mutex );
+        for ( const auto& log : r.logs )
+        {
+            std::lock_guard<std::mutex> logLock( log->mutex );
+            merge( spans, log->spans );
+            merge( counts, log->counts );
+        }
+    }
+    os << std::fixed << std::setprecision( 3 );
+    for ( const auto& entry : spans )
+    {
+        const Total& t = entry.second;
+        os << entry.first << ": " << t.calls << " calls, "
+           << t.total / 1e6 << " ms, mean " << t.total / 1e3 / t.calls
+           << " us, max " << t.max / 1e3 << " us\n";
+    }
+    for ( const auto& entry : counts )
+    {
+        os << entry.first << ": " << entry.second.calls << " times, total "
+           << entry.second.total << "\n";
+    }
+}
+
+} // namespace trace
+} // namespace jpeg
+} // namespace marengo
+
+#endif
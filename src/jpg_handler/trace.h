@@ -0,0 +1,84 @@
+#pragma once
+
+// Opt-in instrumentation: scoped timers and counters on the hot paths,
+// which can be dumped as a Chrome trace (chrome://tracing, or Perfetto)
+// or as a table of totals.
+//
+// Unless MARENGO_TRACE is defined (make trace), the macros expand to
+// nothing and their arguments aren't even evaluated, so a normal build
+// is exactly as fast as it was.
+//
+//   MARENGO_TRACE_SCOPE( "decode" );              // times to end of scope
+//   MARENGO_TRACE_COUNT( "bitmap.copied", bytes ); // adds to a counter
+//
+// Names must be string literals (or otherwise live for ever).
+
+#ifdef MARENGO_TRACE
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+        namespace trace
+        {
+
+            // Nanoseconds on the steady clock
+            uint64_t now();
+
+            // A span from start to end on this thread
+            void record( const char* name, uint64_t start, uint64_t end );
+
+            // Adds value to the counter name
+            void count( const char* name, int64_t value );
+
+            class Scope
+            {
+            public:
+                explicit Scope( const char* name )
+                    : m_name( name )
+                    , m_start( now() )
+                {
+                }
+                ~Scope() { record( m_name, m_start, now() ); }
+
+                Scope( const Scope& ) = delete;
+                Scope& operator=( const Scope& ) = delete;
+
+            private:
+                const char* m_name;
+                uint64_t m_start;
+            };
+
+            // Writes everything recorded so far as Chrome trace event JSON:
+            // spans as complete events, one track per thread, and each
+            // counter's running total. Each thread keeps its first million
+            // spans and counts for this; totals are kept for all of them.
+            // Best called once traced work has stopped.
+            // Will throw if the file cannot be written.
+            void writeChromeTrace( const std::string& fileName );
+
+            // Writes calls, total, mean and max time for each span name,
+            // and calls and total for each counter, one per line
+            void writeStats( std::ostream& os );
+
+        } // namespace trace
+    } // namespace jpeg
+} // namespace marengo
+
+#define MARENGO_TRACE_JOIN2( a, b ) a##b
+#define MARENGO_TRACE_JOIN( a, b ) MARENGO_TRACE_JOIN2( a, b )
+#define MARENGO_TRACE_SCOPE( name ) \
+    ::marengo::jpeg::trace::Scope MARENGO_TRACE_JOIN( traceScope, __LINE__ )( name )
+#define MARENGO_TRACE_COUNT( name, value ) \
+    ::marengo::jpeg::trace::count( name, static_cast<int64_t>( value ) )
+
+#else
+
+#define MARENGO_TRACE_SCOPE( name ) ( (void)0 )
+#define MARENGO_TRACE_COUNT( name, value ) ( (void)0 )
+
+#endif
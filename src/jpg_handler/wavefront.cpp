@@ -0,0 +1,216 @@
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+// Pixels per span. Small enough that the next row isn't kept waiting long,
+// big enough that the counters aren't bounced between cores every pixel.
+const size_t kChunk = 128;
+
+// The helper threads and row counters runWavefront() keeps from one call
+// to the next, one set per calling thread, so once they have grown to what
+// a frame needs, later frames neither start threads nor allocate. Helpers
+// sleep on a condition variable in between.
+class Pool
+{
+public:
+    Pool() = default;
+    Pool( const Pool& ) = delete;
+    Pool& operator=( const Pool& ) = delete;
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        for ( auto& thread : m_threads )
+        {
+            thread.join();
+        }
+    }
+
+    static Pool& forThread()
+    {
+        thread_local Pool pool;
+        return pool;
+    }
+
+    // rows counters, all 0
+    std::atomic<size_t>* progress( size_t rows )
+    {
+        if ( rows > m_rows )
+        {
+            m_progress.reset( new std::atomic<size_t>[ rows ] );
+            m_rows = rows;
+        }
+        for ( size_t row = 0; row < rows; ++row )
+        {
+            m_progress[row].store( 0, std::memory_order_relaxed );
+        }
+        return m_progress.get();
+    }
+
+    // job( 0 ) on the calling thread and job( 1 ) to job( threads - 1 ) on
+    // helpers, returning once they have all finished
+    void run( unsigned threads, const std::function<void( unsigned )>& job )
+    {
+        const unsigned helpers = threads - 1;
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            while ( m_threads.size() < helpers )
+            {
+                const unsigned index = static_cast<unsigned>( m_threads.size() );
+                m_threads.emplace_back( [this, index]() { helper( index ); } );
+            }
+            m_job = &job;
+            m_helpers = helpers;
+            m_running = helpers;
+            ++m_round;
+        }
+        m_wake.notify_all();
+        job( 0 );
+        std::unique_lock<std::mutex> lock( m_mutex );
+        m_done.wait( lock, [this]() { return m_running == 0; } );
+        m_job = nullptr;
+    }
+
+private:
+    void helper( unsigned index )
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock( m_mutex );
+        for ( ;; )
+        {
+            m_wake.wait( lock, [&]() { return m_quit || m_round != seen; } );
+            if ( m_quit )
+            {
+                return;
+            }
+            seen = m_round;
+            if ( index >= m_helpers )
+            {
+                // Not needed this time
+                continue;
+            }
+            const std::function<void( unsigned )>& job = *m_job;
+            lock.unlock();
+            job( index + 1 );
+            lock.lock();
+            if ( --m_running == 0 )
+            {
+                m_done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    // This round's, under m_mutex: the job, how many helpers it wants and
+    // how many of those are still on it
+    const std::function<void( unsigned )>* m_job = nullptr;
+    unsigned m_helpers = 0;
+    unsigned m_running = 0;
+    uint64_t m_round = 0;
+    bool m_quit = false;
+    std::unique_ptr<std::atomic<size_t>[]> m_progress;
+    size_t m_rows = 0;
+};
+
+} // namespace
+
+void runWavefront(
+    size_t rows, size_t width, size_t lead, unsigned threads,
+    const std::function<void( size_t row, size_t begin, size_t end )>& work
+    )
+{
+    runWavefront( rows, width, lead, threads, work, std::function<bool()>() );
+}
+
+bool runWavefront(
+    size_t rows, size_t width, size_t lead, unsigned threads,
+    const std::function<void( size_t row, size_t begin, size_t end )>& work,
+    const std::function<bool()>& stop
+    )
+{
+    if ( threads > rows )
+    {
+        threads = static_cast<unsigned>( rows );
+    }
+    if ( threads <= 1 )
+    {
+        for ( size_t row = 0; row < rows; ++row )
+        {
+            if ( stop && stop() )
+            {
+                return false;
+            }
+            work( row, 0, width );
+        }
+        return true;
+    }
+
+    // progress[r] is how many pixels of row r are done
+    Pool& pool = Pool::forThread();
+    std::atomic<size_t>* progress = pool.progress( rows );
+    // Set by whichever thread stop() first says stop to; the others see
+    // it at their next row, or while waiting for the row above, which
+    // may never now get any further
+    std::atomic<bool> stopped( false );
+
+    auto worker = [&]( unsigned first )
+    {
+        for ( size_t row = first; row < rows; row += threads )
+        {
+            if ( stopped.load( std::memory_order_relaxed ) || ( stop && stop() ) )
+            {
+                stopped.store( true, std::memory_order_relaxed );
+                return;
+            }
+            for ( size_t begin = 0; begin < width; )
+            {
+                const size_t end = std::min( begin + kChunk, width );
+                if ( row > 0 )
+                {
+                    const size_t needed = std::min( end + lead, width );
+                    while ( progress[ row - 1 ].load( std::memory_order_acquire ) < needed )
+                    {
+                        if ( stopped.load( std::memory_order_relaxed ) )
+                        {
+                            return;
+                        }
+                        std::this_thread::yield();
+                    }
+                }
+                work( row, begin, end );
+                progress[row].store( end, std::memory_order_release );
+                begin = end;
+            }
+        }
+    };
+
+    // By reference, so the std::function doesn't allocate a copy
+    pool.run( threads, std::ref( worker ) );
+    return ! stopped.load( std::memory_order_relaxed );
+}
+
+} // namespace jpeg
+} // namespace marengo
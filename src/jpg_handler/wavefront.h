@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Runs an error diffusion style pass over rows x width pixels on
+        // several threads at once, as a diagonal wavefront.
+        //
+        // Row r can't finish a pixel until the row above has finished with
+        // the pixels it spills error into, so rows are dealt out to the
+        // threads round-robin and each one works along its row in chunks,
+        // keeping lead pixels behind the row above. Each row publishes how
+        // far it has got through an atomic counter, which is all the
+        // synchronisation there is: no locks, and a thread that gets ahead
+        // just yields until the row above catches up.
+        //
+        // work( row, begin, end ) must process pixels [begin, end) of a row.
+        // It is called with increasing, non-overlapping spans for each row
+        // and, by the time it is called, the row above has done at least
+        // min( end + lead, width ) pixels. Pixels of a row further right
+        // than that may still be being written by the row above.
+        //
+        // threads <= 1 just runs every row in order on the calling thread.
+        // Otherwise the calling thread is one of them, and the others are
+        // kept, asleep, for its next call, along with the row counters, so
+        // frames after the first don't start threads or allocate. work
+        // must not throw.
+        void runWavefront(
+            size_t rows, size_t width, size_t lead, unsigned threads,
+            const std::function<void( size_t row, size_t begin, size_t end )>& work
+            );
+
+        // The same, asking stop() before each row whether to carry on. Once
+        // it says not to, every thread finishes the span it is on and
+        // returns false, leaving the rows part done. stop() is called on
+        // all of the threads, so must be safe to call from several at once.
+        // An empty stop never stops.
+        bool runWavefront(
+            size_t rows, size_t width, size_t lead, unsigned threads,
+            const std::function<void( size_t row, size_t begin, size_t end )>& work,
+            const std::function<bool()>& stop
+            );
+
+    } // namespace jpeg
+} // namespace marengo
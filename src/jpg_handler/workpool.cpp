@@ -0,0 +1,147 @@
+#include "workpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace marengo
+{
+namespace jpeg
+{
+
+namespace
+{
+
+// The tasks [begin, end) a worker still has. The owner and thieves both
+// go through the lock, but each only holds it for a few instructions, and
+// the owner's is almost never contended.
+struct Range
+{
+    std::mutex mutex;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+} // namespace
+
+unsigned workerCount( size_t tasks, unsigned threads )
+{
+    if ( threads == 0 )
+    {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+    return static_cast<unsigned>( std::max<size_t>( 1, std::min<size_t>( threads, tasks ) ) );
+}
+
+void runWorkStealing(
+    size_t tasks, unsigned threads,
+    const std::function<void( unsigned worker, size_t task )>& work
+    )
+{
+    if ( tasks == 0 )
+    {
+        return;
+    }
+    threads = workerCount( tasks, threads );
+
+    std::unique_ptr<Range[]> ranges( new Range[ threads ] );
+    for ( unsigned t = 0; t < threads; ++t )
+    {
+        ranges[t].begin = tasks * t / threads;
+        ranges[t].end = tasks * ( t + 1 ) / threads;
+    }
+
+    std::atomic<bool> stop{ false };
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    // The next task of our own, or false if we have none left
+    const auto takeOwn = [&]( unsigned self, size_t& task )
+        {
+            std::lock_guard<std::mutex> lock( ranges[self].mutex );
+            if ( ranges[self].begin == ranges[self].end )
+            {
+                return false;
+            }
+            task = ranges[self].begin++;
+            return true;
+        };
+    // Moves the back half of someone else's tasks over to us
+    const auto steal = [&]( unsigned self )
+        {
+            for ( unsigned n = 1; n < threads; ++n )
+            {
+                Range& victim = ranges[ ( self + n ) % threads ];
+                size_t begin;
+                size_t end;
+                {
+                    std::lock_guard<std::mutex> lock( victim.mutex );
+                    const size_t left = victim.end - victim.begin;
+                    if ( left == 0 )
+                    {
+                        continue;
+                    }
+                    end = victim.end;
+                    begin = end - ( left + 1 ) / 2;
+                    victim.end = begin;
+                }
+                std::lock_guard<std::mutex> lock( ranges[self].mutex );
+                ranges[self].begin = begin;
+                ranges[self].end = end;
+                return true;
+            }
+            return false;
+        };
+    const auto worker = [&]( unsigned self )
+        {
+            try
+            {
+                size_t task;
+                while ( ! stop.load( std::memory_order_relaxed ) )
+                {
+                    if ( takeOwn( self, task ) )
+                    {
+                        work( self, task );
+                    }
+                    else if ( ! steal( self ) )
+                    {
+                        // Everything is taken; what's being worked on
+                        // can't be stolen, so we're done
+                        return;
+                    }
+                }
+            }
+            catch ( ... )
+            {
+                std::lock_guard<std::mutex> lock( errorMutex );
+                if ( ! error )
+                {
+                    error = std::current_exception();
+                }
+                stop.store( true );
+            }
+        };
+
+    std::vector<std::thread> pool;
+    pool.reserve( threads - 1 );
+    for ( unsigned t = 1; t < threads; ++t )
+    {
+        pool.emplace_back( worker, t );
+    }
+    worker( 0 );
+    for ( auto& thread : pool )
+    {
+        thread.join();
+    }
+    if ( error )
+    {
+        std::rethrow_exception( error );
+    }
+}
+
+} // namespace jpeg
+} // namespace marengo
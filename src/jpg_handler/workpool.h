@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace marengo
+{
+    namespace jpeg
+    {
+
+        // Runs work( worker, task ) for every task in [0, tasks) on threads
+        // threads (0 for one per core), for jobs which take very different
+        // times, like files of different sizes.
+        //
+        // Each worker starts with an equal, contiguous share of the tasks
+        // and works through it from the front. One that runs out steals
+        // the back half of whatever another worker has left, so nobody
+        // sits idle while there is work queued anywhere, and stealing is
+        // rare: a few times per worker rather than once per task.
+        //
+        // worker is in [0, threads), so work can keep per-thread state
+        // (decoders, buffers) in an array indexed by it. If work throws,
+        // the remaining tasks are dropped and the first exception is
+        // rethrown once every thread has stopped.
+        void runWorkStealing(
+            size_t tasks, unsigned threads,
+            const std::function<void( unsigned worker, size_t task )>& work
+            );
+
+        // The number of workers runWorkStealing() will use for threads
+        unsigned workerCount( size_t tasks, unsigned threads );
+
+    } // namespace jpeg
+} // namespace marengo